@@ -1,3 +1,6 @@
+#if defined (__linux__) && !defined (_GNU_SOURCE)
+#  define _GNU_SOURCE		/* statx(2) */
+#endif
 #include "fmd.h"
 #include "fmd_priv.h"
 
@@ -11,6 +14,13 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#if defined (__linux__)
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <sys/sysmacros.h>
+#  include <linux/fiemap.h>
+#  include <linux/fs.h>
+#endif
 
 const char *fmd_filetype[] = {
 	"file",
@@ -52,6 +62,7 @@ const char *fmd_elemtype[] = {
 	"focal_length35",
 
 	"other",
+	"digest",
 };
 const char *fmd_datatype[] = {
 	"n",
@@ -162,11 +173,90 @@ fmd_print_file(const struct FmdFile *file,
 }
 
 
+/* Marks |file| as a directory, if it is one */
+static void
+fmdp_set_filetype(struct FmdFile *file)
+{
+	if (S_ISDIR(file->stat.st_mode)) {
+		file->filetype = fmdft_directory;
+		file->mimetype = 0;
+	}
+}
+
+
+#if defined (STATX_TYPE)
+unsigned
+fmdp_statx_mask(const struct FmdScanJob *job)
+{
+	/* Probing needs size and mtime, hard links -- ino and nlink */
+	if ((job->flags & fmdsf_lazystat) == fmdsf_lazystat)
+		return STATX_TYPE | STATX_MODE | STATX_NLINK |
+			STATX_INO | STATX_SIZE | STATX_MTIME;
+	return STATX_BASIC_STATS;
+}
+
+
+void
+fmdp_statx_to_stat(const struct statx *stx,
+		   struct stat *st)
+{
+	memset(st, 0, sizeof *st);
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+#endif
+
+
 static int
-fmd_scan_file(struct FmdScanJob *job,
-	      int dirfd,
-	      const char *path,
-	      struct FmdFile **info)
+fmdp_fstatat(struct FmdScanJob *job,
+	     int dirfd,
+	     struct FmdFile *file)
+{
+	int stflags = 0;	/* AT_SYMLINK_NOFOLLOW? */
+	const char *name = dirfd != AT_FDCWD ? file->name : file->path;
+	const char *func = "fstatat";
+	int res;
+	++job->n_stats;
+#if defined (STATX_TYPE)
+	if ((job->flags & fmdsf_lazystat) == fmdsf_lazystat) {
+		struct statx stx;
+		func = "statx";
+		res = statx(dirfd, name, stflags, fmdp_statx_mask(job), &stx);
+		if (res == 0)
+			fmdp_statx_to_stat(&stx, &file->stat);
+	} else
+#endif
+		res = fstatat(dirfd, name, &file->stat, stflags);
+	if (res != 0) {
+		job->log(job, file->path, fmdlt_oserr, "%s(%s): %s",
+			 func, file->path, strerror(errno));
+		FMDP_X(res);
+		return res;
+	}
+	fmdp_set_filetype(file);
+	return 0;
+}
+
+
+int
+fmdp_stat_file(struct FmdScanJob *job,
+	       int dirfd,
+	       const char *path,
+	       struct FmdFile **info)
 {
 	assert(job);
 	assert(path);
@@ -178,40 +268,245 @@ fmd_scan_file(struct FmdScanJob *job,
 	if (!file)
 		return -1;
 
-	int stflags = 0;	/* AT_SYMLINK_NOFOLLOW? */
-	int res = fstatat(dirfd, dirfd != AT_FDCWD ? file->name : file->path,
-			  &file->stat, stflags);
+	int res = fmdp_fstatat(job, dirfd, file);
 	if (res != 0) {
-		job->log(job, path, fmdlt_oserr, "%s(%s): %s",
-			 "fstatat", path, strerror(errno));
-		free(file);
-		FMDP_X(res);
+		fmd_free(file);
 		return res;
 	}
 
-	const int is_dir = S_ISDIR(file->stat.st_mode);
-	if (is_dir) {
-		file->filetype = fmdft_directory;
-		file->mimetype = 0;
-	}
-
 	*info = file;
-	if (!is_dir && (job->flags & fmdsf_metadata) == fmdsf_metadata)
-		return fmdp_probe_file(job, dirfd, file), 0;
 	return 0;
 }
 
 
+/* Stats |list| entries starting at |from|, that have no |st_mode|
+ * yet; drops ones that fail, and returns -1 then */
 static int
-fmd_scan_hier(struct FmdScanJob *job,
-	      int parent_dirfd,
+fmdp_stat_entries(struct FmdScanJob *job,
+		  int dirfd,
+		  struct FmdDirList *list,
+		  size_t from)
+{
+	const size_t n = list->n;
+	size_t i = from, k;
+	if (fmdp_uring_stat(job, dirfd, list, &i) != 0) {
+		/* Stat the rest one by one */
+		for (k = i; i < list->n; ++i) {
+			if (list->entries[i]->stat.st_mode != 0 ||
+			    fmdp_fstatat(job, dirfd, list->entries[i]) == 0)
+				list->entries[k++] = list->entries[i];
+			else
+				fmd_free(list->entries[i]);
+		}
+		list->n = k;
+	}
+	for (i = from; i < list->n; ++i)
+		fmdp_set_filetype(list->entries[i]);
+	return list->n < n ? -1 : 0;
+}
+
+
+static int
+fmd_scan_file(struct FmdScanJob *job,
+	      int dirfd,
 	      const char *path,
 	      struct FmdFile **info)
+{
+	*info = 0;
+	if (job->begin && job->begin(job, path) != 0)
+		return 0;
+
+	struct FmdFile *file;
+	int res = fmdp_stat_file(job, dirfd, path, &file);
+	if (res == 0) {
+		fmdp_probe_entries(job, dirfd, &file, 1);
+		fmdp_emit(job, &info, file, /*hold*/0);
+	}
+	return res;
+}
+
+
+DIR*
+fmdp_open_dir(struct FmdScanJob *job,
+	      int parent_dirfd,
+	      const char *name,
+	      const char *path)
 {
 	assert(job);
+	assert(name);
 	assert(path);
-	assert(info);
-	if (!job || !path || !info)
+
+	int dirfd = fmdp_openat(job, parent_dirfd, name,
+				O_RDONLY | O_DIRECTORY);
+	if (dirfd == -1) {
+		job->log(job, path, fmdlt_oserr, "%s(%s): %s",
+			 "openat", path, strerror(errno));
+		FMDP_X(-1);
+		return 0;
+	}
+	++job->n_filopens;
+	DIR *dirp = fdopendir(dirfd);
+	if (!dirp) {
+		job->log(job, path, fmdlt_oserr, "%s(%s): %s",
+			 "fdopendir", path, strerror(errno));
+		close(dirfd);	/* could lose errno */
+		FMDP_X(-1);
+		return 0;
+	}
+	++job->n_diropens;
+	return dirp;
+}
+
+
+int
+fmdp_dir_list_add(struct FmdDirList *list,
+		  struct FmdFile *file)
+{
+	if (list->n == list->cap) {
+		size_t cap = list->cap ? list->cap * 2 : 64;
+		struct FmdFile **entries = (struct FmdFile**)
+			realloc(list->entries, cap * sizeof *entries);
+		if (!entries)
+			return -1;
+		list->entries = entries;
+		list->cap = cap;
+	}
+	list->entries[list->n++] = file;
+	return 0;
+}
+
+
+/* Reads directory entries; with fmdsf_lazystat, in large
+ * getdents64(2) batches, where available */
+struct FmdDirReader {
+	DIR *dirp;
+	char *buf;		/* getdents64(2) buffer or 0 for readdir(3) */
+	size_t pos, len;
+	int err;		/* errno, if listing stopped short */
+};
+
+#if defined (__linux__) && defined (SYS_getdents64)
+struct FmdDirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+
+static void
+fmdp_dir_reader_init(struct FmdScanJob *job,
+		     DIR *dirp,
+		     struct FmdDirReader *rd)
+{
+	rd->dirp = dirp;
+	rd->buf = 0;
+	rd->pos = rd->len = 0;
+	rd->err = 0;
+#if defined (__linux__) && defined (SYS_getdents64)
+	if ((job->flags & fmdsf_lazystat) == fmdsf_lazystat) {
+		/* Falls back to readdir(3), if cannot allocate */
+		if (!job->priv->dents)
+			job->priv->dents = (char*)malloc(FMDP_DIRENT_BUF_SZ);
+		rd->buf = job->priv->dents;
+	}
+#else
+	(void)job;
+#endif
+}
+
+
+/* Returns name of the next entry and its d_type, or 0 at the end, or
+ * on error, kept in |rd->err| */
+static const char*
+fmdp_dir_reader_next(struct FmdDirReader *rd,
+		     unsigned char *type,
+		     ino_t *ino)
+{
+#if defined (__linux__) && defined (SYS_getdents64)
+	if (rd->buf) {
+		if (rd->pos == rd->len) {
+			long res = syscall(SYS_getdents64, dirfd(rd->dirp),
+					   rd->buf, (size_t)FMDP_DIRENT_BUF_SZ);
+			if (res < 0)
+				rd->err = errno;
+			if (res <= 0)
+				return 0;
+			rd->pos = 0;
+			rd->len = (size_t)res;
+		}
+		const struct FmdDirent64 *entry =
+			(const struct FmdDirent64*)(rd->buf + rd->pos);
+		rd->pos += entry->d_reclen;
+		*type = entry->d_type;
+		*ino = (ino_t)entry->d_ino;
+		return entry->d_name;
+	}
+#endif
+	errno = 0;
+	struct dirent *entry = readdir(rd->dirp);
+	if (!entry) {
+		rd->err = errno;
+		return 0;
+	}
+#if defined (DTTOIF)
+	*type = entry->d_type;
+#else
+	*type = 0;
+#endif
+	*ino = entry->d_ino;
+	return entry->d_name;
+}
+
+
+/* Takes |file| type from its directory entry, if fmdsf_lazystat
+ * allows to go without stat'ing it; returns 0 then */
+static int
+fmdp_dirent_typed(struct FmdScanJob *job,
+		  struct FmdFile *file,
+		  unsigned char type,
+		  ino_t ino)
+{
+#if defined (DTTOIF)
+	if ((job->flags & fmdsf_lazystat) != fmdsf_lazystat)
+		return -1;
+	/* Symbolic links are followed, so their type is unknown */
+	if (type == DT_UNKNOWN || type == DT_LNK)
+		return -1;
+	/* Regular files to be probed need their size and mtime, and
+	 * those filtered by size -- their size */
+	if (type == DT_REG &&
+	    ((job->flags & fmdsf_metadata) == fmdsf_metadata ||
+	     fmdp_filter_sized(job)))
+		return -1;
+	/* Snapshots are looked up by directory's mtime */
+	if (type == DT_DIR &&
+	    (job->flags & fmdsf_prune) == fmdsf_prune && job->cache)
+		return -1;
+	file->stat.st_mode = DTTOIF(type);
+	file->stat.st_ino = ino;
+	fmdp_set_filetype(file);
+	return 0;
+#else
+	(void)job; (void)file; (void)type; (void)ino;
+	return -1;
+#endif
+}
+
+
+int
+fmdp_list_dir(struct FmdScanJob *job,
+	      DIR *dirp,
+	      const char *path,
+	      struct FmdDirList *list)
+{
+	assert(job);
+	assert(dirp);
+	assert(path);
+	assert(list);
+	if (!job || !dirp || !path || !list)
 		return (errno = EINVAL), -1;
 
 	/* XXX: add up statistics to keep track of errors */
@@ -226,86 +521,506 @@ fmd_scan_hier(struct FmdScanJob *job,
 		return -1;
 	}
 
-	int dirfd = openat(parent_dirfd, path, O_RDONLY | O_DIRECTORY);
-	if (dirfd == -1) {
+	const int fd = dirfd(dirp);
+	/* With io_uring, entries are stat'ed in batches, once all of
+	 * their names are known */
+	const int batched = fmdp_uring_ready(job);
+	const size_t from = list->n;
+	int unstated = 0, res = 0;
+	/* Snapshots keep entries filtered out, as filters may change;
+	 * with fmdsf_prune, entries are filtered, and passed to
+	 * |job->begin|, after being listed */
+	const int snapped =
+		(job->flags & fmdsf_prune) == fmdsf_prune && job->cache;
+	const int filtered = job->priv->filter && !snapped;
+	int refilter = 0;
+	char fullpath[fullpath_sz];
+	strcpy(fullpath, path);
+	fullpath[path_len - 1] = '/';
+
+	struct FmdDirReader rd;
+	fmdp_dir_reader_init(job, dirp, &rd);
+	const char *name;
+	unsigned char type;
+	ino_t ino;
+	while ((name = fmdp_dir_reader_next(&rd, &type, &ino)) != NULL) {
+		size_t len = strlen(name);
+		if (path_len + len + 1 >= sizeof fullpath)
+			continue; /* path too long */
+		if (name[0] == '.' &&
+		    (name[1] == '\0' ||
+		     (name[1] == '.' && name[2] == '\0')))
+			continue; /* omit . and .. */
+
+		strcpy(fullpath + path_len, name);
+		if (filtered) {
+			const int skip = fmdp_filter_name(job, fullpath,
+							  name, type);
+			if (skip == 1)
+				continue;
+			if (skip == -1)
+				refilter = 1;
+		}
+		if (!snapped && job->begin && job->begin(job, fullpath) != 0)
+			continue;
+		struct FmdFile *file = fmdp_file_new(job, fullpath);
+		if (!file) {
+			res = 1;
+			continue; /* XXX: keep track of errors */
+		}
+		if (fmdp_dirent_typed(job, file, type, ino) == 0)
+			;
+		else if (batched)
+			unstated = 1;
+		else if (fmdp_fstatat(job, fd, file) != 0) {
+			fmd_free(file);
+			res = 1;
+			continue;
+		}
+		if (fmdp_dir_list_add(list, file) != 0) {
+			job->log(job, path, fmdlt_oserr, "%s(%s): %s",
+				 "realloc", path, strerror(ENOMEM));
+			fmd_free(file);
+			FMDP_X(-1);
+			return (errno = ENOMEM), -1;
+		}
+	}
+	if (rd.err) {
 		job->log(job, path, fmdlt_oserr, "%s(%s): %s",
-			 "openat", path, strerror(errno));
-		FMDP_X(-1);
-		return -1;
+			 "readdir", path, strerror(rd.err));
+		res = 1;
 	}
+	if (unstated && fmdp_stat_entries(job, fd, list, from) != 0)
+		res = 1;
+	if (refilter)
+		fmdp_filter_list(job, list, from);
+	return res;
+}
+
+
+struct FmdProbeKey {
+	uint64_t key;
+	struct FmdFile *file;
+	size_t index;
+};
+
+static int
+fmdp_probe_key_cmp(const void *a, const void *b)
+{
+	const struct FmdProbeKey *ka = (const struct FmdProbeKey*)a;
+	const struct FmdProbeKey *kb = (const struct FmdProbeKey*)b;
+	if (ka->key != kb->key)
+		return ka->key < kb->key ? -1 : 1;
+	return ka->index < kb->index ? -1 : ka->index > kb->index;
+}
+
+/* Returns physical offset of 1st extent of |file|, 0 if it has none
+ * (empty, inline), or -1 if file system cannot tell */
+static int64_t
+fmdp_first_extent(struct FmdScanJob *job,
+		  int dirfd, const struct FmdFile *file)
+{
+#if defined (FS_IOC_FIEMAP)
+	int fd = fmdp_openat(job, dirfd,
+			     dirfd != AT_FDCWD ? file->name : file->path,
+			     O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
 	++job->n_filopens;
-	DIR *dirp = fdopendir(dirfd);
-	if (!dirp) {
-		job->log(job, path, fmdlt_oserr, "%s(%s): %s",
-			 "fdopendir", path, strerror(errno));
-		close(dirfd);	/* could lose errno */
-		FMDP_X(-1);
+	struct {
+		struct fiemap map;
+		struct fiemap_extent extent;
+	} fm;
+	memset(&fm, 0, sizeof fm);
+	fm.map.fm_length = FIEMAP_MAX_OFFSET;
+	fm.map.fm_extent_count = 1;
+	const int res = ioctl(fd, FS_IOC_FIEMAP, &fm.map);
+	close(fd);
+	if (res == -1)
 		return -1;
+	return fm.map.fm_mapped_extents ? (int64_t)fm.extent.fe_physical : 0;
+#else
+	(void)job; (void)dirfd; (void)file;
+	return -1;
+#endif
+}
+
+/* Returns |n| entries, that are worth probing, in |job->probe_order|
+ * as |*pn| ones; or 0, if they go as listed. Free it with free(3) */
+static struct FmdFile**
+fmdp_probe_order(struct FmdScanJob *job,
+		 int dirfd,
+		 struct FmdFile **entries,
+		 size_t n,
+		 size_t *pn)
+{
+	unsigned order = job->probe_order;
+	if (order == fmdpo_readdir || n < 2)
+		return 0;
+
+	struct FmdProbeKey *keys =
+		(struct FmdProbeKey*)malloc(n * sizeof *keys);
+	if (!keys)
+		return 0;
+	size_t i, k = 0;
+	for (i = 0; i < n; ++i)
+		if (entries[i]->filetype != fmdft_directory &&
+		    entries[i]->stat.st_size >= FMDP_MIN_PROBED(job)) {
+			keys[k].file = entries[i];
+			keys[k].index = k;
+			++k;
+		}
+	if (order == fmdpo_auto)
+		order = k && fmdp_sched_rotational(job,
+						   keys[0].file->stat.st_dev) ?
+			fmdpo_extent : fmdpo_readdir;
+	if (order == fmdpo_readdir || k < 2) {
+		free(keys);
+		return 0;
 	}
-	++job->n_diropens;
 
-	struct FmdFile *rv = 0;
-	{
-		struct FmdFile *tail = 0;
-		char fullpath[fullpath_sz];
-		strcpy(fullpath, path);
-		fullpath[path_len - 1] = '/';
-
-		struct dirent *entry;
-		while ((entry = readdir(dirp)) != NULL) {
-			size_t len = strlen(entry->d_name);
-			if (path_len + len + 1 >= sizeof fullpath)
-				continue; /* path too long */
-			if (entry->d_name[0] == '.' &&
-			    (entry->d_name[1] == '\0' ||
-			     (entry->d_name[1] == '.' &&
-			      entry->d_name[2] == '\0')))
-				continue; /* omit . and .. */
-
-			struct FmdFile *file = 0;
-			strcpy(fullpath + path_len, entry->d_name);
-			int res = fmd_scan_file(job, dirfd, fullpath, &file);
-			if (!res && file) {
-				if (tail)
-					tail->next = file;
+	/* By inode #s 1st, as they follow allocation on most file
+	 * systems; extents are then asked for in that order, so that
+	 * opening files reads their inodes in sequence, too */
+	for (i = 0; i < k; ++i)
+		keys[i].key = (uint64_t)keys[i].file->stat.st_ino;
+	qsort(keys, k, sizeof *keys, &fmdp_probe_key_cmp);
+	for (i = 0; i < k && order == fmdpo_extent; ++i) {
+		const int64_t phys = fmdp_first_extent(job, dirfd, keys[i].file);
+		if (phys == -1)
+			break;
+		keys[i].key = (uint64_t)phys;
+		keys[i].index = i;
+	}
+	/* By extents, as long as file system tells them all */
+	if (order == fmdpo_extent && i == k)
+		qsort(keys, k, sizeof *keys, &fmdp_probe_key_cmp);
+
+	/* Pointers take the place of keys, never past the one read */
+	struct FmdFile **sorted = (struct FmdFile**)keys;
+	for (i = 0; i < k; ++i)
+		sorted[i] = keys[i].file;
+	*pn = k;
+	return sorted;
+}
+
+
+void
+fmdp_probe_entries(struct FmdScanJob *job,
+		   int dirfd,
+		   struct FmdFile **entries,
+		   size_t n)
+{
+	assert(job);
+	assert(entries || !n);
+
+	if ((job->flags & fmdsf_metadata) != fmdsf_metadata)
+		return;
+
+	/* Metadata of files from an arena goes to the arena of the
+	 * worker, that probes them */
+	size_t i;
+	for (i = 0; i < n && job->priv->arena; ++i)
+		if (entries[i]->flags & fmdff_arena)
+			FMDP_FILE_ARENA(entries[i]) = job->priv->arena;
+
+	struct FmdFile **misses = 0;
+	if (job->cache &&
+	    (misses = (struct FmdFile**)malloc(n * sizeof *misses)) != NULL) {
+		/* Probe only entries, that are not in the probe cache */
+		size_t k = 0;
+		for (i = 0; i < n; ++i)
+			if (entries[i]->filetype != fmdft_directory &&
+			    entries[i]->stat.st_size >= FMDP_MIN_PROBED(job) &&
+			    fmdp_probe_cache_fill(job, entries[i]) != 0)
+				misses[k++] = entries[i];
+		entries = misses;
+		n = k;
+	}
+
+	/* Links to files probed already are filled from those; links
+	 * to ones being probed are put off, until the rest is probed,
+	 * at the end of |claimed| */
+	for (i = 0; i < n && job->priv->links; ++i)
+		if (entries[i]->filetype != fmdft_directory &&
+		    entries[i]->stat.st_nlink > 1)
+			break;
+	struct FmdFile **claimed = 0;
+	const size_t n_all = n;
+	size_t n_later = 0;
+	if (i < n &&
+	    (claimed = (struct FmdFile**)malloc(n * sizeof *claimed)) != NULL) {
+		size_t k = 0;
+		for (i = 0; i < n; ++i) {
+			if (entries[i]->filetype == fmdft_directory ||
+			    entries[i]->stat.st_size < FMDP_MIN_PROBED(job))
+				continue;
+			const int res = fmdp_links_claim(job, entries[i]);
+			if (res == 1)
+				claimed[k++] = entries[i];
+			else if (res == -1)
+				claimed[n_all - ++n_later] = entries[i];
+		}
+		entries = claimed;
+		n = k;
+	}
+
+	struct FmdFile **sorted = fmdp_probe_order(job, dirfd, entries, n, &n);
+	if (sorted)
+		entries = sorted;
+
+	if (!job->uring_depth ||
+	    fmdp_uring_probe(job, dirfd, entries, n) != 0) {
+		for (i = 0; i < n; ++i)
+			if (entries[i]->filetype != fmdft_directory)
+				fmdp_probe_file(job, dirfd, entries[i]);
+	}
+	for (i = 0; i < n_later; ++i) {
+		struct FmdFile *file = claimed[n_all - 1 - i];
+		if (fmdp_links_claim(job, file) != 0)
+			fmdp_probe_file(job, dirfd, file);
+	}
+	free(sorted);
+	free(claimed);
+	free(misses);
+}
+
+
+int
+fmdp_emit(struct FmdScanJob *job,
+	  struct FmdFile ***ptail,
+	  struct FmdFile *file,
+	  int hold)
+{
+	assert(job);
+	assert(ptail || job->consume);
+	assert(file);
+
+	/* Probing an archive puts its children right after it */
+	int held = 0;
+	while (file) {
+		struct FmdFile *next = file->next;
+		file->next = 0;
+		int drop = job->finish && job->finish(job, file) != 0;
+		if (!drop && job->consume)
+			drop = job->consume(job, file) == 0;
+		else if (!drop) {
+			**ptail = file;
+			*ptail = &file->next;
+		}
+		if (drop && hold)
+			held = 1;
+		else if (drop)
+			fmd_free(file);
+		hold = 0;
+		file = next;
+	}
+	return held;
+}
+
+
+/* Notes directory |path| of |st| in |visit|; returns -1 with ELOOP,
+ * if one of its parents is the same, or 1, if some other symbolic
+ * link or mount led to it already, and it is not to be listed */
+static int
+fmdp_visit_dir(struct FmdScanJob *job,
+	       const char *path,
+	       const struct stat *st,
+	       struct FmdDirVisit *visit)
+{
+	visit->dev = st->st_dev;
+	visit->ino = st->st_ino;
+	const struct FmdDirVisit *it;
+	for (it = visit->parent; it; it = it->parent)
+		if (it->dev == st->st_dev && it->ino == st->st_ino) {
+			job->log(job, path, fmdlt_oserr, "%s(%s): %s",
+				 "opendir", path, strerror(ELOOP));
+			FMDP_X(-1);
+			return (errno = ELOOP), -1;
+		}
+	if (fmdp_links_visit(job, st) == 0)
+		return 0;
+	job->log(job, path, fmdlt_trace, "directory '%s' scanned already",
+		 path);
+	return 1;
+}
+
+
+int
+fmdp_read_dir(struct FmdScanJob *job,
+	      int parent_dirfd,
+	      const char *name,
+	      const char *path,
+	      const struct stat *st,
+	      struct FmdDirVisit *visit,
+	      DIR **pdirp,
+	      struct FmdDirList *list)
+{
+	assert(job);
+	assert(name);
+	assert(path);
+	assert(visit);
+	assert(pdirp);
+	assert(list);
+
+	*pdirp = 0;
+	const int prune =
+		(job->flags & fmdsf_prune) == fmdsf_prune && job->cache;
+	const size_t from = list->n;
+	struct stat dirst;
+	if (prune && !st) {
+		/* Stat it before listing, so that changes made while
+		 * listing it are noticed by the next scan */
+		++job->n_stats;
+		if (fstatat(parent_dirfd, name, &dirst, 0) != 0) {
+			job->log(job, path, fmdlt_oserr, "%s(%s): %s",
+				 "fstatat", path, strerror(errno));
+			FMDP_X(-1);
+			return -1;
+		}
+		st = &dirst;
+	}
+	/* Directories are scanned once, whatever links lead to them */
+	int res;
+	if (prune && job->priv->links &&
+	    (res = fmdp_visit_dir(job, path, st, visit)) != 0)
+		return res > 0 ? 0 : -1;
+	if (prune && fmdp_dir_cache_fill(job, st, path, list) == 0) {
+		/* Sub-directories could have changed; stat them again */
+		size_t i, k;
+		for (i = k = from; i < list->n; ++i) {
+			struct FmdFile *file = list->entries[i];
+			if (fmdp_filter_file(job, file) ||
+			    (job->begin && job->begin(job, file->path) != 0) ||
+			    (file->filetype == fmdft_directory &&
+			     fmdp_fstatat(job, AT_FDCWD, file) != 0))
+				fmd_free(file);
+			else
+				list->entries[k++] = file;
+		}
+		list->n = k;
+		return 0;
+	}
+
+	DIR *dirp = fmdp_open_dir(job, parent_dirfd, name, path);
+	if (!dirp)
+		return -1;
+	if (!prune && job->priv->links) {
+		++job->n_stats;
+		if (fstat(dirfd(dirp), &dirst) != 0) {
+			job->log(job, path, fmdlt_oserr, "%s(%s): %s",
+				 "fstat", path, strerror(errno));
+			closedir(dirp);
+			FMDP_X(-1);
+			return -1;
+		}
+		if ((res = fmdp_visit_dir(job, path, &dirst, visit)) != 0) {
+			closedir(dirp);
+			return res > 0 ? 0 : -1;
+		}
+	}
+	if ((res = fmdp_list_dir(job, dirp, path, list)) == -1) {
+		closedir(dirp);
+		return -1;
+	}
+	if (prune) {
+		/* Listing, that stopped short, is no snapshot */
+		if (res == 0)
+			fmdp_dir_cache_store(job, st, list, from);
+		fmdp_filter_list(job, list, from);
+		if (job->begin) {
+			size_t i, k;
+			for (i = k = from; i < list->n; ++i) {
+				struct FmdFile *file = list->entries[i];
+				if (job->begin(job, file->path) != 0)
+					fmd_free(file);
 				else
-					rv = file;
-				tail = file;
+					list->entries[k++] = file;
 			}
-			/* XXX: else keep track of errors */
+			list->n = k;
 		}
 	}
+	*pdirp = dirp;
+	return 0;
+}
 
-	/* Breath first; time to scan directories */
-	struct FmdFile *it = rv;
-	while (it) {
-		if (it->filetype == fmdft_directory &&
-		    it->name[0] != '.') {
+
+static int
+fmd_scan_hier(struct FmdScanJob *job,
+	      int parent_dirfd,
+	      const char *name,
+	      const char *path,
+	      const struct stat *st,
+	      const struct FmdDirVisit *parent,
+	      struct FmdFile **info)
+{
+	assert(job);
+	assert(name);
+	assert(path);
+	assert(info);
+	if (!job || !name || !path || !info)
+		return (errno = EINVAL), -1;
+
+	DIR *dirp;
+	struct FmdDirList list;
+	memset(&list, 0, sizeof list);
+	struct FmdDirVisit visit = { parent, 0, 0 };
+	int res = fmdp_read_dir(job, parent_dirfd, name, path, st,
+				&visit, &dirp, &list);
+	if (res != 0) {
+		fmdp_free_dir_list(&list, /*entries*/1);
+		return res;
+	}
+
+	/* Directory listed from its snapshot is not opened */
+	const int fd = dirp ? dirfd(dirp) : AT_FDCWD;
+	fmdp_probe_entries(job, fd, list.entries, list.n);
+
+	/* Breath first; time to scan directories. Each one is needed
+	 * until its children are scanned, even if dropped */
+	struct FmdFile *rv = 0, **tail = &rv;
+	size_t i;
+	for (i = 0; i < list.n; ++i) {
+		struct FmdFile *it = list.entries[i];
+		const int descend = FMDP_DESCEND(it);
+		const int held = fmdp_emit(job, &tail, it, descend);
+		if (descend) {
 			struct FmdFile *children = 0;
-			int res = fmd_scan_hier(job, dirfd, it->name,
-						&children);
-			if (!res && children) {
-				/* Insert children right after
-				 * directory they're in. Then skip
-				 * through all children, because we
-				 * should add prev next entry last */
-				struct FmdFile *next = it->next;
-				it->next = children;
-				while (it->next)
-					it = it->next;
-				it->next = next;
-			}
+			res = fmd_scan_hier(job, fd,
+					    fd != AT_FDCWD ? it->name : it->path,
+					    it->path, &it->stat, &visit,
+					    &children);
+			for (*tail = children; *tail; tail = &(*tail)->next)
+				;
 		}
-		it = it->next;
+		if (held)
+			fmd_free(it);
 	}
-	/* closedir(3) will take care to close |dirfd| */
-	closedir(dirp);
+	/* closedir(3) will take care to close |fd| */
+	if (dirp)
+		closedir(dirp);
+	fmdp_free_dir_list(&list, /*entries*/0);
 
 	*info = rv;
 	return 0;
 }
 
 
+void
+fmdp_free_dir_list(struct FmdDirList *list,
+		   int entries)
+{
+	assert(list);
+	if (entries) {
+		size_t i;
+		for (i = 0; i < list->n; ++i)
+			fmd_free_chain(list->entries[i]);
+	}
+	free(list->entries);
+	memset(list, 0, sizeof *list);
+}
+
+
 static void
 fmd_dummy_log(struct FmdScanJob *job,
 	      const char *path,
@@ -341,15 +1056,52 @@ fmd_scan(struct FmdScanJob *job)
 		FMDP_X(-1);
 		return -1;
 	}
+	fmdp_priv_init(job->priv);
+	if ((job->flags & fmdsf_links) == fmdsf_links &&
+	    !(job->priv->links = fmdp_links_new()))
+		job->log(job, job->location, fmdlt_oserr, "%s: %s",
+			 "links", strerror(errno));
+	if (fmdp_filter_new(job, &job->priv->filter) != 0) {
+		job->log(job, 0, fmdlt_oserr, "%s: %s",
+			 "filter", strerror(errno));
+		fmdp_links_free(job->priv->links);
+		fmdp_priv_fini(job->priv);
+		free(job->priv); job->priv = 0;
+		FMDP_X(-1);
+		return -1;
+	}
+	struct FmdBufPool bufs;
+	fmdp_bufpool_init(&bufs, job->buffer_cap);
+	job->priv->bufs = &bufs;
+	struct FmdSched sched;
+	fmdp_sched_init(&sched);
+	job->priv->sched = &sched;
+	const int ioprio = fmdp_ioprio_idle(job);
+	if ((job->flags & fmdsf_arena) == fmdsf_arena && !job->consume) {
+		if (!job->arena)
+			job->arena = (struct FmdArena*)calloc(1, sizeof *job->arena);
+		job->priv->arena = job->arena;	/* else calloc(3) is used */
+	}
 
 	int rv;
 	if ((job->flags & fmdsf_recursive) != fmdsf_recursive)
 		rv = fmd_scan_file(job, AT_FDCWD, job->location,
 				   &job->first_file);
+	else if (job->threads > 1)
+		rv = fmdp_scan_parallel(job);
 	else
-		rv = fmd_scan_hier(job, AT_FDCWD, job->location, &job->first_file);
+		rv = fmd_scan_hier(job, AT_FDCWD, job->location,
+				   job->location, 0, 0, &job->first_file);
 
+	fmdp_links_free(job->priv->links);
+	fmdp_filter_free(job->priv->filter);
+	fmdp_priv_fini(job->priv);
 	free(job->priv); job->priv = 0;
+	if (job->v_bufpeak < bufs.peak)
+		job->v_bufpeak = bufs.peak;
+	fmdp_bufpool_fini(&bufs);
+	fmdp_sched_fini(&sched);
+	fmdp_ioprio_restore(ioprio);
 	return rv;
 }
 
@@ -357,7 +1109,7 @@ fmd_scan(struct FmdScanJob *job)
 void
 fmd_free(struct FmdFile *item)
 {
-	if (!item)
+	if (!item || (item->flags & fmdff_arena))
 		return;
 	struct FmdElem *it = item->metadata;
 	while (it) {
@@ -369,6 +1121,18 @@ fmd_free(struct FmdFile *item)
 }
 
 
+void
+fmd_free_arena(struct FmdScanJob *job)
+{
+	assert(job);
+	if (!job || !job->arena)
+		return;
+	fmdp_arena_fini(job->arena);
+	free(job->arena);
+	job->arena = 0;
+}
+
+
 void
 fmd_free_chain(struct FmdFile *head)
 {
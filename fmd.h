@@ -13,7 +13,56 @@ enum FmdScanFlags {
 	/* also scan for metadata */
 	fmdsf_metadata = 1 << 1,
 	/* also scan archived files */
-	fmdsf_archives = 1 << 2
+	fmdsf_archives = 1 << 2,
+	/* classify directory entries by their d_type and stat only
+	 * those to be probed (or of unknown type); others get only file
+	 * type bits of |stat.st_mode| and |stat.st_ino|; stats also
+	 * skip atime, ctime, blocks, uid and gid, where possible */
+	fmdsf_lazystat = 1 << 3,
+	/* keep snapshots of directories in |cache|; a directory with
+	 * the same mtime is then listed from its snapshot, and only
+	 * its sub-directories are stat'ed. Notice: files modified in
+	 * place do not change directory's mtime and go unnoticed */
+	fmdsf_prune = 1 << 4,
+	/* carve files and metadata from |arena|, to be freed at once
+	 * with fmd_free_arena(); ignored, if streaming */
+	fmdsf_arena = 1 << 5,
+	/* keep the scan from crowding others out of page cache: open
+	 * with O_NOATIME, where permitted, never map files, and drop
+	 * what has been read (POSIX_FADV_DONTNEED), once probed */
+	fmdsf_cold = 1 << 6,
+	/* as fmdsf_cold, and read around page cache with O_DIRECT,
+	 * where reads are aligned and file system permits */
+	fmdsf_direct = 1 << 7,
+	/* do I/O in idle class of ioprio_set(2), on each thread of
+	 * the scan, where able */
+	fmdsf_idleio = 1 << 8,
+	/* fill files of more hard links from the first one probed,
+	 * marked with fmdff_link, and scan a directory, that symbolic
+	 * links lead to, only once. Notice: a record is kept for each
+	 * such file and each directory until the scan ends, streaming
+	 * or not */
+	fmdsf_links = 1 << 9,
+	/* with fmdsf_metadata, only tell |filetype| and |mimetype| of
+	 * files by signatures in their 1st 4 KiB, parsing nothing: a
+	 * cheap pass to pick files to probe in full later. Without
+	 * fmdsf_metadata, files are only stat'ed */
+	fmdsf_typeonly = 1 << 10,
+	/* with fmdsf_metadata, also hash whole contents of non-empty
+	 * regular files (XXH3-64) into fmdet_digest, to tell duplicates
+	 * and changes; archived files are not hashed */
+	fmdsf_hash = 1 << 11
+};
+
+/* Hints for memory-mapped files, see |mmap_min| */
+enum FmdMmapFlags {
+	/* prefault whole mapping at once (MAP_POPULATE), where able */
+	fmdmf_populate = 1 << 0,
+	/* expect random or sequential access (posix_madvise(3)) */
+	fmdmf_random = 1 << 1,
+	fmdmf_sequential = 1 << 2,
+	/* start reading ahead right away */
+	fmdmf_willneed = 1 << 3
 };
 
 enum FmdLogType {
@@ -68,6 +117,7 @@ enum FmdElemType {
 	fmdet_focal_length35,	/* in mm, frac */
 
 	fmdet_other,		/* text: key=value */
+	fmdet_digest,		/* text: XXH3-64 of contents, in hex */
 };
 extern const char *fmd_elemtype[];
 
@@ -97,8 +147,17 @@ struct FmdElem {
 	};
 };
 
+enum FmdFileFlags {
+	/* carved from job's arena; fmd_free() does nothing to it */
+	fmdff_arena = 1 << 0,
+	/* hard link to a file probed earlier in the scan; filled
+	 * from that one, rather than probed */
+	fmdff_link = 1 << 1
+};
+
 struct FmdFile {
 	struct FmdFile *next;
+	unsigned flags;		/* enum FmdFileFlags */
 	enum FmdFileType filetype;
 	const char *mimetype;
 	struct FmdElem *metadata;
@@ -106,15 +165,117 @@ struct FmdFile {
 	char *name, path[1];
 };
 
+/* Order to probe files of a directory in, see |probe_order| */
+enum FmdProbeOrder {
+	/* as they are listed, */
+	fmdpo_readdir = 0,
+	/* by inode #, */
+	fmdpo_inode,
+	/* by physical offset of their 1st extent (FIEMAP), falling
+	 * back to inode # where unavailable, */
+	fmdpo_extent,
+	/* or as fmdpo_extent on rotational disks, as listed on others */
+	fmdpo_auto
+};
+
+/* Limits of a device, files are probed on */
+struct FmdDevLimits {
+	/* # of files probed at a time; 0 for unlimited. Set it to 1
+	 * for rotational disks, to keep their heads from seeking */
+	unsigned depth;
+	/* Octets and reads per second; 0 for unlimited. Mapped files
+	 * cannot be throttled, those on such devices are read */
+	size_t bandwidth;
+	unsigned iops;
+};
+
+/* Persistent probe cache, see fmd_cache_open() */
+struct FmdCache;
+/* Arena, results are carved from with fmdsf_arena */
+struct FmdArena;
+
 struct FmdScanJob {
 	const char *location;
 	enum FmdScanFlags flags;
 
+	/* # of worker threads for recursive scans; 0 or 1 scans on
+	 * the calling thread. With more workers, hooks are called
+	 * concurrently, each with a per-worker copy of the job */
+	unsigned threads;
+
+	/* Queue depth of io_uring(7) engine, that batches opens, stats
+	 * and 1st page reads of many files at once; 0 to disable.
+	 * Synchronous I/O is used, where io_uring is unavailable */
+	unsigned uring_depth;
+	/* Order to probe a directory's files in, to spare seeks of
+	 * disk heads; results keep the listing order. With more
+	 * workers, each batch of a directory is ordered on its own */
+	unsigned probe_order;	/* enum FmdProbeOrder */
+
+	/* Probe cache to consult and update; files with the same
+	 * device, inode, size and mtime are filled from it without
+	 * being opened. Their mimetypes then belong to the cache and
+	 * are valid until it is closed. Can be shared by many jobs */
+	struct FmdCache *cache;
+
+	/* Regular files this large or larger are mapped into memory
+	 * and parsed in place, rather than read into buffers; 0 (or
+	 * negative) never to map. Notice: truncating a file, while it
+	 * is mapped, raises SIGBUS in the caller's process, so only
+	 * set it for trees that no one writes to while scanned */
+	off_t mmap_min;
+	unsigned mmap_flags;	/* enum FmdMmapFlags */
+	/* Octets at the end of each opened file to fetch together with
+	 * its header, for formats keeping an index there (ID3v1, MP4
+	 * 'moov' after 'mdat'); up to 32 KiB, 0 to fetch on demand */
+	size_t tail_prefetch;
+	/* Bounds of read size, which starts low, doubles while file
+	 * is read sequentially and halves on seeks; 0 for defaults of
+	 * 4 KiB and 32 KiB; at most a cache page */
+	size_t read_min, read_max;
+	/* Number and size of pages, each opened file is cached with;
+	 * 0 for defaults of 4 and 32 KiB. More pages help deep walks
+	 * of BMFF boxes and TIFF IFDs */
+	size_t cache_pages, cache_page_sz;
+	/* Cap on memory of read buffers and cache pages, all workers
+	 * draw from together; 0 for default of 64 MiB. Near the cap,
+	 * files go with fewer cache pages or none, and workers wait
+	 * for others to give buffers back */
+	size_t buffer_cap;
+	/* Limits of each device, by |stat.st_dev| of probed files;
+	 * see |devlimits| hook to set them per device */
+	struct FmdDevLimits dev_limits;
+
+	/* Elements to read, a mask of (1UL << enum FmdElemType); 0
+	 * for all. Parsers skip reading others, and stop once each one
+	 * requested is found. Files probed so are not recorded in the
+	 * probe cache, as their metadata are partial */
+	unsigned long elements;
+
+	/* Filters of entries of scanned directories, null-terminated
+	 * lists of fnmatch(3) patterns, matched against entry's name,
+	 * or its whole path, if they contain '/'. Entries are filtered
+	 * before they are stat'ed, where their type is known from the
+	 * directory. Files matching none of |include|, if set, or any
+	 * of |exclude| are skipped; directories matching any of |prune|
+	 * are neither listed nor descended into */
+	const char *const *include, *const *exclude, *const *prune;
+	/* Regular files smaller than |size_min|, or larger than
+	 * |size_max|, unless 0, are skipped before being opened */
+	off_t size_min, size_max;
+
+	/* Set up by fmd_scan() with fmdsf_arena; later scans of the
+	 * same job add to it, until it's freed with fmd_free_arena() */
+	struct FmdArena *arena;
+
 	/* fmd_scan() will fill this upon successful completion. Shall
 	 * be freed with fmd_free() */
 	struct FmdFile *first_file;
 
 	/* Hooks: */
+	/* Opaque pointer for hooks' use; kept in per-worker copies */
+	void *udata;
+
 	/* For logging. fmd_scan() will assign a dummy hook if |log|
 	 * is null to avoid a test before each invocation */
 	void (*log)(struct FmdScanJob *job,
@@ -129,12 +290,32 @@ struct FmdScanJob {
 	 * |file| to the chain if hook is assigned and returns
 	 * non-zero */
 	int (*finish)(struct FmdScanJob *job, struct FmdFile *file);
+	/* Called once per device, files are probed on, to adjust
+	 * |limits|, set from |dev_limits| */
+	void (*devlimits)(struct FmdScanJob *job, dev_t dev,
+			  struct FmdDevLimits *limits);
+	/* Streaming: if assigned, finished files are handed over to
+	 * |consume| one by one instead of being chained to
+	 * |first_file|, and are freed once it returns, unless it
+	 * returns non-zero to keep |file| (free it with fmd_free()
+	 * then; a directory kept shall outlive its contents, though).
+	 * Files come in chain order; with more threads, directory by
+	 * directory in no particular order, but never concurrently */
+	int (*consume)(struct FmdScanJob *job, struct FmdFile *file);
 
-	/* Metrics/Statistics. n_ -> # of, v_ -> volume/octets */
-	size_t n_filopens, n_diropens;
+	/* Metrics/Statistics. n_ -> # of, v_ -> volume/octets,
+	 * t_ -> time/seconds */
+	size_t n_filopens, n_diropens, n_stats, n_mmaps;
 	size_t n_physreads, n_logreads;
 	off_t v_physreads, v_logreads;
 	size_t n_cachehits, n_cachemisses;
+	size_t n_pcachehits, n_pcachemisses;	/* probe cache */
+	size_t n_snaphits, n_snapmisses;	/* directory snapshots */
+	size_t n_linkhits;	/* hard links filled from another */
+	size_t v_bufpeak;	/* peak of buffer memory in use */
+	off_t v_uncached;	/* read, but kept out of page cache */
+	off_t v_hashed, v_hashreads;	/* hashed, and read to hash */
+	double t_hash;		/* spent hashing, I/O aside */
 
 	/* Private pointer for internal use */
 	struct FmdPriv *priv;
@@ -144,8 +325,80 @@ struct FmdScanJob {
  * considering |job->flags| */
 int fmd_scan(struct FmdScanJob *job);
 
+/* Opens probe cache file at |path|, that is created on first flush;
+ * a cache file of other version is started over */
+struct FmdCache* fmd_cache_open(const char *path);
+/* Appends files probed since the last flush to the cache file */
+int fmd_cache_flush(struct FmdCache *cache);
+/* Rewrites the cache file with the latest record of each file; with
+ * |drop_unseen|, also drops files neither found nor probed since the
+ * cache was opened */
+int fmd_cache_compact(struct FmdCache *cache, int drop_unseen);
+/* Flushes and frees |cache| */
+int fmd_cache_close(struct FmdCache *cache);
+
+/* Parser plugins.
+ *
+ * A parser is tried on files, whose header matches its signature:
+ * |magic_len| octets at |magic_offs|, that, masked with |magic_mask|
+ * (all ones, if 0), equal |magic|; a parser without signature is
+ * tried on files no other parser took. Of those matching, parsers
+ * of higher |priority| are tried first, then of lower |cost| -- a
+ * hint of how much a probe reads, in KiB, say; the first one, that
+ * returns 0 from |probe|, takes the file. Built-in parsers are of
+ * priority 0, and cost from 1 (FLAC) to 64 (archives) */
+struct FmdStream;
+struct FmdParser {
+	const char *name;
+	size_t magic_offs, magic_len;
+	const unsigned char *magic, *magic_mask;
+	int priority;
+	unsigned cost;
+	/* Sets |filetype| and |mimetype| (a string, that outlives
+	 * the scan) of fmd_stream_file(), adds its metadata and
+	 * returns 0, or returns -1, if |stream| is not of the format.
+	 * Called concurrently with more threads */
+	int (*probe)(struct FmdStream *stream);
+	/* Type of files, that match the signature, told without
+	 * probing with fmdsf_typeonly; parsers without |mimetype| are
+	 * not tried then, nor those with signatures past 1st 4 KiB */
+	enum FmdFileType filetype;
+	const char *mimetype;
+};
+/* Registers |parser| for scans started later; its signature shall
+ * stay valid, while it's registered. Returns -1 and sets |errno| on
+ * failure, EINVAL for a signature past 1st 32 KiB of file */
+int fmd_register_parser(const struct FmdParser *parser);
+
+/* Returns |len| octets of |stream| at |offs|, relative to its end,
+ * if negative; |len| up to 32 KiB. The data are valid until the next
+ * call; returns 0 and sets |errno| on failure, ERANGE for octets out
+ * of the stream */
+const unsigned char* fmd_stream_get(struct FmdStream *stream,
+				    off_t offs, size_t len);
+off_t fmd_stream_size(struct FmdStream *stream);
+/* File, that is probed, and job, that probes it */
+struct FmdFile* fmd_stream_file(struct FmdStream *stream);
+struct FmdScanJob* fmd_stream_job(struct FmdStream *stream);
+
+/* Add metadata to |file| being probed; |len| of -1 for text up to
+ * '\0'. Return -1 and set |errno| on failure */
+int fmd_add_n(struct FmdFile *file, enum FmdElemType elemtype, long value);
+int fmd_add_frac(struct FmdFile *file, enum FmdElemType elemtype,
+		 double value);
+int fmd_add_timestamp(struct FmdFile *file, enum FmdElemType elemtype,
+		      time_t value);
+int fmd_add_rational(struct FmdFile *file, enum FmdElemType elemtype,
+		     int num, int denom);
+int fmd_add_text(struct FmdFile *file, enum FmdElemType elemtype,
+		 const char *s, int len);
+int fmd_add_other(struct FmdFile *file, const char *key,
+		  const char *s, int len);
+
 void fmd_free(struct FmdFile *item);
 void fmd_free_chain(struct FmdFile *head);
+/* Frees all files and metadata carved from |job->arena| */
+void fmd_free_arena(struct FmdScanJob *job);
 
 void fmd_print_elem(const struct FmdElem *elem,
 		    FILE *where);
@@ -63,7 +63,9 @@ struct FmdArchStream {
 	struct archive *a;
 	struct archive_entry *entry;
 	off_t size, off;
-	char buf[FMDP_READ_PAGE_SZ];
+	char *buf;	/* FMDP_READ_PAGE_SZ, from buffer pool */
+
+	struct FmdSpanBuf spans;
 };
 #define FMDP_GET_ASTR(_stream)			\
 	(struct FmdArchStream*)((_stream) - offsetof(struct FmdArchStream, base))
@@ -130,6 +132,18 @@ err:
 	return 0;
 }
 
+static int
+fmdp_arch_stream_get_many(struct FmdStream *stream,
+			  struct FmdRange *ranges, size_t n)
+{
+	assert(stream);
+	struct FmdArchStream *astr = FMDP_GET_ASTR(stream);
+	/* Spans come in ascending order, so reading forward is fine,
+	 * as long as none is behind */
+	return fmdp_get_spans(stream, &astr->spans, ranges, n,
+			      &fmdp_read_chunked);
+}
+
 static void
 fmdp_arch_stream_close(struct FmdStream *stream)
 {
@@ -137,6 +151,8 @@ fmdp_arch_stream_close(struct FmdStream *stream)
 	struct FmdArchStream *astr = FMDP_GET_ASTR(stream);
 	/* Nothing to close */
 	archive_read_data_skip(astr->a);
+	fmdp_buf_put(stream->job, astr->buf, FMDP_READ_PAGE_SZ);
+	free(astr->spans.data);
 	free(astr);
 }
 
@@ -149,10 +165,16 @@ fmdp_arch_stream(struct FmdScanJob *job, struct FmdFile *file,
 	assert(a);
 	assert(entry);
 	struct FmdArchStream *astr = (struct FmdArchStream*)calloc (1, sizeof (*astr));
+	if (astr &&
+	    !(astr->buf = (char*)fmdp_buf_get(job, FMDP_READ_PAGE_SZ, 1))) {
+		free(astr);
+		astr = 0;
+	}
 	if (astr) {
 		astr->base.size = fmdp_arch_stream_size;
 		astr->base.get = &fmdp_arch_stream_get;
 		astr->base.close = &fmdp_arch_stream_close;
+		astr->base.get_many = &fmdp_arch_stream_get_many;
 		astr->base.job = job;
 		astr->base.file = file;
 		astr->a = a;
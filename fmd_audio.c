@@ -24,13 +24,16 @@ fmdp_do_flac_stream_info(struct FmdStream *stream,
 	/* XXX: 36 bits could overflow 32-bit long */
 	long total_samples = fmdp_get_bits_be(si, 80 + 20 + 3 + 5, 36);
 
+	struct FmdScanJob *job = stream->job;
 	struct FmdFile *file = stream->file;
-	int res = fmdp_add_n(file, fmdet_sampling_rate, sample_rate);
-	if (!res)
+	int res = 0;
+	if (FMDP_WANTS(job, fmdet_sampling_rate))
+		res = fmdp_add_n(file, fmdet_sampling_rate, sample_rate);
+	if (!res && FMDP_WANTS(job, fmdet_num_channels))
 		res = fmdp_add_n(file, fmdet_num_channels, channels);
-	if (!res)
+	if (!res && FMDP_WANTS(job, fmdet_bits_per_sample))
 		res = fmdp_add_n(file, fmdet_bits_per_sample, bits_per_sample);
-	if (!res) {
+	if (!res && FMDP_WANTS(job, fmdet_duration)) {
 		double duration = (double)total_samples / (double)sample_rate;
 		res = fmdp_add_frac(file, fmdet_duration, duration);
 	}
@@ -40,11 +43,11 @@ fmdp_do_flac_stream_info(struct FmdStream *stream,
 
 /* Handles single Ogg Vorbis metadata field */
 static int
-fmdp_do_vorbis_md_field(struct FmdFile *file,
+fmdp_do_vorbis_md_field(struct FmdStream *stream,
 			const char *name, size_t name_len,
 			const char *value, size_t value_len)
 {
-	assert(file);
+	assert(stream);
 	assert(name);
 	assert(name_len);
 	assert(value);
@@ -62,8 +65,9 @@ fmdp_do_vorbis_md_field(struct FmdFile *file,
 		{ 0, 0 }
 	};
 	int t = fmdp_match_token(name, name_len, vorbis_fields);
-	if (t == -1)
-		return 0;	/* no match found */
+	if (t == -1 || !FMDP_WANTS(stream->job, t))
+		return 0;	/* no match found, or not requested */
+	struct FmdFile *file = stream->file;
 	if (t == fmdet_trackno) {
 		long n = fmdp_parse_decimal(value, value_len);
 		if (n != LONG_MIN)
@@ -89,6 +93,7 @@ fmdp_do_vorbis_comments(struct FmdStream *stream,
 
 	/* Spec: https://xiph.org/vorbis/doc/v-comment.html */
 	/* All lengths are 32-bit little-endian; text is in UTF-8 */
+	struct FmdScanJob *job = stream->job;
 	struct FmdFile *file = stream->file;
 	const uint8_t *p = comment, *endp = p + len;
 #define FMDP_GET_LE32(_p)						\
@@ -97,13 +102,14 @@ fmdp_do_vorbis_comments(struct FmdStream *stream,
 	size_t n = FMDP_GET_LE32 (p); p += 4;
 	if (p + n > endp)
 		return 0;
-	int res = fmdp_add_text(file, fmdet_creator, (const char*)p, n);
-	if (res)
+	int res = 0;
+	if (FMDP_WANTS(job, fmdet_creator) &&
+	    (res = fmdp_add_text(file, fmdet_creator, (const char*)p, n)) != 0)
 		return res;
 	p += n;
 	n = FMDP_GET_LE32 (p); p += 4;
 	size_t i;
-	for (i = 0; i < n && p + 4 <= endp; ++i) {
+	for (i = 0; i < n && p + 4 <= endp && fmdp_wants_more(job, file); ++i) {
 		size_t l = FMDP_GET_LE32 (p); p += 4;
 		if (p + l > endp)
 			break;
@@ -111,7 +117,7 @@ fmdp_do_vorbis_comments(struct FmdStream *stream,
 		while (eq < endp && *eq != '=')
 			++eq;
 		if (eq != endp) {
-			res = fmdp_do_vorbis_md_field(file,
+			res = fmdp_do_vorbis_md_field(stream,
 						      (const char*)p,
 						      eq - p,
 						      (const char*)eq + 1,
@@ -133,20 +139,27 @@ fmdp_do_flac(struct FmdStream *stream)
 	/* Format spec: https://xiph.org/flac/format.html#stream */
 	FMDP_READ1STPAGE(stream, -1);
 	p += 4;			/* fLaC */
-	/* Iterate over metadata blocks */
+	/* Iterate over metadata blocks, until those requested are read */
+	struct FmdScanJob *job = stream->job;
+	const unsigned long si_elems = (1UL << fmdet_sampling_rate) |
+		(1UL << fmdet_num_channels) | (1UL << fmdet_bits_per_sample) |
+		(1UL << fmdet_duration);
 	int last = 0;
-	while (p + 4 <= endp && !last) {
+	while (p + 4 <= endp && !last &&
+	       fmdp_wants_more(job, stream->file)) {
 		last = (*p & 0x80) != 0;
 		int block_type = *p & 0x7f;
 		int block_len = ((int)p[1] << 16) | ((int)p[2] << 8) | p[3];
 		if (p + block_len <= endp) {
 			const uint8_t *payload = p + 4;
 			if (block_type == 0 &&
-			    block_len == 34)
+			    block_len == 34 &&
+			    FMDP_WANTS_ANY(job, si_elems))
 				/* stream info */
 				fmdp_do_flac_stream_info(stream, payload);
 			else if (block_type == 4 &&
-				 block_len >= 8)
+				 block_len >= 8 &&
+				 FMDP_WANTS_ANY(job, FMDP_ELEMS_TEXT))
 				/* vorbis comment */
 				fmdp_do_vorbis_comments(stream, payload,
 							block_len);
@@ -285,6 +298,7 @@ fmdp_do_id3_md_field(struct FmdFile *file,
 	assert(file);
 	assert(iter);
 
+	struct FmdScanJob *job = iter->stream->job;
 	static const struct FmdToken id3_fields[] = {
 		{ "TIT2", fmdet_title },
 		{ "TALB", fmdet_album },
@@ -300,8 +314,8 @@ fmdp_do_id3_md_field(struct FmdFile *file,
 	};
 	int t = fmdp_match_token_exact((const char*)iter->type,
 				       iter->typelen, id3_fields);
-	if (t == -1)
-		return 0;	/* no match found */
+	if (t == -1 || !FMDP_WANTS(job, t))
+		return 0;	/* no match found, or not requested */
 	if (iter->read(iter) == -1)
 		return -1;	/* Can't read frame data */
 	assert(iter->data);
@@ -339,7 +353,10 @@ fmdp_do_mp3v2(struct FmdStream *stream)
 	if (!iter)
 		return -1;
 
-	while (iter->next(iter)) {
+	/* Frames are not read, unless requested, nor looked for, once
+	 * those requested are found */
+	while (fmdp_wants_more(stream->job, stream->file) &&
+	       iter->next(iter)) {
 		fmdp_do_id3_md_field(stream->file, iter);
 	}
 
@@ -97,6 +97,13 @@ fmdp_bmffit_next(struct FmdFrameIterator *iter)
 		box_type = p + 8;
 	}
 
+	/* Skipping a large box (i.e. 'mdat'), declare the next one */
+	if (bmfit->box_size > FMDP_READ_PAGE_SZ &&
+	    absoffs + (off_t)bmfit->box_size < bmfit->end_offs)
+		fmdp_stream_prefetch(iter->stream,
+				     absoffs + (off_t)bmfit->box_size,
+				     FMDP_READ_PAGE_SZ);
+
 	bmfit->data_offs = bmfit->offs + payload_offs;
 	bmfit->base.data = 0;
 	bmfit->base.datalen = bmfit->box_size - payload_offs;
@@ -370,11 +377,14 @@ fmdp_bmff_iterate_children(struct FmdBmffScanContext *ctx,
 			 "%*siterating '%4.4s'", depth * 2, "", currtype);
 
 	/* Iterate child Boxes and search for matching handlers
-	 * amongst |map| entries */
+	 * amongst |map| entries, until the file type and elements
+	 * requested are known */
 	int res = 0;
 	struct FmdBmffBoxIterator *bmfit = GET_BMFF(box);
 	struct FmdFrameIterator *iter = fmdp_bmffit_create_framed(bmfit);
-	while (iter->next(iter) == 1) {
+	while ((!ctx->major_brand[0] ||
+		fmdp_wants_more(job, box->stream->file)) &&
+	       iter->next(iter) == 1) {
 		const struct FmdBmffHandlerMap *mit;
 		for (mit = map; mit->handler; ++mit) {
 			if (!memcmp(mit->parent, currtype, 4) &&
@@ -436,6 +446,8 @@ fmdp_bmff_do_moov_mvhd(struct FmdBmffScanContext *ctx,
 	assert(map); (void)map;
 	if (!ctx || !iter)
 		return (errno = EINVAL), -1;
+	if (!FMDP_WANTS(iter->stream->job, fmdet_duration))
+		return 0;
 
 	if (!fmdp_bmff_check_datalen(iter, 25 * 4, 28 * 4, 4) ||
 	    !fmdp_bmff_readdata(iter))
@@ -543,7 +555,7 @@ fmdp_bmff_do_md_field(uint8_t fieldid[4],
 	};
 	int t = fmdp_match_token_exact((const char*)fieldid, 4, text_fields);
 	if (t != -1) {
-		if (!value_len)
+		if (!value_len || !FMDP_WANTS(iter->stream->job, t))
 			return 0;
 		if (iter->read(iter) == -1)
 			return -1;	/* Can't read frame data */
@@ -559,7 +571,7 @@ fmdp_bmff_do_md_field(uint8_t fieldid[4],
 	};
 	t = fmdp_match_token_exact((const char*)fieldid, 4, num_fields);
 	if (t != -1) {
-		if (value_len < 4)
+		if (value_len < 4 || !FMDP_WANTS(iter->stream->job, t))
 			return 0;
 		if (iter->read(iter) == -1)
 			return -1;	/* Can't read frame data */
@@ -584,6 +596,9 @@ fmdp_bmff_do_meta_ilst(struct FmdBmffScanContext *ctx,
 	assert(map); (void)map;
 	if (!ctx || !iter)
 		return (errno = EINVAL), -1;
+	struct FmdScanJob *job = iter->stream->job;
+	if (!FMDP_WANTS_ANY(job, FMDP_ELEMS_TEXT))
+		return 0;
 
 	struct FmdBmffBoxIterator *bmfit = GET_BMFF(iter);
 	struct FmdFrameIterator *field = fmdp_bmffit_create_framed(bmfit);
@@ -597,7 +612,8 @@ fmdp_bmff_do_meta_ilst(struct FmdBmffScanContext *ctx,
 	 * box of type 'data': ilst[name[data], artist[data]]. data
 	 * contains 32-bit typeid, 32-bit localeid and data itself */
 	int res = 0;
-	while (res == 0 && field->next(field) == 1) {
+	while (res == 0 && fmdp_wants_more(job, iter->stream->file) &&
+	       field->next(field) == 1) {
 		uint8_t fieldid[4];
 		memcpy(fieldid, field->type, 4);
 
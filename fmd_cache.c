@@ -0,0 +1,1068 @@
+#include "fmd_priv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Persistent probe cache.
+ *
+ * Results of probing a file -- its filetype, mimetype and metadata
+ * elements -- are kept in memory, hashed by device and inode, and
+ * are valid as long as file's size and mtime stay the same.
+ *
+ * The cache file is a log: a header, followed by records, appended
+ * on every flush; a later record of the same device and inode takes
+ * precedence. Compaction rewrites it with the latest records only.
+ * Records are in host byte order, as cache files are not meant to be
+ * moved between hosts; a cache file of other version or byte order
+ * is started over.
+ *
+ * With fmdsf_prune, directories are recorded too: their mtime and a
+ * snapshot of their entries (names and stats).
+ *
+ * A scan keeps a cache of its own, without a file: the links table.
+ * It holds files of more than one link, once probed, so that other
+ * links to them are filled rather than probed again, and directories
+ * scanned, to notice cycles through symbolic links. Its mimetypes
+ * are not interned, they are as long-lived as files' own */
+
+#if !defined (FMDP_PCACHE_VERSION)
+#  define FMDP_PCACHE_VERSION 1
+#endif
+
+static const char fmdp_pcache_magic[4] = { 'F', 'M', 'D', 'C' };
+static const uint32_t fmdp_pcache_bom = 0x01020304;
+
+/* Flags of a record */
+enum {
+	/* Was probed with fmdsf_archives */
+	fmdp_pcr_archives = 1 << 0,
+	/* Directory snapshot, rather than a probed file */
+	fmdp_pcr_dir = 1 << 1,
+	/* Snapshot was taken with fmdsf_lazystat, and with or without
+	 * fmdsf_metadata (only files to be probed were stat'ed) */
+	fmdp_pcr_lazystat = 1 << 2,
+	fmdp_pcr_metadata = 1 << 3,
+	/* Was probed with fmdsf_hash, and has its digest */
+	fmdp_pcr_hashed = 1 << 4,
+	/* Of links table: file is being probed, or directory has been
+	 * scanned, see fmdp_links_claim() */
+	fmdp_pcr_pending = 1 << 5,
+	/* Looked up or probed since the cache was opened */
+	fmdp_pcr_seen = 1 << 6,
+	/* Not yet written to the cache file */
+	fmdp_pcr_dirty = 1 << 7
+};
+/* Flags, that are written to the cache file */
+#define FMDP_PCR_PERSISTENT					\
+	(fmdp_pcr_archives | fmdp_pcr_dir |			\
+	 fmdp_pcr_lazystat | fmdp_pcr_metadata | fmdp_pcr_hashed)
+
+struct FmdCacheRec {
+	struct FmdCacheRec *next;	/* in hash bucket */
+	uint64_t dev, ino;
+	int64_t size, mtime_sec;
+	uint32_t mtime_nsec;
+	uint8_t filetype, flags;
+	const char *mimetype;		/* interned, see |mimes| */
+	uint32_t len;			/* of serialized |elems| */
+	uint8_t elems[1];		/* or directory entries */
+};
+
+/* Record header, as written to the cache file; it is followed by
+ * |mimelen| bytes of mimetype and serialized elements, up to |len| */
+struct FmdCacheRecHdr {
+	uint32_t len;			/* of all that follows |len| */
+	uint8_t filetype, flags;
+	uint16_t mimelen;
+	uint32_t mtime_nsec;
+	uint32_t reserved;
+	uint64_t dev, ino;
+	int64_t size, mtime_sec;
+};
+
+/* Directory entry of a snapshot, followed by |namelen| bytes */
+struct FmdCacheDirEnt {
+	uint16_t namelen, reserved;
+	uint32_t mode, nlink, uid, gid, blksize;
+	uint64_t dev, ino, rdev;
+	int64_t size, blocks;
+	int64_t atime_sec, mtime_sec, ctime_sec;
+	uint32_t atime_nsec, mtime_nsec, ctime_nsec;
+};
+
+struct FmdCache {
+	pthread_mutex_t lock;
+	char *path;
+
+	struct FmdCacheRec **buckets;
+	size_t n_buckets, n_recs;
+
+	/* Interned mimetypes; files filled from the cache point here */
+	char **mimes;
+	size_t n_mimes;
+
+	/* Cache file has a torn tail or is of other version, and has
+	 * to be rewritten rather than appended to */
+	int rewrite;
+};
+
+
+static size_t
+fmdp_pcache_hash(uint64_t dev, uint64_t ino)
+{
+	uint64_t h = (dev * 0x9e3779b97f4a7c15ull) ^ ino;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return (size_t)h;
+}
+
+
+static struct FmdCacheRec**
+fmdp_pcache_find(struct FmdCache *cache,
+		 uint64_t dev,
+		 uint64_t ino)
+{
+	size_t b = fmdp_pcache_hash(dev, ino) & (cache->n_buckets - 1);
+	struct FmdCacheRec **prec = &cache->buckets[b];
+	while (*prec && ((*prec)->dev != dev || (*prec)->ino != ino))
+		prec = &(*prec)->next;
+	return prec;
+}
+
+
+static int
+fmdp_pcache_grow(struct FmdCache *cache)
+{
+	size_t n = cache->n_buckets ? cache->n_buckets * 2 : 4096;
+	struct FmdCacheRec **buckets =
+		(struct FmdCacheRec**)calloc(n, sizeof *buckets);
+	if (!buckets)
+		return (errno = ENOMEM), -1;
+
+	size_t i;
+	for (i = 0; i < cache->n_buckets; ++i) {
+		struct FmdCacheRec *rec = cache->buckets[i], *next;
+		for (; rec; rec = next) {
+			next = rec->next;
+			size_t b = fmdp_pcache_hash(rec->dev, rec->ino) & (n - 1);
+			rec->next = buckets[b];
+			buckets[b] = rec;
+		}
+	}
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->n_buckets = n;
+	return 0;
+}
+
+
+/* Puts |rec| into |cache|, replacing any record of the same file */
+static int
+fmdp_pcache_put(struct FmdCache *cache,
+		struct FmdCacheRec *rec)
+{
+	if (cache->n_recs >= cache->n_buckets &&
+	    fmdp_pcache_grow(cache) != 0)
+		return -1;
+
+	struct FmdCacheRec **prec = fmdp_pcache_find(cache, rec->dev, rec->ino);
+	if (*prec) {
+		rec->next = (*prec)->next;
+		free(*prec);
+	} else {
+		rec->next = 0;
+		++cache->n_recs;
+	}
+	*prec = rec;
+	return 0;
+}
+
+
+static const char*
+fmdp_pcache_intern(struct FmdCache *cache,
+		   const char *mimetype,
+		   size_t len)
+{
+	size_t i;
+	for (i = 0; i < cache->n_mimes; ++i)
+		if (!strncmp(cache->mimes[i], mimetype, len) &&
+		    cache->mimes[i][len] == '\0')
+			return cache->mimes[i];
+
+	char **mimes = (char**)realloc(cache->mimes,
+				       (cache->n_mimes + 1) * sizeof *mimes);
+	if (!mimes)
+		return 0;
+	cache->mimes = mimes;
+	char *s = (char*)malloc(len + 1);
+	if (!s)
+		return 0;
+	memcpy(s, mimetype, len);
+	s[len] = '\0';
+	return mimes[cache->n_mimes++] = s;
+}
+
+
+/* Size of |elem| when serialized, or 0 if |elem| is malformed */
+static size_t
+fmdp_pcache_elem_size(const struct FmdElem *elem)
+{
+	switch (elem->datatype) {
+	case fmddt_n:
+	case fmddt_frac:
+	case fmddt_timestamp:
+		return 2 + 8;
+	case fmddt_rational:
+		return 2 + 4 + 4;
+	case fmddt_text:
+		return 2 + 4 + strlen(elem->text);
+	}
+	return 0;
+}
+
+
+static uint8_t*
+fmdp_pcache_put_elem(uint8_t *p,
+		     const struct FmdElem *elem)
+{
+	*p++ = (uint8_t)elem->elemtype;
+	*p++ = (uint8_t)elem->datatype;
+	int64_t v;
+	int32_t r[2];
+	uint32_t len;
+	switch (elem->datatype) {
+	case fmddt_n:
+		v = elem->n;
+		memcpy(p, &v, 8);
+		return p + 8;
+	case fmddt_frac:
+		memcpy(p, &elem->frac, 8);
+		return p + 8;
+	case fmddt_timestamp:
+		v = elem->timestamp;
+		memcpy(p, &v, 8);
+		return p + 8;
+	case fmddt_rational:
+		r[0] = elem->numerator;
+		r[1] = elem->denominator;
+		memcpy(p, r, 8);
+		return p + 8;
+	case fmddt_text:
+		len = (uint32_t)strlen(elem->text);
+		memcpy(p, &len, 4);
+		memcpy(p + 4, elem->text, len);
+		return p + 4 + len;
+	}
+	return p;
+}
+
+
+/* Parses one element at |p|, no further than |end|; returns pointer
+ * past it and fills |*elem| (allocated for |file|), or returns 0 */
+static const uint8_t*
+fmdp_pcache_get_elem(const uint8_t *p,
+		     const uint8_t *end,
+		     struct FmdFile *file,
+		     struct FmdElem **pelem)
+{
+	if (end - p < 2 + 4)
+		return 0;
+	const unsigned elemtype = p[0], datatype = p[1];
+	if (elemtype > fmdet_digest || datatype > fmddt_text)
+		return 0;
+	p += 2;
+
+	uint32_t len = 0;
+	if (datatype == fmddt_text) {
+		memcpy(&len, p, 4);
+		p += 4;
+		if ((size_t)(end - p) < len)
+			return 0;
+	} else if (end - p < 8)
+		return 0;
+
+	struct FmdElem *elem = 0;
+	if (pelem) {
+		elem = fmdp_elem_new(file, len);
+		if (!elem)
+			return 0;
+		elem->elemtype = (enum FmdElemType)elemtype;
+		elem->datatype = (enum FmdDataType)datatype;
+		*pelem = elem;
+	}
+
+	int64_t v;
+	int32_t r[2];
+	switch (datatype) {
+	case fmddt_n:
+		memcpy(&v, p, 8);
+		if (elem)
+			elem->n = (long)v;
+		return p + 8;
+	case fmddt_frac:
+		if (elem)
+			memcpy(&elem->frac, p, 8);
+		return p + 8;
+	case fmddt_timestamp:
+		memcpy(&v, p, 8);
+		if (elem)
+			elem->timestamp = (time_t)v;
+		return p + 8;
+	case fmddt_rational:
+		memcpy(r, p, 8);
+		if (elem) {
+			elem->numerator = r[0];
+			elem->denominator = r[1];
+		}
+		return p + 8;
+	default:
+		if (elem) {
+			memcpy(elem->text, p, len);
+			elem->text[len] = '\0';
+		}
+		return p + len;
+	}
+}
+
+
+static uint8_t*
+fmdp_pcache_put_dirent(uint8_t *p,
+		       const struct FmdFile *file)
+{
+	const struct stat *st = &file->stat;
+	struct FmdCacheDirEnt de;
+	memset(&de, 0, sizeof de);
+	de.namelen = (uint16_t)strlen(file->name);
+	de.mode = st->st_mode;
+	de.nlink = st->st_nlink;
+	de.uid = st->st_uid;
+	de.gid = st->st_gid;
+	de.blksize = st->st_blksize;
+	de.dev = st->st_dev;
+	de.ino = st->st_ino;
+	de.rdev = st->st_rdev;
+	de.size = st->st_size;
+	de.blocks = st->st_blocks;
+	de.atime_sec = st->st_atim.tv_sec;
+	de.atime_nsec = st->st_atim.tv_nsec;
+	de.mtime_sec = st->st_mtim.tv_sec;
+	de.mtime_nsec = st->st_mtim.tv_nsec;
+	de.ctime_sec = st->st_ctim.tv_sec;
+	de.ctime_nsec = st->st_ctim.tv_nsec;
+	memcpy(p, &de, sizeof de);
+	memcpy(p + sizeof de, file->name, de.namelen);
+	return p + sizeof de + de.namelen;
+}
+
+
+/* Parses one directory entry at |p|, no further than |end|; returns
+ * pointer past it, or 0 if it is malformed */
+static const uint8_t*
+fmdp_pcache_get_dirent(const uint8_t *p,
+		       const uint8_t *end,
+		       struct FmdCacheDirEnt *de)
+{
+	if ((size_t)(end - p) < sizeof *de)
+		return 0;
+	memcpy(de, p, sizeof *de);
+	p += sizeof *de;
+	if ((size_t)(end - p) < de->namelen || !de->namelen)
+		return 0;
+	return p + de->namelen;
+}
+
+
+/* Reads the next record from |f|; returns 1 on success, 0 at the end
+ * and -1 if it is torn or malformed */
+static int
+fmdp_pcache_read_rec(struct FmdCache *cache,
+		     FILE *f)
+{
+	struct FmdCacheRecHdr hdr;
+	size_t got = fread(&hdr, 1, sizeof hdr, f);
+	if (got == 0 && feof(f))
+		return 0;
+	if (got != sizeof hdr ||
+	    hdr.len < sizeof hdr - sizeof hdr.len + hdr.mimelen ||
+	    hdr.filetype > fmdft_archive)
+		return -1;
+
+	const size_t len = hdr.len - (sizeof hdr - sizeof hdr.len) - hdr.mimelen;
+	struct FmdCacheRec *rec = (struct FmdCacheRec*)malloc(sizeof *rec + len);
+	char *mimetype = (char*)malloc(hdr.mimelen + 1u);
+	if (!rec || !mimetype ||
+	    fread(mimetype, 1, hdr.mimelen, f) != hdr.mimelen ||
+	    fread(rec->elems, 1, len, f) != len) {
+		free(rec);
+		free(mimetype);
+		return -1;
+	}
+
+	/* Validate elements, so that lookups need not to */
+	const uint8_t *p = rec->elems, *end = rec->elems + len;
+	struct FmdCacheDirEnt de;
+	while (p && p < end)
+		p = hdr.flags & fmdp_pcr_dir ?
+			fmdp_pcache_get_dirent(p, end, &de) :
+			fmdp_pcache_get_elem(p, end, 0, 0);
+
+	rec->dev = hdr.dev;
+	rec->ino = hdr.ino;
+	rec->size = hdr.size;
+	rec->mtime_sec = hdr.mtime_sec;
+	rec->mtime_nsec = hdr.mtime_nsec;
+	rec->filetype = hdr.filetype;
+	rec->flags = hdr.flags & FMDP_PCR_PERSISTENT;
+	rec->len = (uint32_t)len;
+	rec->mimetype = p ? fmdp_pcache_intern(cache, mimetype, hdr.mimelen) : 0;
+	free(mimetype);
+	if (!rec->mimetype || fmdp_pcache_put(cache, rec) != 0) {
+		free(rec);
+		return -1;
+	}
+	return 1;
+}
+
+
+static int
+fmdp_pcache_load(struct FmdCache *cache)
+{
+	FILE *f = fopen(cache->path, "rb");
+	if (!f)
+		return errno == ENOENT ? 0 : -1;
+
+	char magic[4];
+	uint32_t version, bom;
+	if (fread(magic, 1, 4, f) != 4 ||
+	    fread(&version, 1, 4, f) != 4 ||
+	    fread(&bom, 1, 4, f) != 4 ||
+	    memcmp(magic, fmdp_pcache_magic, 4) ||
+	    version != FMDP_PCACHE_VERSION || bom != fmdp_pcache_bom) {
+		/* Empty, foreign or of other version: start over */
+		cache->rewrite = 1;
+		fclose(f);
+		return 0;
+	}
+
+	int res;
+	while ((res = fmdp_pcache_read_rec(cache, f)) == 1)
+		;
+	if (res != 0)
+		cache->rewrite = 1;
+	fclose(f);
+	return 0;
+}
+
+
+static int
+fmdp_pcache_write_rec(FILE *f,
+		      const struct FmdCacheRec *rec)
+{
+	const size_t mimelen = strlen(rec->mimetype);
+	struct FmdCacheRecHdr hdr;
+	memset(&hdr, 0, sizeof hdr);
+	hdr.len = (uint32_t)(sizeof hdr - sizeof hdr.len + mimelen + rec->len);
+	hdr.filetype = rec->filetype;
+	hdr.flags = rec->flags & FMDP_PCR_PERSISTENT;
+	hdr.mimelen = (uint16_t)mimelen;
+	hdr.mtime_nsec = rec->mtime_nsec;
+	hdr.dev = rec->dev;
+	hdr.ino = rec->ino;
+	hdr.size = rec->size;
+	hdr.mtime_sec = rec->mtime_sec;
+	if (fwrite(&hdr, 1, sizeof hdr, f) != sizeof hdr ||
+	    fwrite(rec->mimetype, 1, mimelen, f) != mimelen ||
+	    fwrite(rec->elems, 1, rec->len, f) != rec->len)
+		return -1;
+	return 0;
+}
+
+
+static int
+fmdp_pcache_write_hdr(FILE *f)
+{
+	const uint32_t version = FMDP_PCACHE_VERSION;
+	if (fwrite(fmdp_pcache_magic, 1, 4, f) != 4 ||
+	    fwrite(&version, 1, 4, f) != 4 ||
+	    fwrite(&fmdp_pcache_bom, 1, 4, f) != 4)
+		return -1;
+	return 0;
+}
+
+
+/* Writes all records to a temporary file and renames it over cache
+ * file; with |drop_unseen|, drops records, that were not seen */
+static int
+fmdp_pcache_rewrite(struct FmdCache *cache,
+		    int drop_unseen)
+{
+	const size_t path_len = strlen(cache->path);
+	char *tmp = (char*)malloc(path_len + 5);
+	if (!tmp)
+		return (errno = ENOMEM), -1;
+	memcpy(tmp, cache->path, path_len);
+	memcpy(tmp + path_len, ".tmp", 5);
+
+	FILE *f = fopen(tmp, "wb");
+	if (!f) {
+		free(tmp);
+		return -1;
+	}
+	int res = fmdp_pcache_write_hdr(f);
+	size_t i;
+	for (i = 0; i < cache->n_buckets; ++i) {
+		struct FmdCacheRec **prec = &cache->buckets[i];
+		while (*prec) {
+			struct FmdCacheRec *rec = *prec;
+			if (drop_unseen && !(rec->flags & fmdp_pcr_seen)) {
+				*prec = rec->next;
+				free(rec);
+				--cache->n_recs;
+				continue;
+			}
+			if (res == 0)
+				res = fmdp_pcache_write_rec(f, rec);
+			prec = &rec->next;
+		}
+	}
+	if (fclose(f) != 0)
+		res = -1;
+	if (res == 0)
+		res = rename(tmp, cache->path);
+	if (res != 0) {
+		int err = errno;
+		unlink(tmp);
+		errno = err;
+		FMDP_X(res);
+	} else {
+		for (i = 0; i < cache->n_buckets; ++i) {
+			struct FmdCacheRec *rec;
+			for (rec = cache->buckets[i]; rec; rec = rec->next)
+				rec->flags &= ~fmdp_pcr_dirty;
+		}
+		cache->rewrite = 0;
+	}
+	free(tmp);
+	return res;
+}
+
+
+struct FmdCache*
+fmd_cache_open(const char *path)
+{
+	assert(path);
+	if (!path)
+		return (errno = EINVAL), (struct FmdCache*)0;
+
+	struct FmdCache *cache = (struct FmdCache*)calloc(1, sizeof *cache);
+	if (!cache || !(cache->path = strdup(path)) ||
+	    fmdp_pcache_grow(cache) != 0) {
+		if (cache)
+			free(cache->path);
+		free(cache);
+		return (errno = ENOMEM), (struct FmdCache*)0;
+	}
+	pthread_mutex_init(&cache->lock, 0);
+
+	if (fmdp_pcache_load(cache) != 0) {
+		int err = errno;
+		FMDP_X(-1);
+		fmd_cache_close(cache);
+		return (errno = err), (struct FmdCache*)0;
+	}
+	return cache;
+}
+
+
+int
+fmd_cache_flush(struct FmdCache *cache)
+{
+	assert(cache);
+	if (!cache)
+		return (errno = EINVAL), -1;
+
+	pthread_mutex_lock(&cache->lock);
+	int res;
+	if (cache->rewrite) {
+		res = fmdp_pcache_rewrite(cache, 0);
+		pthread_mutex_unlock(&cache->lock);
+		return res;
+	}
+
+	FILE *f = fopen(cache->path, "ab");
+	if (!f) {
+		pthread_mutex_unlock(&cache->lock);
+		FMDP_X(-1);
+		return -1;
+	}
+	res = ftello(f) == 0 ? fmdp_pcache_write_hdr(f) : 0;
+	size_t i;
+	for (i = 0; i < cache->n_buckets && res == 0; ++i) {
+		struct FmdCacheRec *rec;
+		for (rec = cache->buckets[i]; rec && res == 0; rec = rec->next)
+			if (rec->flags & fmdp_pcr_dirty) {
+				res = fmdp_pcache_write_rec(f, rec);
+				rec->flags &= ~fmdp_pcr_dirty;
+			}
+	}
+	if (fclose(f) != 0)
+		res = -1;
+	if (res != 0) {
+		/* Part of a record could have been written */
+		cache->rewrite = 1;
+		FMDP_X(res);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return res;
+}
+
+
+int
+fmd_cache_compact(struct FmdCache *cache,
+		  int drop_unseen)
+{
+	assert(cache);
+	if (!cache)
+		return (errno = EINVAL), -1;
+
+	pthread_mutex_lock(&cache->lock);
+	int res = fmdp_pcache_rewrite(cache, drop_unseen);
+	pthread_mutex_unlock(&cache->lock);
+	return res;
+}
+
+
+int
+fmd_cache_close(struct FmdCache *cache)
+{
+	if (!cache)
+		return 0;
+
+	int res = fmd_cache_flush(cache);
+	size_t i;
+	for (i = 0; i < cache->n_buckets; ++i) {
+		struct FmdCacheRec *rec = cache->buckets[i], *next;
+		for (; rec; rec = next) {
+			next = rec->next;
+			free(rec);
+		}
+	}
+	for (i = 0; i < cache->n_mimes; ++i)
+		free(cache->mimes[i]);
+	free(cache->mimes);
+	free(cache->buckets);
+	free(cache->path);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+	return res;
+}
+
+
+/* Fills |file| from |rec|, if it is of the same size and mtime;
+ * returns 0 then, -1 otherwise. Called with |cache->lock| held */
+static int
+fmdp_pcache_fill_rec(struct FmdScanJob *job,
+		     const struct FmdCacheRec *rec,
+		     struct FmdFile *file)
+{
+	const int archives = (job->flags & fmdsf_archives) == fmdsf_archives;
+	const int hash = FMDP_HASH(job);
+	if (!rec || (rec->flags & (fmdp_pcr_dir | fmdp_pcr_pending)) ||
+	    (hash && !(rec->flags & fmdp_pcr_hashed)) ||
+	    rec->size != file->stat.st_size ||
+	    rec->mtime_sec != file->stat.st_mtim.tv_sec ||
+	    rec->mtime_nsec != (uint32_t)file->stat.st_mtim.tv_nsec ||
+	    /* Unless recognized by its format, a file probed with
+	     * archives differs from one probed without */
+	    (archives != !!(rec->flags & fmdp_pcr_archives) &&
+	     (rec->filetype == fmdft_file ||
+	      rec->filetype == fmdft_archive)))
+		return -1;
+
+	struct FmdElem *head = 0, **ptail = &head;
+	const uint8_t *p = rec->elems, *end = rec->elems + rec->len;
+	while (p < end && (p = fmdp_pcache_get_elem(p, end, file, ptail))) {
+		/* Digest is left out, unless hashing */
+		if (!hash && (*ptail)->elemtype == fmdet_digest) {
+			fmdp_elem_free(file, *ptail);
+			*ptail = 0;
+		} else
+			ptail = &(*ptail)->next;
+	}
+	if (!p) {
+		while (head) {
+			struct FmdElem *next = head->next;
+			fmdp_elem_free(file, head);
+			head = next;
+		}
+		return -1;
+	}
+	file->filetype = (enum FmdFileType)rec->filetype;
+	file->mimetype = rec->mimetype;
+	*ptail = file->metadata;
+	file->metadata = head;
+	return 0;
+}
+
+
+/* Returns record of probed |file|, with its mimetype yet to be set,
+ * or 0, if it cannot be recorded */
+static struct FmdCacheRec*
+fmdp_pcache_rec_new(struct FmdScanJob *job,
+		    const struct FmdFile *file)
+{
+	/* Archive children cannot be cached */
+	if (file->next)
+		return 0;
+
+	size_t len = 0, sz;
+	const struct FmdElem *elem;
+	for (elem = file->metadata; elem; elem = elem->next) {
+		if (!(sz = fmdp_pcache_elem_size(elem)))
+			return 0;
+		len += sz;
+	}
+	if (len > UINT32_MAX / 2)
+		return 0;
+
+	struct FmdCacheRec *rec = (struct FmdCacheRec*)malloc(sizeof *rec + len);
+	if (!rec)
+		return 0;
+	uint8_t *p = rec->elems;
+	for (elem = file->metadata; elem; elem = elem->next)
+		p = fmdp_pcache_put_elem(p, elem);
+	rec->dev = file->stat.st_dev;
+	rec->ino = file->stat.st_ino;
+	rec->size = file->stat.st_size;
+	rec->mtime_sec = file->stat.st_mtim.tv_sec;
+	rec->mtime_nsec = (uint32_t)file->stat.st_mtim.tv_nsec;
+	rec->filetype = (uint8_t)file->filetype;
+	rec->flags = 0;
+	if ((job->flags & fmdsf_archives) == fmdsf_archives)
+		rec->flags |= fmdp_pcr_archives;
+	if (FMDP_HASH(job))
+		rec->flags |= fmdp_pcr_hashed;
+	rec->mimetype = 0;
+	rec->len = (uint32_t)len;
+	return rec;
+}
+
+
+int
+fmdp_probe_cache_fill(struct FmdScanJob *job,
+		      struct FmdFile *file)
+{
+	assert(job);
+	assert(job->cache);
+	assert(file);
+
+	struct FmdCache *cache = job->cache;
+	pthread_mutex_lock(&cache->lock);
+	struct FmdCacheRec *rec =
+		*fmdp_pcache_find(cache, file->stat.st_dev, file->stat.st_ino);
+	const int hit = fmdp_pcache_fill_rec(job, rec, file) == 0;
+	if (hit)
+		rec->flags |= fmdp_pcr_seen;
+	pthread_mutex_unlock(&cache->lock);
+
+	if (!hit) {
+		++job->n_pcachemisses;
+		return -1;
+	}
+	++job->n_pcachehits;
+	return 0;
+}
+
+
+void
+fmdp_probe_cache_store(struct FmdScanJob *job,
+		       struct FmdFile *file)
+{
+	assert(job);
+	assert(job->cache);
+	assert(file);
+
+	const char *mimetype = file->mimetype ? file->mimetype : "";
+	const size_t mimelen = strlen(mimetype);
+	struct FmdCacheRec *rec;
+	if (mimelen > UINT16_MAX || !(rec = fmdp_pcache_rec_new(job, file)))
+		return;
+	rec->flags |= fmdp_pcr_seen | fmdp_pcr_dirty;
+
+	struct FmdCache *cache = job->cache;
+	pthread_mutex_lock(&cache->lock);
+	rec->mimetype = fmdp_pcache_intern(cache, mimetype, mimelen);
+	if (!rec->mimetype || fmdp_pcache_put(cache, rec) != 0)
+		free(rec);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+struct FmdCache*
+fmdp_links_new(void)
+{
+	struct FmdCache *links = (struct FmdCache*)calloc(1, sizeof *links);
+	if (!links || fmdp_pcache_grow(links) != 0) {
+		free(links);
+		return (errno = ENOMEM), (struct FmdCache*)0;
+	}
+	pthread_mutex_init(&links->lock, 0);
+	return links;
+}
+
+
+void
+fmdp_links_free(struct FmdCache *links)
+{
+	if (!links)
+		return;
+	size_t i;
+	for (i = 0; i < links->n_buckets; ++i) {
+		struct FmdCacheRec *rec = links->buckets[i], *next;
+		for (; rec; rec = next) {
+			next = rec->next;
+			free(rec);
+		}
+	}
+	free(links->buckets);
+	pthread_mutex_destroy(&links->lock);
+	free(links);
+}
+
+
+/* Puts pending record of |dev| and |ino| into |links|; called with
+ * its lock held */
+static int
+fmdp_links_pend(struct FmdCache *links,
+		dev_t dev, ino_t ino, uint8_t flags)
+{
+	struct FmdCacheRec *rec = (struct FmdCacheRec*)calloc(1, sizeof *rec);
+	if (!rec)
+		return (errno = ENOMEM), -1;
+	rec->dev = dev;
+	rec->ino = ino;
+	rec->flags = fmdp_pcr_pending | flags;
+	if (fmdp_pcache_put(links, rec) != 0) {
+		free(rec);
+		return -1;
+	}
+	return 0;
+}
+
+
+int
+fmdp_links_claim(struct FmdScanJob *job,
+		 struct FmdFile *file)
+{
+	assert(job);
+	assert(file);
+
+	struct FmdCache *links = job->priv ? job->priv->links : 0;
+	if (!links || file->stat.st_nlink < 2)
+		return 1;
+
+	int res = 1;
+	pthread_mutex_lock(&links->lock);
+	struct FmdCacheRec *rec =
+		*fmdp_pcache_find(links, file->stat.st_dev, file->stat.st_ino);
+	if (fmdp_pcache_fill_rec(job, rec, file) == 0) {
+		file->flags |= fmdff_link;
+		++job->n_linkhits;
+		res = 0;
+	} else if (rec && (rec->flags & fmdp_pcr_pending)) {
+		res = -1;
+	} else if (!rec) {
+		(void)fmdp_links_pend(links, file->stat.st_dev,
+				      file->stat.st_ino, 0);
+	}
+	pthread_mutex_unlock(&links->lock);
+	return res;
+}
+
+
+void
+fmdp_links_store(struct FmdScanJob *job,
+		 struct FmdFile *file)
+{
+	assert(job);
+	assert(file);
+
+	struct FmdCache *links = job->priv ? job->priv->links : 0;
+	struct FmdCacheRec *rec;
+	if (!links || file->stat.st_nlink < 2 ||
+	    !(rec = fmdp_pcache_rec_new(job, file)))
+		return;
+	rec->mimetype = file->mimetype;
+	pthread_mutex_lock(&links->lock);
+	if (fmdp_pcache_put(links, rec) != 0)
+		free(rec);
+	pthread_mutex_unlock(&links->lock);
+}
+
+
+int
+fmdp_links_visit(struct FmdScanJob *job,
+		 const struct stat *st)
+{
+	assert(job);
+	assert(st);
+
+	struct FmdCache *links = job->priv ? job->priv->links : 0;
+	if (!links)
+		return 0;
+
+	pthread_mutex_lock(&links->lock);
+	const int seen = *fmdp_pcache_find(links, st->st_dev, st->st_ino) != 0;
+	if (!seen)
+		(void)fmdp_links_pend(links, st->st_dev, st->st_ino,
+				      fmdp_pcr_dir);
+	pthread_mutex_unlock(&links->lock);
+	return seen;
+}
+
+
+int
+fmdp_dir_cache_fill(struct FmdScanJob *job,
+		    const struct stat *st,
+		    const char *path,
+		    struct FmdDirList *list)
+{
+	assert(job);
+	assert(job->cache);
+	assert(st);
+	assert(path);
+	assert(list);
+
+	enum { fullpath_sz = 2048 };
+	const size_t path_len = strlen(path) + 1;
+	if (path_len + 10 > fullpath_sz)
+		return (errno = ENAMETOOLONG), -1;
+	char fullpath[fullpath_sz];
+	memcpy(fullpath, path, path_len - 1);
+	fullpath[path_len - 1] = '/';
+
+	struct FmdCache *cache = job->cache;
+	const int lazystat = (job->flags & fmdsf_lazystat) == fmdsf_lazystat;
+	const int metadata = (job->flags & fmdsf_metadata) == fmdsf_metadata;
+	const size_t from = list->n;
+	int hit = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	struct FmdCacheRec *rec = *fmdp_pcache_find(cache, st->st_dev, st->st_ino);
+	if (rec && (rec->flags & fmdp_pcr_dir) &&
+	    rec->size == st->st_size &&
+	    rec->mtime_sec == st->st_mtim.tv_sec &&
+	    rec->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec &&
+	    /* Lazy snapshot lacks stats, that this job might need */
+	    (!(rec->flags & fmdp_pcr_lazystat) ||
+	     (lazystat && (!metadata || (rec->flags & fmdp_pcr_metadata))))) {
+		const uint8_t *p = rec->elems, *end = rec->elems + rec->len;
+		struct FmdCacheDirEnt de;
+		for (hit = 1; p < end && hit; ) {
+			const uint8_t *name = p + sizeof de;
+			if (!(p = fmdp_pcache_get_dirent(p, end, &de))) {
+				hit = 0;
+				break;
+			}
+			if (path_len + de.namelen + 1 >= sizeof fullpath)
+				continue; /* path too long */
+			memcpy(fullpath + path_len, name, de.namelen);
+			fullpath[path_len + de.namelen] = '\0';
+			struct FmdFile *file = fmdp_file_new(job, fullpath);
+			if (!file || fmdp_dir_list_add(list, file) != 0) {
+				fmd_free(file);
+				hit = 0;
+				break;
+			}
+			struct stat *fst = &file->stat;
+			fst->st_mode = de.mode;
+			fst->st_nlink = de.nlink;
+			fst->st_uid = de.uid;
+			fst->st_gid = de.gid;
+			fst->st_blksize = de.blksize;
+			fst->st_dev = de.dev;
+			fst->st_ino = de.ino;
+			fst->st_rdev = de.rdev;
+			fst->st_size = de.size;
+			fst->st_blocks = de.blocks;
+			fst->st_atim.tv_sec = de.atime_sec;
+			fst->st_atim.tv_nsec = de.atime_nsec;
+			fst->st_mtim.tv_sec = de.mtime_sec;
+			fst->st_mtim.tv_nsec = de.mtime_nsec;
+			fst->st_ctim.tv_sec = de.ctime_sec;
+			fst->st_ctim.tv_nsec = de.ctime_nsec;
+			if (S_ISDIR(fst->st_mode)) {
+				file->filetype = fmdft_directory;
+				file->mimetype = 0;
+			}
+		}
+		if (hit)
+			rec->flags |= fmdp_pcr_seen;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (!hit) {
+		++job->n_snapmisses;
+		size_t i;
+		for (i = from; i < list->n; ++i)
+			fmd_free(list->entries[i]);
+		list->n = from;
+		return -1;
+	}
+	++job->n_snaphits;
+	return 0;
+}
+
+
+void
+fmdp_dir_cache_store(struct FmdScanJob *job,
+		     const struct stat *st,
+		     const struct FmdDirList *list,
+		     size_t from)
+{
+	assert(job);
+	assert(job->cache);
+	assert(st);
+	assert(list);
+
+	size_t len = 0, i;
+	for (i = from; i < list->n; ++i)
+		len += sizeof (struct FmdCacheDirEnt) +
+			strlen(list->entries[i]->name);
+	if (len > UINT32_MAX / 2)
+		return;
+
+	struct FmdCacheRec *rec = (struct FmdCacheRec*)malloc(sizeof *rec + len);
+	if (!rec)
+		return;
+	uint8_t *p = rec->elems;
+	for (i = from; i < list->n; ++i)
+		p = fmdp_pcache_put_dirent(p, list->entries[i]);
+	rec->dev = st->st_dev;
+	rec->ino = st->st_ino;
+	rec->size = st->st_size;
+	rec->mtime_sec = st->st_mtim.tv_sec;
+	rec->mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+	rec->filetype = fmdft_directory;
+	rec->flags = fmdp_pcr_dir | fmdp_pcr_seen | fmdp_pcr_dirty;
+	if ((job->flags & fmdsf_lazystat) == fmdsf_lazystat)
+		rec->flags |= fmdp_pcr_lazystat;
+	if ((job->flags & fmdsf_metadata) == fmdsf_metadata)
+		rec->flags |= fmdp_pcr_metadata;
+	rec->len = (uint32_t)len;
+
+	struct FmdCache *cache = job->cache;
+	pthread_mutex_lock(&cache->lock);
+	rec->mimetype = fmdp_pcache_intern(cache, "", 0);
+	if (!rec->mimetype || fmdp_pcache_put(cache, rec) != 0)
+		free(rec);
+	pthread_mutex_unlock(&cache->lock);
+}
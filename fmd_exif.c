@@ -205,6 +205,8 @@ fmdp_do_exif(struct FmdStream *stream)
 				if (rv == 0)
 					stream->file->mimetype = "image/jpeg";
 			}
+			if (rv == 0 && !fmdp_wants_more(job, stream->file))
+				break;
 		}
 	}
 	iter->free(iter);
@@ -0,0 +1,272 @@
+#include "fmd_priv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <dirent.h>
+
+/* Filters of directory entries.
+ *
+ * Patterns of |job->include|, |exclude| and |prune| are compiled,
+ * when the scan starts: most of them are a literal name ("Makefile"),
+ * a literal suffix ("*.mp3") or prefix ("tmp*"), which are matched by
+ * comparing octets; the rest go to fnmatch(3), against the name, or
+ * the whole path, if they contain '/'.
+ *
+ * Entries are filtered by name, as they are listed, where d_type
+ * tells a directory from a file; the rest, and files to be filtered
+ * by size, are filtered again, once stat'ed */
+
+enum FmdGlobKind {
+	fmdgk_name,	/* literal name */
+	fmdgk_suffix,	/* '*' and a literal */
+	fmdgk_prefix,	/* a literal and '*' */
+	fmdgk_glob,	/* fnmatch(3) against name */
+	fmdgk_path	/* fnmatch(3) against path */
+};
+
+struct FmdGlob {
+	const char *lit;	/* literal part, or pattern itself */
+	size_t len;
+	enum FmdGlobKind kind;
+};
+
+struct FmdGlobSet {
+	struct FmdGlob *globs;
+	size_t n;
+};
+
+struct FmdFilter {
+	struct FmdGlobSet include, exclude, prune;
+	off_t size_min, size_max;
+};
+
+
+static int
+fmdp_glob_literal(const char *p, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; ++i)
+		if (p[i] == '*' || p[i] == '?' || p[i] == '[' || p[i] == '\\')
+			return 0;
+	return 1;
+}
+
+
+static int
+fmdp_globset_init(struct FmdGlobSet *set,
+		  const char *const *patterns)
+{
+	set->globs = 0;
+	set->n = 0;
+	size_t n = 0;
+	while (patterns && patterns[n])
+		++n;
+	if (!n)
+		return 0;
+	set->globs = (struct FmdGlob*)malloc(n * sizeof *set->globs);
+	if (!set->globs)
+		return (errno = ENOMEM), -1;
+
+	for (; set->n < n; ++set->n) {
+		const char *pat = patterns[set->n];
+		struct FmdGlob *g = &set->globs[set->n];
+		const size_t len = strlen(pat);
+		g->lit = pat;
+		g->len = len;
+		if (strchr(pat, '/'))
+			g->kind = fmdgk_path;
+		else if (fmdp_glob_literal(pat, len))
+			g->kind = fmdgk_name;
+		else if (pat[0] == '*' && fmdp_glob_literal(pat + 1, len - 1)) {
+			g->kind = fmdgk_suffix;
+			++g->lit;
+			--g->len;
+		} else if (len && pat[len - 1] == '*' &&
+			   fmdp_glob_literal(pat, len - 1)) {
+			g->kind = fmdgk_prefix;
+			--g->len;
+		} else
+			g->kind = fmdgk_glob;
+	}
+	return 0;
+}
+
+
+static int
+fmdp_globset_match(const struct FmdGlobSet *set,
+		   const char *path,
+		   const char *name)
+{
+	const size_t len = strlen(name);
+	size_t i;
+	for (i = 0; i < set->n; ++i) {
+		const struct FmdGlob *g = &set->globs[i];
+		switch (g->kind) {
+		case fmdgk_name:
+			if (len == g->len && memcmp(name, g->lit, len) == 0)
+				return 1;
+			break;
+		case fmdgk_suffix:
+			if (len >= g->len &&
+			    memcmp(name + len - g->len, g->lit, g->len) == 0)
+				return 1;
+			break;
+		case fmdgk_prefix:
+			if (len >= g->len && memcmp(name, g->lit, g->len) == 0)
+				return 1;
+			break;
+		case fmdgk_glob:
+			if (fnmatch(g->lit, name, 0) == 0)
+				return 1;
+			break;
+		case fmdgk_path:
+			if (fnmatch(g->lit, path, 0) == 0)
+				return 1;
+			break;
+		}
+	}
+	return 0;
+}
+
+
+int
+fmdp_filter_new(const struct FmdScanJob *job,
+		struct FmdFilter **pfilter)
+{
+	assert(job);
+	assert(pfilter);
+
+	*pfilter = 0;
+	if (!job->include && !job->exclude && !job->prune &&
+	    !job->size_min && !job->size_max)
+		return 0;
+
+	struct FmdFilter *filter = (struct FmdFilter*)calloc(1, sizeof *filter);
+	if (!filter)
+		return (errno = ENOMEM), -1;
+	if (fmdp_globset_init(&filter->include, job->include) != 0 ||
+	    fmdp_globset_init(&filter->exclude, job->exclude) != 0 ||
+	    fmdp_globset_init(&filter->prune, job->prune) != 0) {
+		fmdp_filter_free(filter);
+		FMDP_X(-1);
+		return (errno = ENOMEM), -1;
+	}
+	filter->size_min = job->size_min;
+	filter->size_max = job->size_max;
+	*pfilter = filter;
+	return 0;
+}
+
+
+void
+fmdp_filter_free(struct FmdFilter *filter)
+{
+	if (!filter)
+		return;
+	free(filter->include.globs);
+	free(filter->exclude.globs);
+	free(filter->prune.globs);
+	free(filter);
+}
+
+
+static int
+fmdp_filter_excluded(const struct FmdFilter *filter,
+		     const char *path,
+		     const char *name)
+{
+	return (filter->include.n &&
+		!fmdp_globset_match(&filter->include, path, name)) ||
+		fmdp_globset_match(&filter->exclude, path, name);
+}
+
+
+int
+fmdp_filter_name(struct FmdScanJob *job,
+		 const char *path,
+		 const char *name,
+		 unsigned char type)
+{
+	assert(job);
+	assert(path);
+	assert(name);
+
+	const struct FmdFilter *filter = job->priv ? job->priv->filter : 0;
+	if (!filter)
+		return 0;
+	const int sized = filter->size_min || filter->size_max;
+#if defined (DT_DIR)
+	if (type == DT_DIR)
+		return fmdp_globset_match(&filter->prune, path, name);
+	if (type != DT_UNKNOWN && type != DT_LNK) {
+		if (fmdp_filter_excluded(filter, path, name))
+			return 1;
+		return type == DT_REG && sized ? -1 : 0;
+	}
+#else
+	(void)type;
+#endif
+	/* Symbolic links are followed, so their type is unknown */
+	const int pruned = fmdp_globset_match(&filter->prune, path, name);
+	const int excluded = fmdp_filter_excluded(filter, path, name);
+	if (pruned && excluded)
+		return 1;
+	return pruned || excluded || sized ? -1 : 0;
+}
+
+
+int
+fmdp_filter_file(struct FmdScanJob *job,
+		 const struct FmdFile *file)
+{
+	assert(job);
+	assert(file);
+
+	const struct FmdFilter *filter = job->priv ? job->priv->filter : 0;
+	if (!filter)
+		return 0;
+	if (S_ISDIR(file->stat.st_mode))
+		return fmdp_globset_match(&filter->prune, file->path,
+					  file->name);
+	if (fmdp_filter_excluded(filter, file->path, file->name))
+		return 1;
+	return S_ISREG(file->stat.st_mode) &&
+		(file->stat.st_size < filter->size_min ||
+		 (filter->size_max && file->stat.st_size > filter->size_max));
+}
+
+
+int
+fmdp_filter_sized(const struct FmdScanJob *job)
+{
+	assert(job);
+
+	const struct FmdFilter *filter = job->priv ? job->priv->filter : 0;
+	return filter && (filter->size_min || filter->size_max);
+}
+
+
+void
+fmdp_filter_list(struct FmdScanJob *job,
+		 struct FmdDirList *list,
+		 size_t from)
+{
+	assert(job);
+	assert(list);
+
+	if (!job->priv || !job->priv->filter)
+		return;
+	size_t i, k;
+	for (i = k = from; i < list->n; ++i) {
+		if (fmdp_filter_file(job, list->entries[i]))
+			fmd_free(list->entries[i]);
+		else
+			list->entries[k++] = list->entries[i];
+	}
+	list->n = k;
+}
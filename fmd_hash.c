@@ -0,0 +1,539 @@
+#include "fmd_priv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined (FMDP_HASH_SIMD)
+/* Widest vectors to hash with: 0 -- none, 1 -- SSE2, 2 -- AVX2 */
+#  define FMDP_HASH_SIMD 2
+#endif
+#if FMDP_HASH_SIMD && defined (__x86_64__) && defined (__GNUC__)
+#  define FMDP_HASH_X86 1
+#  include <immintrin.h>
+#endif
+
+/* Content hashing, see fmdsf_hash.
+ *
+ * Contents of a file are hashed with XXH3 (64-bit, no seed), as
+ * xxhsum -H3 does, once it's probed: read through its stream, so its
+ * header and tail come from cache pages, or right from its mapping.
+ * Long inputs are hashed by stripes of 64 octets into 8 lanes of
+ * accumulators; those are done with SSE2 or, if the CPU has it, AVX2,
+ * chosen at run time, and the rest is scalar */
+
+#define FMDP_XXH_STRIPE 64
+#define FMDP_XXH_SECRET_SZ 192
+#define FMDP_XXH_STRIPES_PER_BLOCK					\
+	((FMDP_XXH_SECRET_SZ - FMDP_XXH_STRIPE) / 8)
+#define FMDP_XXH_BUFFER_SZ 256
+#define FMDP_XXH_MID_MAX 240
+
+#define FMDP_PRIME32_1 0x9E3779B1U
+#define FMDP_PRIME32_2 0x85EBCA77U
+#define FMDP_PRIME32_3 0xC2B2AE3DU
+#define FMDP_PRIME64_1 0x9E3779B185EBCA87ULL
+#define FMDP_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define FMDP_PRIME64_3 0x165667B19E3779F9ULL
+#define FMDP_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define FMDP_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static const uint8_t fmdp_xxh_secret[FMDP_XXH_SECRET_SZ] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c,
+	0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+	0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, 0xcb, 0x79, 0xe6, 0x4e,
+	0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6,
+	0x81, 0x3a, 0x26, 0x4c, 0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+	0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97,
+	0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7,
+	0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+	0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, 0xea, 0xc5, 0xac, 0x83,
+	0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26,
+	0x29, 0xd4, 0x68, 0x9e, 0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+	0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f,
+	0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+/* Accumulates |n| stripes of |p| into |acc|, with the secret at |key|
+ * advancing by 8 octets a stripe; and scrambles |acc| with |key| */
+typedef void (*FmdpXxhAccumulate)(uint64_t *acc, const uint8_t *p,
+				  const uint8_t *key, size_t n);
+typedef void (*FmdpXxhScramble)(uint64_t *acc, const uint8_t *key);
+
+static struct {
+	FmdpXxhAccumulate accumulate;
+	FmdpXxhScramble scramble;
+} fmdp_xxh_impl;
+static pthread_once_t fmdp_xxh_once = PTHREAD_ONCE_INIT;
+
+struct FmdHashState {
+	uint64_t acc[8];
+	uint8_t buf[FMDP_XXH_BUFFER_SZ];
+	size_t buffered;
+	size_t stripes;		/* of current block, accumulated */
+	uint64_t total;
+};
+
+
+static uint32_t
+fmdp_xxh_read32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+static uint64_t
+fmdp_xxh_read64(const uint8_t *p)
+{
+	return (uint64_t)fmdp_xxh_read32(p) |
+		(uint64_t)fmdp_xxh_read32(p + 4) << 32;
+}
+
+
+static uint64_t
+fmdp_xxh_swap64(uint64_t x)
+{
+	x = (x & 0x00000000ffffffffULL) << 32 | x >> 32;
+	x = (x & 0x0000ffff0000ffffULL) << 16 | (x >> 16 & 0x0000ffff0000ffffULL);
+	return (x & 0x00ff00ff00ff00ffULL) << 8 | (x >> 8 & 0x00ff00ff00ff00ffULL);
+}
+
+
+/* Folds 128-bit product of |a| and |b| into 64 bits */
+static uint64_t
+fmdp_xxh_mul128_fold64(uint64_t a, uint64_t b)
+{
+#if defined (__SIZEOF_INT128__)
+	const unsigned __int128 r = (unsigned __int128)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+	const uint64_t lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+	const uint64_t hi_lo = (a >> 32) * (b & 0xffffffff);
+	const uint64_t lo_hi = (a & 0xffffffff) * (b >> 32);
+	const uint64_t hi_hi = (a >> 32) * (b >> 32);
+	const uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+	const uint64_t hi = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+	return ((cross << 32) | (lo_lo & 0xffffffff)) ^ hi;
+#endif
+}
+
+
+static uint64_t
+fmdp_xxh64_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= FMDP_PRIME64_2;
+	h ^= h >> 29;
+	h *= FMDP_PRIME64_3;
+	return h ^ (h >> 32);
+}
+
+
+static uint64_t
+fmdp_xxh3_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	return h ^ (h >> 32);
+}
+
+
+static uint64_t
+fmdp_xxh3_rrmxmx(uint64_t h, uint64_t len)
+{
+	h ^= (h << 49 | h >> 15) ^ (h << 24 | h >> 40);
+	h *= 0x9FB21C651E98DF25ULL;
+	h ^= (h >> 35) + len;
+	h *= 0x9FB21C651E98DF25ULL;
+	return h ^ (h >> 28);
+}
+
+
+static uint64_t
+fmdp_xxh3_mix16(const uint8_t *p, const uint8_t *key)
+{
+	return fmdp_xxh_mul128_fold64(fmdp_xxh_read64(p) ^ fmdp_xxh_read64(key),
+				      fmdp_xxh_read64(p + 8) ^
+				      fmdp_xxh_read64(key + 8));
+}
+
+
+/* Hashes up to FMDP_XXH_MID_MAX octets at once */
+static uint64_t
+fmdp_xxh3_short(const uint8_t *p, size_t len)
+{
+	const uint8_t *key = fmdp_xxh_secret;
+	if (len > 128) {
+		uint64_t acc = len * FMDP_PRIME64_1;
+		const size_t rounds = len / 16;
+		size_t i;
+		for (i = 0; i < 8; ++i)
+			acc += fmdp_xxh3_mix16(p + 16 * i, key + 16 * i);
+		acc = fmdp_xxh3_avalanche(acc);
+		for (i = 8; i < rounds; ++i)
+			acc += fmdp_xxh3_mix16(p + 16 * i, key + 16 * (i - 8) + 3);
+		acc += fmdp_xxh3_mix16(p + len - 16, key + 136 - 17);
+		return fmdp_xxh3_avalanche(acc);
+	}
+	if (len > 16) {
+		uint64_t acc = len * FMDP_PRIME64_1;
+		if (len > 32) {
+			if (len > 64) {
+				if (len > 96) {
+					acc += fmdp_xxh3_mix16(p + 48, key + 96);
+					acc += fmdp_xxh3_mix16(p + len - 64,
+							       key + 112);
+				}
+				acc += fmdp_xxh3_mix16(p + 32, key + 64);
+				acc += fmdp_xxh3_mix16(p + len - 48, key + 80);
+			}
+			acc += fmdp_xxh3_mix16(p + 16, key + 32);
+			acc += fmdp_xxh3_mix16(p + len - 32, key + 48);
+		}
+		acc += fmdp_xxh3_mix16(p, key);
+		acc += fmdp_xxh3_mix16(p + len - 16, key + 16);
+		return fmdp_xxh3_avalanche(acc);
+	}
+	if (len > 8) {
+		const uint64_t lo = fmdp_xxh_read64(p) ^
+			(fmdp_xxh_read64(key + 24) ^ fmdp_xxh_read64(key + 32));
+		const uint64_t hi = fmdp_xxh_read64(p + len - 8) ^
+			(fmdp_xxh_read64(key + 40) ^ fmdp_xxh_read64(key + 48));
+		return fmdp_xxh3_avalanche(len + fmdp_xxh_swap64(lo) + hi +
+					   fmdp_xxh_mul128_fold64(lo, hi));
+	}
+	if (len >= 4) {
+		const uint64_t in = fmdp_xxh_read32(p + len - 4) +
+			((uint64_t)fmdp_xxh_read32(p) << 32);
+		const uint64_t flip = fmdp_xxh_read64(key + 8) ^
+			fmdp_xxh_read64(key + 16);
+		return fmdp_xxh3_rrmxmx(in ^ flip, len);
+	}
+	if (len) {
+		const uint32_t combo = (uint32_t)p[0] << 16 |
+			(uint32_t)p[len >> 1] << 24 | (uint32_t)p[len - 1] |
+			(uint32_t)len << 8;
+		const uint64_t flip = fmdp_xxh_read32(key) ^
+			fmdp_xxh_read32(key + 4);
+		return fmdp_xxh64_avalanche(combo ^ flip);
+	}
+	return fmdp_xxh64_avalanche(fmdp_xxh_read64(key + 56) ^
+				    fmdp_xxh_read64(key + 64));
+}
+
+
+static void
+fmdp_xxh_accumulate_scalar(uint64_t *acc,
+			   const uint8_t *p,
+			   const uint8_t *key,
+			   size_t n)
+{
+	size_t s, i;
+	for (s = 0; s < n; ++s, p += FMDP_XXH_STRIPE, key += 8)
+		for (i = 0; i < 8; ++i) {
+			const uint64_t v = fmdp_xxh_read64(p + 8 * i);
+			const uint64_t k = v ^ fmdp_xxh_read64(key + 8 * i);
+			acc[i ^ 1] += v;
+			acc[i] += (k & 0xffffffff) * (k >> 32);
+		}
+}
+
+
+static void
+fmdp_xxh_scramble_scalar(uint64_t *acc,
+			 const uint8_t *key)
+{
+	size_t i;
+	for (i = 0; i < 8; ++i) {
+		uint64_t a = acc[i];
+		a ^= a >> 47;
+		a ^= fmdp_xxh_read64(key + 8 * i);
+		acc[i] = a * FMDP_PRIME32_1;
+	}
+}
+
+
+#if defined (FMDP_HASH_X86)
+static void
+fmdp_xxh_accumulate_sse2(uint64_t *acc,
+			 const uint8_t *p,
+			 const uint8_t *key,
+			 size_t n)
+{
+	__m128i a[4];
+	size_t s, i;
+	for (i = 0; i < 4; ++i)
+		a[i] = _mm_loadu_si128((const __m128i*)acc + i);
+	for (s = 0; s < n; ++s, p += FMDP_XXH_STRIPE, key += 8)
+		for (i = 0; i < 4; ++i) {
+			const __m128i v = _mm_loadu_si128((const __m128i*)p + i);
+			const __m128i k = _mm_xor_si128(
+				v, _mm_loadu_si128((const __m128i*)key + i));
+			const __m128i khi = _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1));
+			a[i] = _mm_add_epi64(a[i], _mm_mul_epu32(k, khi));
+			a[i] = _mm_add_epi64(a[i], _mm_shuffle_epi32(
+						     v, _MM_SHUFFLE(1, 0, 3, 2)));
+		}
+	for (i = 0; i < 4; ++i)
+		_mm_storeu_si128((__m128i*)acc + i, a[i]);
+}
+
+
+static void
+fmdp_xxh_scramble_sse2(uint64_t *acc,
+		       const uint8_t *key)
+{
+	const __m128i prime = _mm_set1_epi32((int)FMDP_PRIME32_1);
+	size_t i;
+	for (i = 0; i < 4; ++i) {
+		__m128i a = _mm_loadu_si128((const __m128i*)acc + i);
+		a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+		a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*)key + i));
+		const __m128i hi = _mm_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1));
+		a = _mm_add_epi64(_mm_mul_epu32(a, prime),
+				  _mm_slli_epi64(_mm_mul_epu32(hi, prime), 32));
+		_mm_storeu_si128((__m128i*)acc + i, a);
+	}
+}
+
+
+#  if FMDP_HASH_SIMD >= 2
+__attribute__ ((target ("avx2")))
+static void
+fmdp_xxh_accumulate_avx2(uint64_t *acc,
+			 const uint8_t *p,
+			 const uint8_t *key,
+			 size_t n)
+{
+	__m256i a[2];
+	size_t s, i;
+	for (i = 0; i < 2; ++i)
+		a[i] = _mm256_loadu_si256((const __m256i*)acc + i);
+	for (s = 0; s < n; ++s, p += FMDP_XXH_STRIPE, key += 8)
+		for (i = 0; i < 2; ++i) {
+			const __m256i v = _mm256_loadu_si256((const __m256i*)p + i);
+			const __m256i k = _mm256_xor_si256(
+				v, _mm256_loadu_si256((const __m256i*)key + i));
+			a[i] = _mm256_add_epi64(a[i], _mm256_mul_epu32(
+							k, _mm256_srli_epi64(k, 32)));
+			a[i] = _mm256_add_epi64(a[i], _mm256_shuffle_epi32(
+							v, _MM_SHUFFLE(1, 0, 3, 2)));
+		}
+	for (i = 0; i < 2; ++i)
+		_mm256_storeu_si256((__m256i*)acc + i, a[i]);
+}
+
+
+__attribute__ ((target ("avx2")))
+static void
+fmdp_xxh_scramble_avx2(uint64_t *acc,
+		       const uint8_t *key)
+{
+	const __m256i prime = _mm256_set1_epi32((int)FMDP_PRIME32_1);
+	size_t i;
+	for (i = 0; i < 2; ++i) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)acc + i);
+		a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+		a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*)key + i));
+		const __m256i hi = _mm256_srli_epi64(a, 32);
+		a = _mm256_add_epi64(_mm256_mul_epu32(a, prime),
+				     _mm256_slli_epi64(_mm256_mul_epu32(hi, prime), 32));
+		_mm256_storeu_si256((__m256i*)acc + i, a);
+	}
+}
+#  endif
+#endif
+
+
+static void
+fmdp_xxh_select(void)
+{
+	fmdp_xxh_impl.accumulate = &fmdp_xxh_accumulate_scalar;
+	fmdp_xxh_impl.scramble = &fmdp_xxh_scramble_scalar;
+#if defined (FMDP_HASH_X86)
+	fmdp_xxh_impl.accumulate = &fmdp_xxh_accumulate_sse2;
+	fmdp_xxh_impl.scramble = &fmdp_xxh_scramble_sse2;
+#  if FMDP_HASH_SIMD >= 2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fmdp_xxh_impl.accumulate = &fmdp_xxh_accumulate_avx2;
+		fmdp_xxh_impl.scramble = &fmdp_xxh_scramble_avx2;
+	}
+#  endif
+#endif
+}
+
+
+static void
+fmdp_hash_init(struct FmdHashState *h)
+{
+	static const uint64_t acc0[8] = {
+		FMDP_PRIME32_3, FMDP_PRIME64_1, FMDP_PRIME64_2, FMDP_PRIME64_3,
+		FMDP_PRIME64_4, FMDP_PRIME32_2, FMDP_PRIME64_5, FMDP_PRIME32_1
+	};
+	pthread_once(&fmdp_xxh_once, &fmdp_xxh_select);
+	memcpy(h->acc, acc0, sizeof acc0);
+	h->buffered = 0;
+	h->stripes = 0;
+	h->total = 0;
+}
+
+
+/* Accumulates |n| stripes of |p|, scrambling at the end of a block */
+static void
+fmdp_hash_stripes(uint64_t *acc,
+		  size_t *stripes,
+		  const uint8_t *p,
+		  size_t n)
+{
+	const uint8_t *key = fmdp_xxh_secret;
+	if (FMDP_XXH_STRIPES_PER_BLOCK - *stripes <= n) {
+		const size_t to_end = FMDP_XXH_STRIPES_PER_BLOCK - *stripes;
+		fmdp_xxh_impl.accumulate(acc, p, key + *stripes * 8, to_end);
+		fmdp_xxh_impl.scramble(acc, key + FMDP_XXH_SECRET_SZ -
+				       FMDP_XXH_STRIPE);
+		fmdp_xxh_impl.accumulate(acc, p + to_end * FMDP_XXH_STRIPE,
+					 key, n - to_end);
+		*stripes = n - to_end;
+	} else {
+		fmdp_xxh_impl.accumulate(acc, p, key + *stripes * 8, n);
+		*stripes += n;
+	}
+}
+
+
+static void
+fmdp_hash_update(struct FmdHashState *h,
+		 const uint8_t *p,
+		 size_t len)
+{
+	const size_t buf_stripes = FMDP_XXH_BUFFER_SZ / FMDP_XXH_STRIPE;
+	h->total += len;
+	if (h->buffered + len <= FMDP_XXH_BUFFER_SZ) {
+		memcpy(h->buf + h->buffered, p, len);
+		h->buffered += len;
+		return;
+	}
+	if (h->buffered) {
+		const size_t fill = FMDP_XXH_BUFFER_SZ - h->buffered;
+		memcpy(h->buf + h->buffered, p, fill);
+		p += fill;
+		len -= fill;
+		fmdp_hash_stripes(h->acc, &h->stripes, h->buf, buf_stripes);
+		h->buffered = 0;
+	}
+	/* Last stripe is kept, as digest might need it */
+	if (len > FMDP_XXH_BUFFER_SZ) {
+		const size_t n = (len - 1) / FMDP_XXH_BUFFER_SZ * buf_stripes;
+		size_t done = 0;
+		/* Whole blocks at once, where able */
+		while (done < n) {
+			size_t k = FMDP_XXH_STRIPES_PER_BLOCK - h->stripes;
+			if (k > n - done)
+				k = n - done;
+			fmdp_hash_stripes(h->acc, &h->stripes,
+					  p + done * FMDP_XXH_STRIPE, k);
+			done += k;
+		}
+		p += n * FMDP_XXH_STRIPE;
+		len -= n * FMDP_XXH_STRIPE;
+		memcpy(h->buf + FMDP_XXH_BUFFER_SZ - FMDP_XXH_STRIPE,
+		       p - FMDP_XXH_STRIPE, FMDP_XXH_STRIPE);
+	}
+	memcpy(h->buf, p, len);
+	h->buffered = len;
+}
+
+
+static uint64_t
+fmdp_hash_digest(const struct FmdHashState *h)
+{
+	if (h->total <= FMDP_XXH_MID_MAX)
+		return fmdp_xxh3_short(h->buf, (size_t)h->total);
+
+	const uint8_t *key = fmdp_xxh_secret;
+	uint64_t acc[8];
+	memcpy(acc, h->acc, sizeof acc);
+	const uint8_t *lastkey = key + FMDP_XXH_SECRET_SZ - FMDP_XXH_STRIPE - 7;
+	if (h->buffered >= FMDP_XXH_STRIPE) {
+		size_t stripes = h->stripes;
+		fmdp_hash_stripes(acc, &stripes, h->buf,
+				  (h->buffered - 1) / FMDP_XXH_STRIPE);
+		fmdp_xxh_impl.accumulate(acc, h->buf + h->buffered -
+					 FMDP_XXH_STRIPE, lastkey, 1);
+	} else {
+		/* Last stripe overlaps octets hashed already */
+		uint8_t last[FMDP_XXH_STRIPE];
+		const size_t catchup = FMDP_XXH_STRIPE - h->buffered;
+		memcpy(last, h->buf + FMDP_XXH_BUFFER_SZ - catchup, catchup);
+		memcpy(last + catchup, h->buf, h->buffered);
+		fmdp_xxh_impl.accumulate(acc, last, lastkey, 1);
+	}
+
+	uint64_t res = h->total * FMDP_PRIME64_1;
+	size_t i;
+	for (i = 0; i < 4; ++i)
+		res += fmdp_xxh_mul128_fold64(
+			acc[2 * i] ^ fmdp_xxh_read64(key + 11 + 16 * i),
+			acc[2 * i + 1] ^ fmdp_xxh_read64(key + 11 + 16 * i + 8));
+	return fmdp_xxh3_avalanche(res);
+}
+
+
+static double
+fmdp_hash_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+int
+fmdp_hash_stream(struct FmdStream *stream)
+{
+	assert(stream);
+
+	struct FmdScanJob *job = stream->job;
+	struct FmdFile *file = stream->file;
+	if (!FMDP_HASH(job) || !FMDP_WANTS(job, fmdet_digest))
+		return 0;
+
+	struct FmdHashState h;
+	fmdp_hash_init(&h);
+	const off_t size = stream->size(stream);
+	const off_t v_physreads = job->v_physreads;
+	double t = 0;
+	off_t offs = 0;
+	while (offs < size) {
+		size_t len = FMDP_READ_PAGE_SZ;
+		if ((off_t)len > size - offs)
+			len = (size_t)(size - offs);
+		const uint8_t *p = stream->get(stream, offs, len);
+		if (!p) {
+			job->log(job, file->path, fmdlt_oserr, "%s(%s): %s",
+				 "read", file->path, strerror(errno));
+			FMDP_X(-1);
+			return -1;
+		}
+		const double t0 = fmdp_hash_now();
+		fmdp_hash_update(&h, p, len);
+		t += fmdp_hash_now() - t0;
+		offs += (off_t)len;
+	}
+	job->v_hashed += size;
+	job->v_hashreads += job->v_physreads - v_physreads;
+	job->t_hash += t;
+
+	char hex[17];
+	snprintf(hex, sizeof hex, "%016llx",
+		 (unsigned long long)fmdp_hash_digest(&h));
+	return fmdp_add_text(file, fmdet_digest, hex, 16);
+}
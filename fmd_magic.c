@@ -0,0 +1,501 @@
+#include "fmd_priv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Magic dispatcher.
+ *
+ * Each format is known by a signature: octets at some offset of the
+ * header, that, masked, shall equal given ones. Signatures are indexed
+ * by an anchor -- the 1st octet of theirs, that is not masked off --
+ * in a table of 256 buckets per distinct anchor offset. A file is
+ * matched in one pass: for each anchor offset, only signatures of the
+ * bucket of its octet there are compared. Parsers of those that match
+ * are tried by priority and cost, then those without a signature.
+ *
+ * Built-in parsers come first, then those registered with
+ * fmd_register_parser(); the index is rebuilt on the next probe after
+ * a registration. Parsers are tried after the index is unlocked, so
+ * that they can probe nested streams. With fmdsf_typeonly, the 1st
+ * signature, that tells a type, gives it, and no parser is tried */
+
+#if !defined (FMDP_MAGIC_MATCHES)
+/* Max # of parsers, whose signatures match a file, to try, those
+ * without a signature included */
+#  define FMDP_MAGIC_MATCHES 32
+#endif
+
+static int fmdp_magic_id3(const uint8_t *p, size_t len);
+static int fmdp_magic_arch(struct FmdStream *stream);
+static void fmdp_magic_bmff_type(struct FmdFile *file, const uint8_t *p,
+				 size_t len);
+
+static const struct FmdMagic fmdp_builtin_magics[] = {
+	{ { "flac", 0, 4, (const uint8_t*)"fLaC", 0,
+	    0, 1, &fmdp_do_flac, fmdft_audio, "audio/flac" }, 0, 0 },
+	{ { "id3v2", 0, 10, (const uint8_t*)"ID3\0\0\0\0\0\0\0",
+	    (const uint8_t*)"\377\377\377\0\0\0\200\200\200\200",
+	    0, 2, &fmdp_do_mp3v2, fmdft_audio, "audio/mpeg" },
+	  &fmdp_magic_id3, 0 },
+	{ { "bmff", 0, 8, (const uint8_t*)"\0\0\0\0ftyp",
+	    (const uint8_t*)"\377\377\0\0\377\377\377\377",
+	    0, 4, &fmdp_do_bmff, fmdft_media, 0 },
+	  0, &fmdp_magic_bmff_type },
+	{ { "tiff-be", 0, 4, (const uint8_t*)"MM\000\052", 0,
+	    0, 8, &fmdp_do_tiff, fmdft_raster, "image/tiff" }, 0, 0 },
+	{ { "tiff-le", 0, 4, (const uint8_t*)"II\052\000", 0,
+	    0, 8, &fmdp_do_tiff, fmdft_raster, "image/tiff" }, 0, 0 },
+	{ { "exif", 0, 10, (const uint8_t*)"\377\330\377\341\0\0Exif",
+	    (const uint8_t*)"\377\377\377\377\0\0\377\377\377\377",
+	    0, 16, &fmdp_do_exif, fmdft_raster, "image/jpeg" }, 0, 0 },
+	/* XXX: consider delaying this for a second stage */
+	{ { "archive", 0, 0, 0, 0,
+	    0, 64, &fmdp_magic_arch, fmdft_archive, 0 }, 0, 0 },
+};
+#define FMDP_N_BUILTIN_MAGICS						\
+	(sizeof fmdp_builtin_magics / sizeof *fmdp_builtin_magics)
+
+/* Buckets of an anchor offset; signatures are chained through
+ * |fmdp_magic_index.next|, in order they are tried, 1-based */
+struct FmdMagicAnchor {
+	size_t offs;
+	uint16_t heads[256];
+};
+
+static struct {
+	/* Built-in, then registered signatures */
+	struct FmdMagic *magics;
+	size_t n, cap;
+	int stale;	/* registered since indexed */
+
+	struct FmdMagicAnchor *anchors;
+	size_t n_anchors;
+	uint16_t *next;
+	/* Signatures without an anchor, in order they are tried */
+	uint16_t *rest;
+	size_t n_rest;
+} fmdp_magic_index;
+static pthread_rwlock_t fmdp_magic_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+static int
+fmdp_magic_id3(const uint8_t *p,
+	       size_t len)
+{
+	(void)len;
+	/* Version and revision are never 0xff */
+	return p[3] < 0xff && p[4] < 0xff;
+}
+
+
+/* As fmdp_do_bmff() tells it, by major brand of 'ftyp' */
+static void
+fmdp_magic_bmff_type(struct FmdFile *file,
+		     const uint8_t *p,
+		     size_t len)
+{
+	if (len < 12) {
+		file->filetype = fmdft_media;
+		return;
+	}
+	const uint8_t *brand = p + 8;
+	if (!memcmp(brand, "M4V ", 4) ||
+	    !memcmp(brand, "mp41", 4) ||
+	    !memcmp(brand, "mp42", 4)) {
+		file->filetype = fmdft_video;
+		file->mimetype = "video/mp4";
+	} else if (!memcmp(brand, "M4A ", 4)) {
+		file->filetype = fmdft_audio;
+		file->mimetype = "audio/mp4";
+	} else {
+		file->filetype = fmdft_media;
+	}
+}
+
+
+static int
+fmdp_magic_arch(struct FmdStream *stream)
+{
+	struct FmdScanJob *job = stream->job;
+	if ((job->flags & fmdsf_archives) != fmdsf_archives)
+		return -1;
+	return fmdp_do_arch(stream);
+}
+
+
+/* Whether |a| is tried before |b|, given both match */
+static int
+fmdp_magic_before(const struct FmdMagic *a,
+		  const struct FmdMagic *b)
+{
+	if (a->parser.priority != b->parser.priority)
+		return a->parser.priority > b->parser.priority;
+	return a->parser.cost < b->parser.cost;
+}
+
+
+/* Offset of the 1st octet of |m|, that is not masked off, or -1 */
+static long
+fmdp_magic_anchor(const struct FmdMagic *m)
+{
+	const struct FmdParser *parser = &m->parser;
+	size_t i;
+	for (i = 0; i < parser->magic_len; ++i)
+		if (!parser->magic_mask || parser->magic_mask[i] == 0xff)
+			return (long)(parser->magic_offs + i);
+	return -1;
+}
+
+
+/* Inserts 1-based |k| into chain at |head|, after those tried before
+ * it or as well */
+static void
+fmdp_magic_chain(uint16_t *head,
+		 uint16_t k)
+{
+	const struct FmdMagic *magics = fmdp_magic_index.magics;
+	while (*head && !fmdp_magic_before(&magics[k - 1],
+					   &magics[*head - 1]))
+		head = &fmdp_magic_index.next[*head - 1];
+	fmdp_magic_index.next[k - 1] = *head;
+	*head = k;
+}
+
+
+/* Adds built-in signatures, if not yet; called with write lock */
+static int
+fmdp_magic_builtins(void)
+{
+	if (fmdp_magic_index.magics)
+		return 0;
+	const size_t cap = 2 * FMDP_N_BUILTIN_MAGICS;
+	struct FmdMagic *magics =
+		(struct FmdMagic*)malloc(cap * sizeof *magics);
+	if (!magics)
+		return (errno = ENOMEM), -1;
+	memcpy(magics, fmdp_builtin_magics, sizeof fmdp_builtin_magics);
+	fmdp_magic_index.magics = magics;
+	fmdp_magic_index.n = FMDP_N_BUILTIN_MAGICS;
+	fmdp_magic_index.cap = cap;
+	fmdp_magic_index.stale = 1;
+	return 0;
+}
+
+
+/* Indexes signatures; called with write lock */
+static int
+fmdp_magic_compile(void)
+{
+	const size_t n = fmdp_magic_index.n;
+	struct FmdMagicAnchor *anchors =
+		(struct FmdMagicAnchor*)calloc(n, sizeof *anchors);
+	uint16_t *next = (uint16_t*)calloc(n, sizeof *next);
+	uint16_t *rest = (uint16_t*)calloc(n, sizeof *rest);
+	if (!anchors || !next || !rest) {
+		free(anchors);
+		free(next);
+		free(rest);
+		FMDP_X(-1);
+		return (errno = ENOMEM), -1;
+	}
+	free(fmdp_magic_index.anchors);
+	free(fmdp_magic_index.next);
+	free(fmdp_magic_index.rest);
+	fmdp_magic_index.anchors = anchors;
+	fmdp_magic_index.n_anchors = 0;
+	fmdp_magic_index.next = next;
+	fmdp_magic_index.rest = rest;
+	fmdp_magic_index.n_rest = 0;
+
+	const struct FmdMagic *magics = fmdp_magic_index.magics;
+	size_t i, j;
+	for (i = 0; i < n; ++i) {
+		const struct FmdMagic *m = &magics[i];
+		const long anchor = fmdp_magic_anchor(m);
+		if (anchor == -1) {
+			for (j = fmdp_magic_index.n_rest; j > 0 &&
+			     fmdp_magic_before(m, &magics[rest[j - 1]]); --j)
+				rest[j] = rest[j - 1];
+			rest[j] = (uint16_t)i;
+			++fmdp_magic_index.n_rest;
+			continue;
+		}
+		for (j = 0; j < fmdp_magic_index.n_anchors; ++j)
+			if (anchors[j].offs == (size_t)anchor)
+				break;
+		struct FmdMagicAnchor *a = &anchors[j];
+		if (j == fmdp_magic_index.n_anchors) {
+			a->offs = (size_t)anchor;
+			++fmdp_magic_index.n_anchors;
+		}
+		const uint8_t octet =
+			m->parser.magic[(size_t)anchor - m->parser.magic_offs];
+		fmdp_magic_chain(&a->heads[octet], (uint16_t)(i + 1));
+	}
+	fmdp_magic_index.stale = 0;
+	return 0;
+}
+
+
+static int
+fmdp_magic_match(const struct FmdMagic *m,
+		 const uint8_t *p,
+		 size_t len)
+{
+	const struct FmdParser *parser = &m->parser;
+	if (parser->magic_offs + parser->magic_len > len)
+		return 0;
+	const uint8_t *q = p + parser->magic_offs;
+	size_t i;
+	if (!parser->magic_mask) {
+		if (parser->magic_len &&
+		    memcmp(q, parser->magic, parser->magic_len) != 0)
+			return 0;
+	} else {
+		for (i = 0; i < parser->magic_len; ++i)
+			if ((q[i] & parser->magic_mask[i]) != parser->magic[i])
+				return 0;
+	}
+	return !m->check || m->check(p, len);
+}
+
+
+/* Probes |stream| with parser of |m|, or, with fmdsf_typeonly, only
+ * tells type of its file, if |m| has a signature and tells one */
+static int
+fmdp_magic_try(const struct FmdMagic *m,
+	       struct FmdStream *stream,
+	       const uint8_t *p,
+	       size_t len)
+{
+	if (!FMDP_TYPEONLY(stream->job))
+		return m->parser.probe(stream);
+	struct FmdFile *file = stream->file;
+	if (!m->parser.magic_len)
+		return -1;
+	if (m->type)
+		m->type(file, p, len);
+	else if (m->parser.mimetype) {
+		file->filetype = m->parser.filetype;
+		file->mimetype = m->parser.mimetype;
+	} else
+		return -1;
+	return 0;
+}
+
+
+/* Takes read lock of the index, indexing signatures first, if any
+ * were registered since. Signatures not indexed for lack of memory
+ * are not matched, until the next try */
+static int
+fmdp_magic_rdlock(void)
+{
+	pthread_rwlock_rdlock(&fmdp_magic_lock);
+	if (fmdp_magic_index.anchors && !fmdp_magic_index.stale)
+		return 0;
+	pthread_rwlock_unlock(&fmdp_magic_lock);
+
+	pthread_rwlock_wrlock(&fmdp_magic_lock);
+	if (fmdp_magic_builtins() == 0 && fmdp_magic_index.stale)
+		(void)fmdp_magic_compile();
+	const int indexed = fmdp_magic_index.anchors != 0;
+	pthread_rwlock_unlock(&fmdp_magic_lock);
+	if (!indexed)
+		return -1;
+	pthread_rwlock_rdlock(&fmdp_magic_lock);
+	return 0;
+}
+
+
+int
+fmdp_magic_probe(struct FmdStream *stream,
+		 const uint8_t *p,
+		 size_t len)
+{
+	assert(stream);
+	assert(p);
+
+	if (fmdp_magic_rdlock() != 0) {
+		FMDP_X(-1);
+		return -1;
+	}
+
+	/* Signatures matched, in order they are tried; copied, as
+	 * parsers run unlocked, for those of archives probe their
+	 * members, while parsers could be registered meanwhile */
+	struct FmdMagic matched[FMDP_MAGIC_MATCHES];
+	const struct FmdMagic *magics = fmdp_magic_index.magics;
+	const uint16_t *next = fmdp_magic_index.next;
+	size_t n = 0, i, j;
+	for (i = 0; i < fmdp_magic_index.n_anchors; ++i) {
+		const struct FmdMagicAnchor *a = &fmdp_magic_index.anchors[i];
+		if (a->offs >= len)
+			continue;
+		uint16_t k;
+		for (k = a->heads[p[a->offs]]; k; k = next[k - 1]) {
+			const struct FmdMagic *m = &magics[k - 1];
+			if (n == FMDP_MAGIC_MATCHES ||
+			    !fmdp_magic_match(m, p, len))
+				continue;
+			/* Buckets are sorted, but there could be more */
+			for (j = n; j > 0 &&
+			     fmdp_magic_before(m, &matched[j - 1]); --j)
+				matched[j] = matched[j - 1];
+			matched[j] = *m;
+			++n;
+		}
+	}
+	for (i = 0; i < fmdp_magic_index.n_rest &&
+		    n < FMDP_MAGIC_MATCHES; ++i) {
+		const struct FmdMagic *m = &magics[fmdp_magic_index.rest[i]];
+		if (fmdp_magic_match(m, p, len))
+			matched[n++] = *m;
+	}
+	pthread_rwlock_unlock(&fmdp_magic_lock);
+
+	int rv = -1;
+	for (i = 0; i < n && rv != 0; ++i)
+		rv = fmdp_magic_try(&matched[i], stream, p, len);
+	return rv;
+}
+
+
+int
+fmd_register_parser(const struct FmdParser *parser)
+{
+	assert(parser);
+	if (!parser || !parser->probe ||
+	    (parser->magic_len && !parser->magic))
+		return (errno = EINVAL), -1;
+	/* Signatures are matched against 1st page */
+	if (parser->magic_offs + parser->magic_len > FMDP_READ_PAGE_SZ)
+		return (errno = EINVAL), -1;
+
+	pthread_rwlock_wrlock(&fmdp_magic_lock);
+	int res = fmdp_magic_builtins();
+	if (res == 0 && fmdp_magic_index.n == fmdp_magic_index.cap) {
+		const size_t cap = 2 * fmdp_magic_index.cap;
+		struct FmdMagic *magics = cap > UINT16_MAX ? 0 :
+			(struct FmdMagic*)realloc(fmdp_magic_index.magics,
+						  cap * sizeof *magics);
+		if (magics) {
+			fmdp_magic_index.magics = magics;
+			fmdp_magic_index.cap = cap;
+		} else {
+			errno = ENOMEM;
+			res = -1;
+		}
+	}
+	if (res == 0) {
+		struct FmdMagic *m =
+			&fmdp_magic_index.magics[fmdp_magic_index.n++];
+		m->parser = *parser;
+		m->check = 0;
+		m->type = 0;
+		fmdp_magic_index.stale = 1;
+	}
+	pthread_rwlock_unlock(&fmdp_magic_lock);
+	if (res != 0) {
+		FMDP_X(res);
+	}
+	return res;
+}
+
+
+const unsigned char*
+fmd_stream_get(struct FmdStream *stream,
+	       off_t offs,
+	       size_t len)
+{
+	assert(stream);
+	if (!stream || len > FMDP_READ_PAGE_SZ)
+		return (errno = EINVAL), (const unsigned char*)0;
+	return stream->get(stream, offs, len);
+}
+
+
+off_t
+fmd_stream_size(struct FmdStream *stream)
+{
+	assert(stream);
+	return stream->size(stream);
+}
+
+
+struct FmdFile*
+fmd_stream_file(struct FmdStream *stream)
+{
+	assert(stream);
+	return stream->file;
+}
+
+
+struct FmdScanJob*
+fmd_stream_job(struct FmdStream *stream)
+{
+	assert(stream);
+	return stream->job;
+}
+
+
+int
+fmd_add_n(struct FmdFile *file,
+	  enum FmdElemType elemtype, long value)
+{
+	if (!file)
+		return (errno = EINVAL), -1;
+	return fmdp_add_n(file, elemtype, value);
+}
+
+
+int
+fmd_add_frac(struct FmdFile *file,
+	     enum FmdElemType elemtype, double value)
+{
+	if (!file)
+		return (errno = EINVAL), -1;
+	return fmdp_add_frac(file, elemtype, value);
+}
+
+
+int
+fmd_add_timestamp(struct FmdFile *file,
+		  enum FmdElemType elemtype, time_t value)
+{
+	if (!file)
+		return (errno = EINVAL), -1;
+	return fmdp_add_timestamp(file, elemtype, value);
+}
+
+
+int
+fmd_add_rational(struct FmdFile *file,
+		 enum FmdElemType elemtype, int num, int denom)
+{
+	if (!file || !denom)
+		return (errno = EINVAL), -1;
+	return fmdp_add_rational(file, elemtype, num, denom);
+}
+
+
+int
+fmd_add_text(struct FmdFile *file,
+	     enum FmdElemType elemtype, const char *s, int len)
+{
+	/* "Other" elements go with their key, see fmd_add_other() */
+	if (!file || !s || len < -1 || elemtype == fmdet_other)
+		return (errno = EINVAL), -1;
+	return fmdp_add_text(file, elemtype, s, len);
+}
+
+
+int
+fmd_add_other(struct FmdFile *file,
+	      const char *key, const char *s, int len)
+{
+	if (!file || !key || !s || len < -1)
+		return (errno = EINVAL), -1;
+	return fmdp_add_other(file, key, s, len);
+}
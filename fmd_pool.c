@@ -0,0 +1,533 @@
+#include "fmd_priv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Recursive scan on a pool of worker threads.
+ *
+ * Each directory is a task, that lists (and stats) its entries and
+ * then spawns a task per sub-directory, as well as tasks to probe
+ * its entries in batches of FMDP_PROBE_BATCH. Every worker keeps its
+ * own deque of tasks: it pushes and pops at the bottom, while idle
+ * workers steal from the top of others' deques.
+ *
+ * Directory tasks keep their listings until all workers are done;
+ * the chain is then put together in the same order, as a single
+ * threaded scan would produce. When streaming, each directory task
+ * instead hands its entries over to |job->consume| as soon as they
+ * are probed, and is freed right away */
+
+struct FmdDirTask {
+	/* Directory entry in parent's listing; 0 for |job->location|.
+	 * When streaming, it could be handed over before the task is
+	 * run, hence its |path| and |stat| are copied */
+	struct FmdFile *file;
+	const char *path;
+	struct stat stat;
+	DIR *dirp;
+	struct FmdDirList list;
+
+	/* Parent directory task, 0 for the root one, and directories up
+	 * to the root, to tell cycles. When streaming, each task is held
+	 * by itself, until done, and by its sub-directory tasks, until
+	 * those are freed */
+	struct FmdDirTask *parent;
+	struct FmdDirVisit visit;
+	size_t refs;
+
+	/* Tasks of sub-directories, in order of |list| entries */
+	struct FmdDirTask **subdirs;
+	size_t n_subdirs;
+
+	/* # of probe batches not yet finished; last one to finish
+	 * closes |dirp| */
+	size_t n_probing;
+	struct FmdTask *batches;
+
+	int res, err;
+};
+
+struct FmdTask {
+	struct FmdDirTask *dir;
+	/* Probe |dir| entries in [from, to), or list |dir| if equal */
+	size_t from, to;
+};
+
+/* Tasks are in [top, bottom), both indices are modulo |cap| */
+struct FmdDeque {
+	pthread_mutex_t lock;
+	struct FmdTask **v;
+	size_t cap, top, bottom;
+};
+
+struct FmdPool;
+struct FmdWorker {
+	struct FmdPool *pool;
+	struct FmdScanJob job;	/* per-worker copy */
+	struct FmdPriv priv;
+	struct FmdArena arena;	/* merged into job's one in the end */
+	struct FmdDeque deque;
+	pthread_t thread;
+	unsigned index;
+};
+
+struct FmdPool {
+	struct FmdWorker *workers;
+	unsigned n_workers;
+
+	/* Guards sleeping on |wake| */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	unsigned n_sleeping;
+
+	/* Tasks queued or running, and queued only */
+	size_t pending, queued;
+
+	/* Serializes |job->consume| calls */
+	pthread_mutex_t consume_lock;
+};
+
+
+static int
+fmdp_deque_push(struct FmdDeque *dq,
+		struct FmdTask *task)
+{
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom - dq->top == dq->cap) {
+		size_t cap = dq->cap ? dq->cap * 2 : 64, i;
+		struct FmdTask **v = (struct FmdTask**)malloc(cap * sizeof *v);
+		if (!v) {
+			pthread_mutex_unlock(&dq->lock);
+			return -1;
+		}
+		for (i = dq->top; i != dq->bottom; ++i)
+			v[i % cap] = dq->v[i % dq->cap];
+		free(dq->v);
+		dq->v = v;
+		dq->cap = cap;
+	}
+	dq->v[dq->bottom++ % dq->cap] = task;
+	pthread_mutex_unlock(&dq->lock);
+	return 0;
+}
+
+static struct FmdTask*
+fmdp_deque_pop(struct FmdDeque *dq)
+{
+	struct FmdTask *task = 0;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom != dq->top)
+		task = dq->v[--dq->bottom % dq->cap];
+	pthread_mutex_unlock(&dq->lock);
+	return task;
+}
+
+static struct FmdTask*
+fmdp_deque_steal(struct FmdDeque *dq)
+{
+	struct FmdTask *task = 0;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom != dq->top)
+		task = dq->v[dq->top++ % dq->cap];
+	pthread_mutex_unlock(&dq->lock);
+	return task;
+}
+
+
+/* Queues |task| to |w|'s deque; runs it right away, if it cannot be
+ * queued */
+static void fmdp_pool_run(struct FmdWorker *w, struct FmdTask *task);
+
+static void
+fmdp_pool_push(struct FmdWorker *w,
+	       struct FmdTask *task)
+{
+	struct FmdPool *pool = w->pool;
+	__atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+	if (fmdp_deque_push(&w->deque, task) != 0) {
+		fmdp_pool_run(w, task);
+		__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->n_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+
+/* Directory listed from its snapshot is not opened; its entries
+ * have full paths */
+static int
+fmdp_dir_task_fd(struct FmdDirTask *dt)
+{
+	return dt->dirp ? dirfd(dt->dirp) : AT_FDCWD;
+}
+
+
+/* Drops a hold on |dt|, and frees it (but the root one), if it was
+ * the last one */
+static void
+fmdp_dir_task_release(struct FmdDirTask *dt)
+{
+	while (dt && __atomic_sub_fetch(&dt->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		struct FmdDirTask *parent = dt->parent;
+		if (dt->file)
+			free(dt);
+		dt = parent;
+	}
+}
+
+
+/* Called when |dt| is listed and probed; when streaming, hands its
+ * entries over and drops its own hold on it */
+static void
+fmdp_pool_done(struct FmdWorker *w,
+	       struct FmdDirTask *dt)
+{
+	struct FmdScanJob *job = &w->job;
+	if (!job->consume)
+		return;
+
+	struct FmdPool *pool = w->pool;
+	size_t i;
+	pthread_mutex_lock(&pool->consume_lock);
+	for (i = 0; i < dt->list.n; ++i)
+		fmdp_emit(job, 0, dt->list.entries[i], /*hold*/0);
+	pthread_mutex_unlock(&pool->consume_lock);
+	fmdp_free_dir_list(&dt->list, /*entries*/0);
+	free(dt->subdirs); dt->subdirs = 0;
+	free(dt->batches); dt->batches = 0;
+	fmdp_dir_task_release(dt);
+}
+
+
+static void
+fmdp_pool_list(struct FmdWorker *w,
+	       struct FmdDirTask *dt)
+{
+	struct FmdScanJob *job = &w->job;
+	const char *path = dt->path;
+
+	if (fmdp_read_dir(job, AT_FDCWD, path, path,
+			  dt->file ? &dt->stat : 0, &dt->visit,
+			  &dt->dirp, &dt->list) != 0) {
+		dt->err = errno;
+		dt->res = -1;
+		fmdp_free_dir_list(&dt->list, /*entries*/1);
+		fmdp_pool_done(w, dt);
+		return;
+	}
+
+	/* Streaming needs no |subdirs| to put the chain together */
+	const int streaming = job->consume != 0;
+	size_t i, n = 0;
+	for (i = 0; i < dt->list.n; ++i)
+		if (FMDP_DESCEND(dt->list.entries[i]))
+			++n;
+	if (n && !streaming) {
+		dt->subdirs = (struct FmdDirTask**)calloc(n, sizeof *dt->subdirs);
+		if (!dt->subdirs)
+			job->log(job, path, fmdlt_oserr, "%s(%s): %s",
+				 "calloc", path, strerror(ENOMEM));
+	}
+	for (i = 0; i < dt->list.n && (dt->subdirs || streaming); ++i) {
+		struct FmdFile *file = dt->list.entries[i];
+		if (!FMDP_DESCEND(file))
+			continue;
+		/* List task is right after its directory task, and is
+		 * followed by a copy of directory's path */
+		struct FmdDirTask *sub = (struct FmdDirTask*)
+			calloc(1, sizeof *sub + sizeof (struct FmdTask) +
+			       strlen(file->path) + 1);
+		if (!sub) {
+			job->log(job, file->path, fmdlt_oserr, "%s(%s): %s",
+				 "calloc", file->path, strerror(ENOMEM));
+			continue;
+		}
+		struct FmdTask *task = (struct FmdTask*)(sub + 1);
+		sub->file = file;
+		sub->path = strcpy((char*)(task + 1), file->path);
+		sub->stat = file->stat;
+		sub->parent = dt;
+		sub->visit.parent = &dt->visit;
+		sub->refs = 1;
+		__atomic_add_fetch(&dt->refs, 1, __ATOMIC_ACQ_REL);
+		task->dir = sub;
+		if (dt->subdirs)
+			dt->subdirs[dt->n_subdirs++] = sub;
+		fmdp_pool_push(w, task);
+	}
+
+	const size_t nb = (job->flags & fmdsf_metadata) == fmdsf_metadata ?
+		(dt->list.n + FMDP_PROBE_BATCH - 1) / FMDP_PROBE_BATCH : 0;
+	if (nb)
+		dt->batches = (struct FmdTask*)calloc(nb, sizeof *dt->batches);
+	if (!dt->batches) {
+		/* Nothing to probe, or probe it all right here */
+		fmdp_probe_entries(job, fmdp_dir_task_fd(dt),
+				   dt->list.entries, dt->list.n);
+		if (dt->dirp) {
+			closedir(dt->dirp);
+			dt->dirp = 0;
+		}
+		fmdp_pool_done(w, dt);
+		return;
+	}
+	dt->n_probing = nb;
+	for (i = 0; i < nb; ++i) {
+		struct FmdTask *task = &dt->batches[i];
+		task->dir = dt;
+		task->from = i * FMDP_PROBE_BATCH;
+		task->to = task->from + FMDP_PROBE_BATCH;
+		if (task->to > dt->list.n)
+			task->to = dt->list.n;
+		fmdp_pool_push(w, task);
+	}
+}
+
+
+static void
+fmdp_pool_run(struct FmdWorker *w,
+	      struct FmdTask *task)
+{
+	struct FmdDirTask *dt = task->dir;
+	if (task->from == task->to) {
+		fmdp_pool_list(w, dt);
+		return;
+	}
+
+	fmdp_probe_entries(&w->job, fmdp_dir_task_fd(dt),
+			   dt->list.entries + task->from,
+			   task->to - task->from);
+	if (__atomic_sub_fetch(&dt->n_probing, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (dt->dirp) {
+			closedir(dt->dirp);
+			dt->dirp = 0;
+		}
+		fmdp_pool_done(w, dt);
+	}
+}
+
+
+static void*
+fmdp_pool_worker(void *arg)
+{
+	struct FmdWorker *w = (struct FmdWorker*)arg;
+	struct FmdPool *pool = w->pool;
+	if (w->index)
+		/* Calling thread did it for itself in fmd_scan() */
+		(void)fmdp_ioprio_idle(&w->job);
+	for (;;) {
+		struct FmdTask *task = fmdp_deque_pop(&w->deque);
+		unsigned i;
+		for (i = 1; !task && i < pool->n_workers; ++i) {
+			struct FmdWorker *victim =
+				&pool->workers[(w->index + i) % pool->n_workers];
+			task = fmdp_deque_steal(&victim->deque);
+		}
+
+		if (task) {
+			__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+			fmdp_pool_run(w, task);
+			if (__atomic_sub_fetch(&pool->pending, 1,
+					       __ATOMIC_SEQ_CST) == 0) {
+				pthread_mutex_lock(&pool->lock);
+				pthread_cond_broadcast(&pool->wake);
+				pthread_mutex_unlock(&pool->lock);
+			}
+			continue;
+		}
+
+		/* Nothing to steal; wait until tasks are queued, or
+		 * until all of them are done */
+		pthread_mutex_lock(&pool->lock);
+		__atomic_add_fetch(&pool->n_sleeping, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) &&
+		       __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		__atomic_sub_fetch(&pool->n_sleeping, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool->lock);
+		if (!__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST))
+			break;
+	}
+	return 0;
+}
+
+
+/* Chains |dt| listing with all of its sub-directories at |*ptail|
+ * and frees |dt|; files allocated by a worker get pointed at the
+ * job's arena, which their worker's was merged into */
+static void
+fmdp_pool_assemble(struct FmdScanJob *job,
+		   struct FmdDirTask *dt,
+		   struct FmdFile ***ptail)
+{
+	assert(!dt->dirp);
+	size_t i, k = 0;
+	for (i = 0; i < dt->list.n; ++i) {
+		struct FmdFile *file = dt->list.entries[i];
+		struct FmdDirTask *sub =
+			k < dt->n_subdirs && dt->subdirs[k]->file == file ?
+			dt->subdirs[k++] : 0;
+		struct FmdFile *f;
+		for (f = file; f; f = f->next)
+			if (f->flags & fmdff_arena)
+				FMDP_FILE_ARENA(f) = job->priv->arena;
+		const int held = fmdp_emit(job, ptail, file, /*hold*/sub != 0);
+		if (sub)
+			fmdp_pool_assemble(job, sub, ptail);
+		if (held)
+			fmd_free(file);
+	}
+	fmdp_free_dir_list(&dt->list, /*entries*/0);
+	free(dt->subdirs);
+	free(dt->batches);
+	free(dt);
+}
+
+
+static void
+fmdp_reset_metrics(struct FmdScanJob *job)
+{
+	job->n_filopens = job->n_diropens = job->n_stats = job->n_mmaps = 0;
+	job->n_physreads = job->n_logreads = 0;
+	job->v_physreads = job->v_logreads = 0;
+	job->n_cachehits = job->n_cachemisses = 0;
+	job->n_pcachehits = job->n_pcachemisses = 0;
+	job->n_snaphits = job->n_snapmisses = 0;
+	job->n_linkhits = 0;
+	job->v_bufpeak = 0;
+	job->v_uncached = 0;
+	job->v_hashed = job->v_hashreads = 0;
+	job->t_hash = 0;
+}
+
+static void
+fmdp_add_metrics(struct FmdScanJob *job,
+		 const struct FmdScanJob *from)
+{
+	job->n_filopens += from->n_filopens;
+	job->n_diropens += from->n_diropens;
+	job->n_stats += from->n_stats;
+	job->n_mmaps += from->n_mmaps;
+	job->n_physreads += from->n_physreads;
+	job->n_logreads += from->n_logreads;
+	job->v_physreads += from->v_physreads;
+	job->v_logreads += from->v_logreads;
+	job->n_cachehits += from->n_cachehits;
+	job->n_cachemisses += from->n_cachemisses;
+	job->n_pcachehits += from->n_pcachehits;
+	job->n_pcachemisses += from->n_pcachemisses;
+	job->n_snaphits += from->n_snaphits;
+	job->n_snapmisses += from->n_snapmisses;
+	job->n_linkhits += from->n_linkhits;
+	job->v_uncached += from->v_uncached;
+	job->v_hashed += from->v_hashed;
+	job->v_hashreads += from->v_hashreads;
+	job->t_hash += from->t_hash;
+}
+
+
+int
+fmdp_scan_parallel(struct FmdScanJob *job)
+{
+	assert(job);
+	assert(job->threads > 1);
+
+	struct FmdPool pool;
+	memset(&pool, 0, sizeof pool);
+	size_t sz = job->threads * sizeof *pool.workers;
+	pool.workers = (struct FmdWorker*)calloc(job->threads,
+						 sizeof *pool.workers);
+	/* Root directory task with its list task right after it */
+	struct FmdDirTask *root =
+		(struct FmdDirTask*)calloc(1, sizeof *root + sizeof (struct FmdTask));
+	if (!pool.workers || !root) {
+		job->log(job, job->location, fmdlt_oserr, "%s(%u): %s",
+			 "calloc", (unsigned)sz, strerror(ENOMEM));
+		free(pool.workers);
+		free(root);
+		FMDP_X(-1);
+		return (errno = ENOMEM), -1;
+	}
+	pthread_mutex_init(&pool.lock, 0);
+	pthread_cond_init(&pool.wake, 0);
+	pthread_mutex_init(&pool.consume_lock, 0);
+
+	unsigned i;
+	pool.n_workers = job->threads;
+	for (i = 0; i < pool.n_workers; ++i) {
+		struct FmdWorker *w = &pool.workers[i];
+		w->pool = &pool;
+		w->index = i;
+		w->job = *job;
+		w->job.priv = &w->priv;
+		fmdp_priv_init(&w->priv);
+		if (job->priv->arena)
+			w->priv.arena = &w->arena;
+		w->priv.bufs = job->priv->bufs;
+		w->priv.sched = job->priv->sched;
+		w->priv.links = job->priv->links;
+		w->priv.filter = job->priv->filter;
+		fmdp_reset_metrics(&w->job);
+		pthread_mutex_init(&w->deque.lock, 0);
+	}
+
+	struct FmdTask *task = (struct FmdTask*)(root + 1);
+	root->path = job->location;
+	root->refs = 1;
+	task->dir = root;
+	pool.pending = pool.queued = 1;
+	fmdp_deque_push(&pool.workers[0].deque, task);
+
+	/* Calling thread is worker #0 */
+	unsigned started = 1;
+	for (i = 1; i < pool.n_workers; ++i, ++started) {
+		struct FmdWorker *w = &pool.workers[i];
+		int res = pthread_create(&w->thread, 0, &fmdp_pool_worker, w);
+		if (res != 0) {
+			job->log(job, job->location, fmdlt_oserr,
+				 "%s(%u): %s", "pthread_create", i,
+				 strerror(res));
+			break;
+		}
+	}
+	fmdp_pool_worker(&pool.workers[0]);
+	for (i = 1; i < started; ++i)
+		pthread_join(pool.workers[i].thread, 0);
+
+	for (i = 0; i < pool.n_workers; ++i) {
+		struct FmdWorker *w = &pool.workers[i];
+		fmdp_add_metrics(job, &w->job);
+		if (job->priv->arena)
+			fmdp_arena_merge(job->priv->arena, &w->arena);
+		fmdp_priv_fini(&w->priv);
+		free(w->deque.v);
+		pthread_mutex_destroy(&w->deque.lock);
+	}
+	pthread_cond_destroy(&pool.wake);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_mutex_destroy(&pool.consume_lock);
+	free(pool.workers);
+
+	const int res = root->res, err = root->err;
+	struct FmdFile **tail = &job->first_file;
+	if (job->consume)
+		free(root);	/* all handed over already */
+	else
+		fmdp_pool_assemble(job, root, &tail);
+	if (res != 0)
+		errno = err;
+	return res;
+}
@@ -1,3 +1,6 @@
+#if defined (__linux__) && !defined (_GNU_SOURCE)
+#  define _GNU_SOURCE		/* O_NOATIME, O_DIRECT */
+#endif
 #include "fmd_priv.h"
 
 #include <assert.h>
@@ -9,9 +12,259 @@
 #include <string.h>
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+void
+fmdp_priv_init(struct FmdPriv *priv)
+{
+	assert(priv);
+	priv->ring = 0;
+	priv->ring_err = 0;
+	priv->dents = 0;
+	priv->arena = 0;
+	priv->bufs = 0;
+	priv->buf_held = 0;
+	priv->sched = 0;
+	priv->sched_held = 0;
+	priv->links = 0;
+	priv->filter = 0;
+}
+
+
+void
+fmdp_priv_fini(struct FmdPriv *priv)
+{
+	assert(priv);
+	fmdp_uring_free(priv);
+	free(priv->dents);
+	priv->dents = 0;
+}
+
+
+struct FmdArenaChunk {
+	struct FmdArenaChunk *next;
+	size_t size, used;
+};
+
+
+void*
+fmdp_arena_alloc(struct FmdArena *arena,
+		 size_t sz)
+{
+	assert(arena);
+
+	const size_t hdr = FMDP_ALIGN(sizeof (struct FmdArenaChunk));
+	struct FmdArenaChunk *chunk = arena->chunks;
+	sz = FMDP_ALIGN(sz);
+	if (!chunk || chunk->size - chunk->used < sz) {
+		/* Large ones get a chunk of their own, behind the
+		 * current one, so that its free space is not lost */
+		const int large = sz > FMDP_ARENA_CHUNK_SZ / 4;
+		const size_t csz = large ? hdr + sz : FMDP_ARENA_CHUNK_SZ;
+		struct FmdArenaChunk *nc = (struct FmdArenaChunk*)malloc(csz);
+		if (!nc)
+			return (errno = ENOMEM), (void*)0;
+		nc->size = csz;
+		nc->used = hdr;
+		if (large && chunk) {
+			nc->next = chunk->next;
+			chunk->next = nc;
+		} else {
+			nc->next = chunk;
+			arena->chunks = nc;
+		}
+		chunk = nc;
+	}
+	void *p = (char*)chunk + chunk->used;
+	chunk->used += sz;
+	return memset(p, 0, sz);
+}
+
+
+void
+fmdp_arena_merge(struct FmdArena *to,
+		 struct FmdArena *from)
+{
+	assert(to);
+	assert(from);
+	if (!from->chunks)
+		return;
+
+	/* Keep current chunk of |to| first */
+	struct FmdArenaChunk **tail = to->chunks ? &to->chunks->next : &to->chunks;
+	struct FmdArenaChunk *last = from->chunks;
+	while (last->next)
+		last = last->next;
+	last->next = *tail;
+	*tail = from->chunks;
+	from->chunks = 0;
+}
+
+
+void
+fmdp_arena_fini(struct FmdArena *arena)
+{
+	assert(arena);
+	struct FmdArenaChunk *chunk = arena->chunks;
+	while (chunk) {
+		struct FmdArenaChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena->chunks = 0;
+}
+
+
+/* Buffer given back to pool; kept in the buffer itself */
+struct FmdBufFree {
+	struct FmdBufFree *next;
+	size_t size;
+};
+
+
+void
+fmdp_bufpool_init(struct FmdBufPool *pool,
+		  size_t cap)
+{
+	assert(pool);
+	pthread_mutex_init(&pool->lock, 0);
+	pthread_cond_init(&pool->freed, 0);
+	pool->cap = cap ? cap : FMDP_BUFFER_CAP;
+	pool->used = pool->peak = 0;
+	pool->free = 0;
+}
+
+
+void
+fmdp_bufpool_fini(struct FmdBufPool *pool)
+{
+	assert(pool);
+	struct FmdBufFree *it = pool->free;
+	while (it) {
+		struct FmdBufFree *next = it->next;
+		pool->used -= it->size;
+		free(it);
+		it = next;
+	}
+	pool->free = 0;
+	assert(!pool->used);
+	pthread_cond_destroy(&pool->freed);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+
+void*
+fmdp_buf_get(struct FmdScanJob *job,
+	     size_t size, int must)
+{
+	assert(job);
+	assert(size >= sizeof (struct FmdBufFree));
+
+	/* Aligned, to be read into with O_DIRECT */
+	void *p;
+	struct FmdBufPool *pool = job->priv ? job->priv->bufs : 0;
+	if (!pool) {
+		if (posix_memalign(&p, FMDP_DIRECT_ALIGN, size) != 0)
+			return (errno = ENOMEM), (void*)0;
+		return p;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	struct FmdBufFree *buf = 0;
+	for (;;) {
+		struct FmdBufFree **pp = &pool->free;
+		while (*pp && (*pp)->size != size)
+			pp = &(*pp)->next;
+		if (*pp) {
+			buf = *pp;
+			*pp = buf->next;
+			break;
+		}
+
+		/* Make room, dropping buffers of other sizes */
+		while (pool->free && pool->used + size > pool->cap) {
+			struct FmdBufFree *it = pool->free;
+			pool->free = it->next;
+			pool->used -= it->size;
+			free(it);
+		}
+		if (pool->used + size <= pool->cap || !pool->used)
+			break;
+		/* Only those holding none wait: others will give
+		 * theirs back, as they are not waiting */
+		if (!job->priv->buf_held) {
+			pthread_cond_wait(&pool->freed, &pool->lock);
+			continue;
+		}
+		if (must)
+			break;
+		pthread_mutex_unlock(&pool->lock);
+		errno = ENOMEM;
+		FMDP_X(0);
+		return 0;
+	}
+	if (!buf) {
+		pool->used += size;
+		if (pool->peak < pool->used)
+			pool->peak = pool->used;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!buf) {
+		if (posix_memalign(&p, FMDP_DIRECT_ALIGN, size) != 0) {
+			pthread_mutex_lock(&pool->lock);
+			pool->used -= size;
+			pthread_cond_broadcast(&pool->freed);
+			pthread_mutex_unlock(&pool->lock);
+			return (errno = ENOMEM), (void*)0;
+		}
+		buf = (struct FmdBufFree*)p;
+	}
+	job->priv->buf_held += size;
+	return buf;
+}
+
+
+void
+fmdp_buf_put(struct FmdScanJob *job,
+	     void *buf, size_t size)
+{
+	assert(job);
+
+	struct FmdBufPool *pool = job->priv ? job->priv->bufs : 0;
+	if (!pool || !buf) {
+		free(buf);
+		return;
+	}
+	job->priv->buf_held -= size;
+	struct FmdBufFree *it = (struct FmdBufFree*)buf;
+	it->size = size;
+	pthread_mutex_lock(&pool->lock);
+	it->next = pool->free;
+	pool->free = it;
+	pthread_cond_broadcast(&pool->freed);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void
+fmdp_buf_lose(struct FmdScanJob *job,
+	      void *buf, size_t size)
+{
+	assert(job);
+
+	struct FmdBufPool *pool = job->priv ? job->priv->bufs : 0;
+	if (!pool || !buf)
+		return;
+	job->priv->buf_held -= size;
+	pthread_mutex_lock(&pool->lock);
+	pool->used -= size;
+	pthread_cond_broadcast(&pool->freed);
+	pthread_mutex_unlock(&pool->lock);
+}
+
 struct FmdFile*
 fmdp_file_new(struct FmdScanJob *job,
 	      const char *path)
@@ -21,7 +274,18 @@ fmdp_file_new(struct FmdScanJob *job,
 
 	size_t path_len = strlen(path);
 	size_t sz = sizeof(struct FmdFile) + path_len;
-	struct FmdFile *file = (struct FmdFile*)calloc(1, sz);
+	struct FmdArena *arena = job->priv ? job->priv->arena : 0;
+	struct FmdFile *file;
+	if (arena) {
+		const size_t hdr = FMDP_ALIGN(sizeof (struct FmdArena*));
+		char *p = (char*)fmdp_arena_alloc(arena, hdr + sz);
+		file = p ? (struct FmdFile*)(p + hdr) : 0;
+		if (file) {
+			FMDP_FILE_ARENA(file) = arena;
+			file->flags |= fmdff_arena;
+		}
+	} else
+		file = (struct FmdFile*)calloc(1, sz);
 	if (!file) {
 		job->log(job, path, fmdlt_oserr, "%s(%u): %s",
 			 "calloc", (unsigned)sz, strerror(ENOMEM));
@@ -64,15 +328,54 @@ fmdp_gcd(int a, int b)
 }
 
 
+int
+fmdp_wants_more(const struct FmdScanJob *job,
+		const struct FmdFile *file)
+{
+	assert(job);
+	assert(file);
+
+	if (!job->elements)
+		return 1;
+	/* Digest is added once parsers are done */
+	unsigned long missing = job->elements & ~(1UL << fmdet_digest);
+	const struct FmdElem *it;
+	for (it = file->metadata; it && missing; it = it->next)
+		missing &= ~(1UL << it->elemtype);
+	return missing != 0;
+}
+
+
+struct FmdElem*
+fmdp_elem_new(struct FmdFile *file,
+	      size_t extrasize)
+{
+	assert(file);
+	/* Arena rounds the size up to keep the next one aligned */
+	size_t sz = sizeof (struct FmdElem) + extrasize;
+	if (file->flags & fmdff_arena)
+		return (struct FmdElem*)fmdp_arena_alloc(FMDP_FILE_ARENA(file), sz);
+	return (struct FmdElem*)calloc(1, sz);
+}
+
+
+void
+fmdp_elem_free(struct FmdFile *file,
+	       struct FmdElem *elem)
+{
+	assert(file);
+	if (!(file->flags & fmdff_arena))
+		free(elem);
+}
+
+
 static struct FmdElem*
 fmdp_add(struct FmdFile *file,
 	 enum FmdElemType elemtype, enum FmdDataType datatype,
 	 size_t extrasize)
 {
 	assert(file);
-	/* XXX: align size? */
-	size_t sz = sizeof (struct FmdElem) + extrasize;
-	struct FmdElem *elem = (struct FmdElem*)calloc(1, sz);
+	struct FmdElem *elem = fmdp_elem_new(file, extrasize);
 	if (elem) {
 		elem->elemtype = elemtype;
 		elem->datatype = datatype;
@@ -400,6 +703,45 @@ fmdp_ranged_stream_get(struct FmdStream *stream,
 	return rstr->next->get(rstr->next, rstr->start_offs + offs, len);
 }
 
+static int
+fmdp_ranged_stream_get_many(struct FmdStream *stream,
+			    struct FmdRange *ranges, size_t n)
+{
+	assert(stream);
+
+	/* Translate to offsets of underlying stream, and back */
+	struct FmdRangedStream *rstr = FMDP_GET_RSTR(stream);
+	const off_t ssize = rstr->end_offs - rstr->start_offs;
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		if (ranges[i].offs < 0)
+			ranges[i].offs += ssize;
+		if (ranges[i].offs < 0 ||
+		    ranges[i].offs + (off_t)ranges[i].len > ssize) {
+			while (i--)
+				ranges[i].offs -= rstr->start_offs;
+			FMDP_X(ERANGE);
+			return (errno = ERANGE), -1;
+		}
+		ranges[i].offs += rstr->start_offs;
+	}
+	int rv = fmdp_stream_get_many(rstr->next, ranges, n);
+	for (i = 0; i < n; ++i)
+		ranges[i].offs -= rstr->start_offs;
+	return rv;
+}
+
+static void
+fmdp_ranged_stream_prefetch(struct FmdStream *stream,
+			    off_t offs, size_t len)
+{
+	assert(stream);
+
+	struct FmdRangedStream *rstr = FMDP_GET_RSTR(stream);
+	if (rstr->start_offs + offs + (off_t)len <= rstr->end_offs)
+		fmdp_stream_prefetch(rstr->next, rstr->start_offs + offs, len);
+}
+
 static void
 fmdp_ranged_stream_close(struct FmdStream *stream)
 {
@@ -429,6 +771,8 @@ fmdp_ranged_stream_create(struct FmdStream *stream,
 	rstr->base.size = &fmdp_ranged_stream_size;
 	rstr->base.get = &fmdp_ranged_stream_get;
 	rstr->base.close = &fmdp_ranged_stream_close;
+	rstr->base.get_many = &fmdp_ranged_stream_get_many;
+	rstr->base.prefetch = &fmdp_ranged_stream_prefetch;
 	rstr->base.job = stream->job;
 	rstr->base.file = stream->file;
 	rstr->next = stream;
@@ -438,28 +782,88 @@ fmdp_ranged_stream_create(struct FmdStream *stream,
 }
 
 
-struct FmdCachePage {
-	uint8_t data[FMDP_READ_PAGE_SZ];
-	off_t offs, len;
+/* Size of reads, adapting to access pattern */
+struct FmdReadSizer {
+	size_t size;
+	off_t next;		/* Where last read ended */
+};
+
+/* Returns size for next read at |offs|, up to |cap|: larger, if it
+ * continues the last one, smaller otherwise */
+static size_t
+fmdp_read_size(struct FmdScanJob *job,
+	       struct FmdReadSizer *rs, off_t offs, size_t cap)
+{
+	size_t max = job->read_max ? job->read_max : FMDP_READ_PAGE_SZ;
+	if (max > cap)
+		max = cap;
+	size_t min = job->read_min ? job->read_min : FMDP_READ_MIN_SZ;
+	if (min > max)
+		min = max;
+
+	if (!rs->size)
+		rs->size = min;
+	else if (offs >= rs->next && offs < rs->next + (off_t)rs->size)
+		rs->size *= 2;
+	else
+		rs->size /= 2;
+	if (rs->size < min)
+		rs->size = min;
+	else if (rs->size > max)
+		rs->size = max;
+	return rs->size;
+}
+
+size_t
+fmdp_cache_page_sz(const struct FmdScanJob *job)
+{
+	assert(job);
+	return job->cache_page_sz >= 512 ? job->cache_page_sz :
+		job->cache_page_sz ? 512 : FMDP_READ_PAGE_SZ;
+}
 
-	/* Keeps track of number of cache hits, as well as generation
-	 * (most/least recently used), so a newly read page, won't be
-	 * reclaimed soon after being read */
-	size_t hits, gen;
+struct FmdCachePage {
+	uint8_t *data;
+	off_t index;		/* Page # within file; -1 if unused */
+	/* Valid data, relative to page start */
+	size_t lo, hi;
+
+	struct FmdCachePage *chain; /* Next in |index| bucket */
+	size_t pin;		/* Request using it, not to evict */
+	int ref;		/* Used since CLOCK hand passed */
 };
 struct FmdCachedStream {
 	struct FmdStream base;
 	struct FmdStream *next;
-
-	/* Keep several pages with file data to minimize I/O */
-	/* Those pages are cache, as well as read buffers */
-	struct FmdCachePage *last_hit;
-	struct FmdCachePage page[FMDP_CACHE_PAGES];
-	size_t gen;
+	struct FmdReadSizer sizer;
+
+	/* Pages cache page-aligned slices of file, so a page is found
+	 * by its # through |index| buckets; they double as read
+	 * buffers, that file streams underneath read right into */
+	size_t page_sz, n_pages, n_buckets;
+	struct FmdCachePage *pages;
+	struct FmdCachePage **index;
+	struct iovec *iov;	/* One per page, for batched reads */
+	uint8_t *data;		/* Of all pages, from buffer pool */
+	size_t hand;		/* CLOCK hand, see _page() */
+	size_t reqno;		/* Current request, see |pin| */
+
+	/* Requests spanning pages are stitched together here */
+	uint8_t *stitch;
+	size_t stitch_sz;
+
+	/* Spans of |get_many()|, read past the pages */
+	struct FmdSpanBuf spans;
 };
 #define FMDP_GET_CSTR(_stream)			\
 	(struct FmdCachedStream*)((_stream) - offsetof(struct FmdCachedStream, base))
 
+static const uint8_t* fmdp_file_stream_get(struct FmdStream *stream,
+					   off_t offs, size_t len);
+static ssize_t fmdp_file_stream_readv(struct FmdStream *stream,
+				      struct iovec *iov, int iovcnt,
+				      off_t offs);
+
 static off_t
 fmdp_cached_stream_size(struct FmdStream *stream)
 {
@@ -468,6 +872,165 @@ fmdp_cached_stream_size(struct FmdStream *stream)
 	return cstr->next->size(cstr->next);
 }
 
+static struct FmdCachePage*
+fmdp_cached_stream_find(struct FmdCachedStream *cstr, off_t index)
+{
+	struct FmdCachePage *it =
+		cstr->index[(size_t)index & (cstr->n_buckets - 1)];
+	while (it && it->index != index)
+		it = it->chain;
+	return it;
+}
+
+/* Returns page # |index|, reclaiming one with CLOCK, if not there;
+ * pins it for current request */
+static struct FmdCachePage*
+fmdp_cached_stream_page(struct FmdCachedStream *cstr, off_t index)
+{
+	struct FmdCachePage *page = fmdp_cached_stream_find(cstr, index);
+	if (page) {
+		page->pin = cstr->reqno;
+		return page;
+	}
+
+	/* Sweep, sparing pinned pages and giving used ones a second
+	 * chance; there're always more pages than a request pins */
+	for (;;) {
+		page = &cstr->pages[cstr->hand];
+		if (++cstr->hand == cstr->n_pages)
+			cstr->hand = 0;
+		if (page->pin == cstr->reqno)
+			continue;
+		if (page->ref && page->hi) {
+			page->ref = 0;
+			continue;
+		}
+		break;
+	}
+	if (page->index != -1) {
+		struct FmdCachePage **pp =
+			&cstr->index[(size_t)page->index & (cstr->n_buckets - 1)];
+		while (*pp != page)
+			pp = &(*pp)->chain;
+		*pp = page->chain;
+	}
+	struct FmdCachePage **bucket =
+		&cstr->index[(size_t)index & (cstr->n_buckets - 1)];
+	page->index = index;
+	page->lo = page->hi = 0;
+	page->chain = *bucket;
+	*bucket = page;
+	page->pin = cstr->reqno;
+	page->ref = 1;
+	return page;
+}
+
+/* Reads pages, so [|mlo|, |mhi|) is cached; aligned to file system
+ * block size and as large, as access pattern suggests, up to the end
+ * of the last page, with a single read */
+static int
+fmdp_cached_stream_fetch(struct FmdStream *stream,
+			 off_t mlo, off_t mhi)
+{
+	struct FmdScanJob *job = stream->job;
+	struct FmdCachedStream *cstr = FMDP_GET_CSTR(stream);
+	const off_t psz = (off_t)cstr->page_sz;
+	const int direct = cstr->next->get == &fmdp_file_stream_get;
+
+	off_t lo = mlo;
+	const off_t blksize = stream->file->stat.st_blksize;
+	if (direct && blksize > 1 && blksize <= psz)
+		lo -= lo % blksize;
+	if (lo < mlo - mlo % psz)
+		lo = mlo - mlo % psz;
+	off_t hi = lo + (off_t)fmdp_read_size(job, &cstr->sizer, mlo,
+					      cstr->page_sz);
+	if (hi < mhi)
+		hi = mhi;
+	const off_t lastend = (mhi - 1) / psz * psz + psz;
+	if (hi > lastend)
+		hi = lastend;
+	const off_t filesize = stream->size(stream);
+	if (hi > filesize)
+		hi = filesize;
+	if (direct && (job->flags & fmdsf_direct) == fmdsf_direct &&
+	    psz % FMDP_DIRECT_ALIGN == 0) {
+		/* Whole blocks for O_DIRECT, which reads less at the
+		 * end-of-file */
+		lo -= lo % FMDP_DIRECT_ALIGN;
+		hi += (FMDP_DIRECT_ALIGN - hi % FMDP_DIRECT_ALIGN) %
+			FMDP_DIRECT_ALIGN;
+		if (hi > lastend)
+			hi = lastend;
+	}
+
+	/* Into what is there on each page */
+	const off_t first = lo / psz, last = (hi - 1) / psz;
+	off_t k;
+	size_t i;
+	for (k = first, i = 0; k <= last; ++k, ++i) {
+		struct FmdCachePage *page = fmdp_cached_stream_page(cstr, k);
+		const off_t start = k * psz;
+		const off_t seglo = lo > start ? lo : start;
+		const off_t seghi = hi < start + psz ? hi : start + psz;
+		cstr->iov[i].iov_base = page->data + (seglo - start);
+		cstr->iov[i].iov_len = (size_t)(seghi - seglo);
+	}
+	const size_t n = i;
+
+	ssize_t got;
+	if (direct) {
+		got = fmdp_file_stream_readv(cstr->next, cstr->iov, (int)n, lo);
+	} else {
+		/* Others cannot seek, but going forward */
+		got = 0;
+		for (i = 0; i < n && got != -1; ++i) {
+			const size_t l = cstr->iov[i].iov_len;
+			if (fmdp_read_chunked(cstr->next,
+					      (uint8_t*)cstr->iov[i].iov_base,
+					      lo + got, l) != 0)
+				got = -1;
+			else
+				got += (ssize_t)l;
+		}
+	}
+
+	/* Pages now hold what was read, joined with what they had */
+	for (k = first; k <= last; ++k) {
+		struct FmdCachePage *page = fmdp_cached_stream_find(cstr, k);
+		const off_t start = k * psz;
+		off_t seglo = lo > start ? lo : start;
+		off_t seghi = hi < start + psz ? hi : start + psz;
+		if (got == -1 || lo + got <= seglo) {
+			page->lo = page->hi = 0;
+			continue;
+		}
+		if (seghi > lo + got)
+			seghi = lo + got;
+		seglo -= start;
+		seghi -= start;
+		if (page->hi > page->lo &&
+		    page->hi >= (size_t)seglo &&
+		    page->lo <= (size_t)seghi) {
+			if (page->lo < (size_t)seglo)
+				seglo = (off_t)page->lo;
+			if (page->hi > (size_t)seghi)
+				seghi = (off_t)page->hi;
+		}
+		page->lo = (size_t)seglo;
+		page->hi = (size_t)seghi;
+	}
+	if (got == -1)
+		return -1;
+	cstr->sizer.next = lo + got;
+	if (lo + got < mhi) {
+		errno = ERANGE;
+		FMDP_X(0);
+		return -1;
+	}
+	return 0;
+}
+
 static const uint8_t*
 fmdp_cached_stream_get(struct FmdStream *stream,
 		       off_t offs, size_t len)
@@ -481,7 +1044,7 @@ fmdp_cached_stream_get(struct FmdStream *stream,
 	 * offsets; also make sure request is within file size */
 	const off_t filesize = stream->size(stream);
 	if (offs < 0)
-		offs = filesize - offs;
+		offs += filesize;
 	if (offs < 0 ||
 	    offs + (off_t)len > filesize ||
 	    !len) {
@@ -490,65 +1053,128 @@ fmdp_cached_stream_get(struct FmdStream *stream,
 		return 0;
 	}
 
-	/* Check if read request can be fulfilled from the cache */
-	/* Also keep a track of best page to read into */
-	struct FmdCachePage *unused = 0, *best = cstr->page;
-	const struct FmdCachePage *endp = cstr->page + FMDP_CACHE_PAGES;
-	struct FmdCachePage *it = cstr->last_hit;
-	do {
-		if (it->offs <= offs &&
-		    it->offs + it->len >= offs + (off_t)len) {
-			/* Found in cache */
-			++it->hits;
-			it->gen = ++cstr->gen;
-			cstr->last_hit = it;
-
-			/* Return from cache */
-			++job->n_logreads;
-			++job->n_cachehits;
-			job->v_logreads += len;
-
-			return it->data + (offs - it->offs);
+	/* Look pages up, marking which part is missing */
+	++cstr->reqno;
+	const off_t psz = (off_t)cstr->page_sz, end = offs + (off_t)len;
+	const off_t first = offs / psz, last = (end - 1) / psz;
+	off_t k, mlo = -1, mhi = -1;
+	for (k = first; k <= last; ++k) {
+		const off_t start = k * psz;
+		const size_t nlo = (size_t)((offs > start ? offs : start) - start);
+		const size_t nhi = (size_t)((end < start + psz ? end : start + psz) - start);
+		struct FmdCachePage *page = fmdp_cached_stream_find(cstr, k);
+		if (page) {
+			page->pin = cstr->reqno;
+			page->ref = 1;
+			if (page->lo <= nlo && nhi <= page->hi)
+				continue;
 		}
-		if (!it->len)
-			unused = it;
-		else if (it->gen < best->gen)
-			best = it;
-		if (++it == endp)
-			it = cstr->page;
-	} while (it != cstr->last_hit);
-
-	/* Not found in cache, will read into |unused| or |best| */
-	if (unused)
-		best = unused;
-	++job->n_cachemisses;
+		if (mlo == -1)
+			mlo = start + (off_t)nlo;
+		mhi = start + (off_t)nhi;
+	}
 
-	/* XXX: align read to optimal block size, if possible */
-	/* XXX: align read not to include already cached page */
-	len = FMDP_READ_PAGE_SZ;
-	if (offs + (off_t)len > filesize)
-		len = filesize - offs;
-	const uint8_t *ptr =
-		cstr->next->get(cstr->next, offs, len);
-	if (!ptr) {
-		FMDP_X(0);
+	++job->n_logreads;
+	job->v_logreads += len;
+	if (mlo == -1) {
+		++job->n_cachehits;
+	} else {
+		++job->n_cachemisses;
+		if (fmdp_cached_stream_fetch(stream, mlo, mhi) != 0)
+			return 0;
+	}
+
+	struct FmdCachePage *page = fmdp_cached_stream_find(cstr, first);
+	if (first == last)
+		return page->data + (offs - first * psz);
+
+	/* Stitch pages together */
+	if (len > cstr->stitch_sz) {
+		uint8_t *stitch = (uint8_t*)realloc(cstr->stitch, len);
+		if (!stitch)
+			return 0;
+		cstr->stitch = stitch;
+		cstr->stitch_sz = len;
+	}
+	size_t done = 0;
+	for (k = first; k <= last; ++k) {
+		const off_t start = k * psz;
+		const off_t seglo = offs > start ? offs : start;
+		const off_t seghi = end < start + psz ? end : start + psz;
+		page = fmdp_cached_stream_find(cstr, k);
+		memcpy(cstr->stitch + done, page->data + (seglo - start),
+		       (size_t)(seghi - seglo));
+		done += (size_t)(seghi - seglo);
+	}
+	return cstr->stitch;
+}
+
+/* |read()| for fmdp_get_spans(); copies from a cached page, or reads
+ * from file right into |dst|, keeping pages intact */
+static int
+fmdp_cached_stream_read(struct FmdStream *stream, uint8_t *dst,
+			off_t offs, size_t len)
+{
+	assert(stream);
+
+	struct FmdScanJob *job = stream->job;
+	struct FmdCachedStream *cstr = FMDP_GET_CSTR(stream);
+	const off_t psz = (off_t)cstr->page_sz;
+	struct FmdCachePage *page = fmdp_cached_stream_find(cstr, offs / psz);
+	const off_t start = offs - offs % psz;
+	if (page &&
+	    (off_t)page->lo <= offs - start &&
+	    offs - start + (off_t)len <= (off_t)page->hi) {
+		page->ref = 1;
+		++job->n_cachehits;
+		memcpy(dst, page->data + (offs - start), len);
 		return 0;
 	}
+	++job->n_cachemisses;
 
-	memcpy(best->data, ptr, len);
-	best->offs = offs;
-	best->len = len;
-	best->hits = 1;
-	best->gen = ++cstr->gen;
-	cstr->last_hit = best;
+	if (cstr->next->get != &fmdp_file_stream_get)
+		/* Go through the pages, for streams that cannot seek */
+		return fmdp_read_chunked(stream, dst, offs, len);
+	struct iovec iov = { dst, len };
+	ssize_t reallen = fmdp_file_stream_readv(cstr->next, &iov, 1, offs);
+	if (reallen == -1)
+		return -1;
+	if (reallen < (ssize_t)len) {
+		errno = ERANGE;
+		FMDP_X(0);
+		return -1;
+	}
+	return 0;
+}
 
-	++job->n_logreads;
-	job->v_logreads += len;
+static int
+fmdp_cached_stream_get_many(struct FmdStream *stream,
+			    struct FmdRange *ranges, size_t n)
+{
+	assert(stream);
 
-	assert(offs >= best->offs);
-	return best->data + (offs - best->offs);
+	struct FmdCachedStream *cstr = FMDP_GET_CSTR(stream);
+	return fmdp_get_spans(stream, &cstr->spans, ranges, n,
+			      &fmdp_cached_stream_read);
 }
 
+static void
+fmdp_cached_stream_prefetch(struct FmdStream *stream,
+			    off_t offs, size_t len)
+{
+	assert(stream);
+
+	struct FmdCachedStream *cstr = FMDP_GET_CSTR(stream);
+	const off_t psz = (off_t)cstr->page_sz;
+	const struct FmdCachePage *page =
+		fmdp_cached_stream_find(cstr, offs / psz);
+	const off_t start = offs - offs % psz;
+	if (page &&
+	    (off_t)page->lo <= offs - start &&
+	    offs - start + (off_t)len <= (off_t)page->hi)
+		return;	/* Cached already */
+	fmdp_stream_prefetch(cstr->next, offs, len);
+}
 
 static void
 fmdp_cached_stream_close(struct FmdStream *stream)
@@ -557,38 +1183,116 @@ fmdp_cached_stream_close(struct FmdStream *stream)
 
 	struct FmdCachedStream *cstr = FMDP_GET_CSTR(stream);
 	cstr->next->close(cstr->next);
+	fmdp_buf_put(stream->job, cstr->data, cstr->n_pages * cstr->page_sz);
+	free(cstr->stitch);
+	free(cstr->spans.data);
 	free(cstr);
 }
 
+static const uint8_t* fmdp_mmap_stream_get(struct FmdStream *stream,
+					   off_t offs, size_t len);
+
 struct FmdStream*
 fmdp_cache_stream(struct FmdStream *stream)
 {
 	assert(stream);
 
+	/* Mapped file is its own cache */
+	if (fmdp_stream_mapped(stream) ||
+	    stream->get == &fmdp_cached_stream_get)
+		return stream;
+
+	/* Enough pages for any request to fit, with one to spare; as
+	 * few, as that, near the cap of buffer memory. Files go on
+	 * uncached then, but streams, that cannot seek, need pages */
+	struct FmdScanJob *job = stream->job;
+	const size_t page_sz = fmdp_cache_page_sz(job);
+	size_t n_pages = job->cache_pages ? job->cache_pages : FMDP_CACHE_PAGES;
+	const size_t min_pages = (FMDP_READ_PAGE_SZ + page_sz - 1) / page_sz + 2;
+	const int must = stream->get != &fmdp_file_stream_get;
+	if (n_pages < min_pages)
+		n_pages = min_pages;
+	uint8_t *data = (uint8_t*)fmdp_buf_get(job, n_pages * page_sz, 0);
+	if (!data) {
+		n_pages = min_pages;
+		data = (uint8_t*)fmdp_buf_get(job, n_pages * page_sz, must);
+	}
+	if (!data)
+		return stream;
+	size_t n_buckets = 1;
+	while (n_buckets < n_pages)
+		n_buckets <<= 1;
+
+	/* All in one block: stream, pages, index, iov */
+	const size_t hdrsz = sizeof (struct FmdCachedStream) +
+			     n_pages * sizeof (struct FmdCachePage) +
+			     n_buckets * sizeof (struct FmdCachePage*) +
+			     n_pages * sizeof (struct iovec);
 	struct FmdCachedStream *cstr =
-		(struct FmdCachedStream*)calloc(1, sizeof *cstr);
+		(struct FmdCachedStream*)calloc(1, hdrsz);
 	if (cstr) {
 		cstr->base.size = &fmdp_cached_stream_size;
 		cstr->base.get = &fmdp_cached_stream_get;
 		cstr->base.close = &fmdp_cached_stream_close;
+		cstr->base.get_many = &fmdp_cached_stream_get_many;
+		cstr->base.prefetch = &fmdp_cached_stream_prefetch;
 		cstr->base.job = stream->job;
 		cstr->base.file = stream->file;
 		cstr->next = stream;
-		cstr->last_hit = cstr->page;
+		cstr->page_sz = page_sz;
+		cstr->n_pages = n_pages;
+		cstr->n_buckets = n_buckets;
+		cstr->pages = (struct FmdCachePage*)(cstr + 1);
+		cstr->index = (struct FmdCachePage**)(cstr->pages + n_pages);
+		cstr->iov = (struct iovec*)(cstr->index + n_buckets);
+		cstr->data = data;
+		size_t i;
+		for (i = 0; i < n_pages; ++i) {
+			cstr->pages[i].data = data + i * page_sz;
+			cstr->pages[i].index = -1;
+		}
 		stream = &cstr->base;
+	} else {
+		fmdp_buf_put(job, data, n_pages * page_sz);
 	}
 	/* Cannot allocate memory -> return original |stream| */
 	return stream;
 }
 
 
+/* Returns offset to read a page from, so it holds |offs + len|, and
+ * is aligned to file system block size, if possible */
+static off_t
+fmdp_aligned_offs(const struct FmdFile *file,
+		  off_t offs, size_t len, size_t pagesz)
+{
+	off_t blksize = file->stat.st_blksize;
+	if (blksize > (off_t)FMDP_READ_PAGE_SZ)
+		blksize = FMDP_READ_PAGE_SZ;
+	if (blksize <= 1)
+		return offs;
+	const off_t aligned = offs - offs % blksize;
+	return offs + (off_t)len - aligned <= (off_t)pagesz ? aligned : offs;
+}
+
 struct FmdFileStream {
 	struct FmdStream base;
 	int fd;
 
+	/* Own buffer is only used, when not cached; allocated on
+	 * first use */
 	off_t offs;
 	size_t len;
-	uint8_t buf[FMDP_READ_PAGE_SZ];
+	uint8_t *buf;
+	struct FmdReadSizer sizer;
+
+	struct FmdSpanBuf spans;
+
+	/* Octets read, kept out of page cache with fmdsf_cold; with
+	 * fmdsf_direct, |direct| is 1 while O_DIRECT is on, and -1,
+	 * once it is off for good */
+	off_t v_read;
+	int direct;
 };
 #define FMDP_GET_FSTR(_stream)			\
 	(struct FmdFileStream*)((_stream) - offsetof(struct FmdFileStream, base))
@@ -601,6 +1305,94 @@ fmdp_file_stream_size(struct FmdStream *stream)
 	return fstr->base.file->stat.st_size;
 }
 
+/* Turns O_DIRECT on, while reads are |aligned|; off for good with
+ * the first one, that is not, so as not to flip it back and forth */
+static void
+fmdp_file_stream_direct(struct FmdFileStream *fstr, int aligned)
+{
+#if defined (O_DIRECT)
+	if (fstr->direct == -1 || aligned == (fstr->direct == 1))
+		return;
+	const int fl = fcntl(fstr->fd, F_GETFL);
+	if (aligned && fl != -1 &&
+	    fcntl(fstr->fd, F_SETFL, fl | O_DIRECT) == 0) {
+		fstr->direct = 1;
+		return;
+	}
+	if (fstr->direct == 1 && fl != -1)
+		(void)fcntl(fstr->fd, F_SETFL, fl & ~O_DIRECT);
+	fstr->direct = -1;
+#else
+	(void)aligned;
+	fstr->direct = -1;
+#endif
+}
+
+/* Whether O_DIRECT can read into |iovcnt| buffers of |iov| at |offs| */
+static int
+fmdp_direct_aligned(const struct iovec *iov, int iovcnt, off_t offs)
+{
+	if (offs % FMDP_DIRECT_ALIGN)
+		return 0;
+	for (; iovcnt; ++iov, --iovcnt)
+		if ((uintptr_t)iov->iov_base % FMDP_DIRECT_ALIGN ||
+		    iov->iov_len % FMDP_DIRECT_ALIGN)
+			return 0;
+	return 1;
+}
+
+/* Reads into |iovcnt| buffers of |iov| at |offs|, with positional
+ * reads, so streams share no file offset; returns octets read (less
+ * on end-of-file), or -1. Consumes |iov| */
+static ssize_t
+fmdp_file_stream_readv(struct FmdStream *stream,
+		       struct iovec *iov, int iovcnt, off_t offs)
+{
+	assert(stream);
+	assert(iov);
+
+	struct FmdFileStream *fstr = FMDP_GET_FSTR(stream);
+	size_t done = 0;
+	while (iovcnt && !iov->iov_len)
+		++iov, --iovcnt;
+	if ((stream->job->flags & fmdsf_direct) == fmdsf_direct)
+		fmdp_file_stream_direct(fstr,
+					fmdp_direct_aligned(iov, iovcnt, offs));
+	while (iovcnt) {
+		ssize_t res = iovcnt == 1 ?
+			pread(fstr->fd, iov->iov_base, iov->iov_len,
+			      offs + (off_t)done) :
+			preadv(fstr->fd, iov, iovcnt, offs + (off_t)done);
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res == -1 && errno == EINVAL && fstr->direct == 1) {
+			/* Not for this file system, after all */
+			fmdp_file_stream_direct(fstr, 0);
+			continue;
+		}
+		if (res == -1) {
+			FMDP_X(0);
+			return -1;
+		}
+		if (!res)
+			break;
+		done += (size_t)res;
+
+		/* Skip over what has been read */
+		while (iovcnt && (size_t)res >= iov->iov_len) {
+			res -= iov->iov_len;
+			++iov, --iovcnt;
+		}
+		if (iovcnt) {
+			iov->iov_base = (uint8_t*)iov->iov_base + res;
+			iov->iov_len -= (size_t)res;
+		}
+	}
+
+	fmdp_stream_count_read(stream, done);
+	return (ssize_t)done;
+}
+
 static const uint8_t*
 fmdp_file_stream_get(struct FmdStream *stream,
 		     off_t offs, size_t len)
@@ -609,6 +1401,15 @@ fmdp_file_stream_get(struct FmdStream *stream,
 	assert(len);
 
 	struct FmdFileStream *fstr = FMDP_GET_FSTR(stream);
+	const off_t filesize = stream->size(stream);
+	if (offs < 0)
+		offs += filesize;
+	if (offs < 0 ||
+	    offs + (off_t)len > filesize) {
+		errno = ERANGE;
+		FMDP_X(0);
+		return 0;
+	}
 
 	if (fstr->offs <= offs &&
 	    fstr->offs + fstr->len >= offs + len) {
@@ -616,33 +1417,73 @@ fmdp_file_stream_get(struct FmdStream *stream,
 		return fstr->buf + (offs - fstr->offs);
 	}
 
-	/* XXX: align if requested size is smaller than page size */
-	off_t realoffs = lseek(fstr->fd, offs, SEEK_SET);
-	if (realoffs == -1)
+	if (!fstr->buf &&
+	    !(fstr->buf = (uint8_t*)fmdp_buf_get(stream->job,
+						 FMDP_READ_PAGE_SZ, 1)))
 		return 0;
-	if (realoffs != offs) {
-		errno = ENOTRECOVERABLE;
-		FMDP_X(0);
+	fstr->len = 0;
+	const off_t roffs = fmdp_aligned_offs(stream->file, offs, len,
+					      FMDP_READ_PAGE_SZ);
+	size_t want = fmdp_read_size(stream->job, &fstr->sizer, offs,
+				     FMDP_READ_PAGE_SZ);
+	if (roffs + (off_t)want < offs + (off_t)len)
+		want = (size_t)(offs + (off_t)len - roffs);
+	struct iovec iov = { fstr->buf, want };
+	ssize_t reallen = fmdp_file_stream_readv(stream, &iov, 1, roffs);
+	if (reallen == -1)
 		return 0;
-	}
+	fstr->sizer.next = roffs + reallen;
 
-	ssize_t reallen = read(fstr->fd, fstr->buf, FMDP_READ_PAGE_SZ);
-	if (reallen == -1)
+	fstr->offs = roffs;
+	fstr->len = reallen;
+	if (roffs + reallen < offs + (off_t)len) {
+		errno = ERANGE;
+		FMDP_X(0);
 		return 0;
+	}
 
-	struct FmdScanJob *job = stream->job;
-	++job->n_physreads;
-	job->v_physreads += len;
+	return fstr->buf + (offs - roffs);
+}
 
-	fstr->offs = realoffs;
-	fstr->len = reallen;
+static int
+fmdp_file_stream_read(struct FmdStream *stream, uint8_t *dst,
+		      off_t offs, size_t len)
+{
+	struct iovec iov = { dst, len };
+	ssize_t reallen = fmdp_file_stream_readv(stream, &iov, 1, offs);
+	if (reallen == -1)
+		return -1;
 	if (reallen < (ssize_t)len) {
 		errno = ERANGE;
 		FMDP_X(0);
-		return 0;
+		return -1;
 	}
+	return 0;
+}
+
+static int
+fmdp_file_stream_get_many(struct FmdStream *stream,
+			  struct FmdRange *ranges, size_t n)
+{
+	assert(stream);
 
-	return fstr->buf + (offs - fstr->offs);
+	struct FmdFileStream *fstr = FMDP_GET_FSTR(stream);
+	return fmdp_get_spans(stream, &fstr->spans, ranges, n,
+			      &fmdp_file_stream_read);
+}
+
+static void
+fmdp_file_stream_prefetch(struct FmdStream *stream,
+			  off_t offs, size_t len)
+{
+	assert(stream);
+
+	struct FmdFileStream *fstr = FMDP_GET_FSTR(stream);
+	/* Let kernel read it ahead, while we're busy with the rest */
+	const off_t roffs = fmdp_aligned_offs(stream->file, offs, len,
+					      FMDP_READ_PAGE_SZ);
+	(void)posix_fadvise(fstr->fd, roffs, offs + (off_t)len - roffs,
+			    POSIX_FADV_WILLNEED);
 }
 
 static void
@@ -650,17 +1491,26 @@ fmdp_file_stream_close(struct FmdStream *stream)
 {
 	assert(stream);
 
+	struct FmdScanJob *job = stream->job;
 	struct FmdFileStream *fstr = FMDP_GET_FSTR(stream);
+	if (FMDP_COLD(job)) {
+		/* Drop what has been read from page cache */
+		(void)posix_fadvise(fstr->fd, 0, 0, POSIX_FADV_DONTNEED);
+		job->v_uncached += fstr->v_read;
+	}
 	close(fstr->fd);
+	fmdp_buf_put(job, fstr->buf, FMDP_READ_PAGE_SZ);
+	free(fstr->spans.data);
 	free(fstr);
 }
 
 struct FmdStream*
-fmdp_open_file(struct FmdScanJob *job,
-	       int dirfd, struct FmdFile *file, int cached)
+fmdp_file_stream_create(struct FmdScanJob *job,
+			struct FmdFile *file, int fd)
 {
 	assert(job);
 	assert(file);
+	assert(fd != -1);
 
 	struct FmdFileStream *fstr =
 		(struct FmdFileStream*)calloc(1, sizeof *fstr);
@@ -670,25 +1520,475 @@ fmdp_open_file(struct FmdScanJob *job,
 	fstr->base.size = &fmdp_file_stream_size;
 	fstr->base.get = &fmdp_file_stream_get;
 	fstr->base.close = &fmdp_file_stream_close;
+	fstr->base.get_many = &fmdp_file_stream_get_many;
+	fstr->base.prefetch = &fmdp_file_stream_prefetch;
 	fstr->base.job = job;
 	fstr->base.file = file;
-	fstr->fd = openat(dirfd, dirfd != AT_FDCWD ? file->name : file->path,
-			  O_RDONLY);
-	if (fstr->fd == -1) {
-		free(fstr);
+	fstr->fd = fd;
+	return &fstr->base;
+}
+
+uint8_t*
+fmdp_stream_fill(struct FmdStream *stream,
+		 off_t offs, size_t len)
+{
+	assert(stream);
+	assert(len <= FMDP_READ_PAGE_SZ);
+
+	if (stream->get == &fmdp_cached_stream_get) {
+		/* Fill the page, that holds |offs| */
+		struct FmdCachedStream *cstr = FMDP_GET_CSTR(stream);
+		const off_t psz = (off_t)cstr->page_sz;
+		const off_t start = offs - offs % psz;
+		assert(offs + (off_t)len <= start + psz);
+		++cstr->reqno;
+		struct FmdCachePage *page =
+			fmdp_cached_stream_page(cstr, offs / psz);
+		page->lo = (size_t)(offs - start);
+		page->hi = page->lo + len;
+		if (!len)
+			page->lo = page->hi = 0;
+		return page->data + (offs - start);
+	}
+
+	assert(stream->get == &fmdp_file_stream_get);
+	struct FmdFileStream *fstr = FMDP_GET_FSTR(stream);
+	if (!fstr->buf &&
+	    !(fstr->buf = (uint8_t*)fmdp_buf_get(stream->job,
+						 FMDP_READ_PAGE_SZ, 1)))
+		return 0;
+	fstr->offs = offs;
+	fstr->len = len;
+	return fstr->buf;
+}
+
+void
+fmdp_stream_count_read(struct FmdStream *stream,
+		       size_t len)
+{
+	assert(stream);
+
+	struct FmdScanJob *job = stream->job;
+	++job->n_physreads;
+	job->v_physreads += len;
+	fmdp_sched_charge(job, stream->file->stat.st_dev, len);
+	if (stream->get == &fmdp_cached_stream_get) {
+		struct FmdCachedStream *cstr = FMDP_GET_CSTR(stream);
+		stream = cstr->next;
+	}
+	if (stream->get == &fmdp_file_stream_get) {
+		struct FmdFileStream *fstr = FMDP_GET_FSTR(stream);
+		fstr->v_read += (off_t)len;
+	}
+}
+
+void
+fmdp_stream_abandon(struct FmdStream *stream)
+{
+	assert(stream);
+
+	struct FmdScanJob *job = stream->job;
+	if (stream->get == &fmdp_cached_stream_get) {
+		struct FmdCachedStream *cstr = FMDP_GET_CSTR(stream);
+		fmdp_buf_lose(job, cstr->data, cstr->n_pages * cstr->page_sz);
+		cstr->data = 0;
+	} else if (stream->get == &fmdp_file_stream_get) {
+		struct FmdFileStream *fstr = FMDP_GET_FSTR(stream);
+		fmdp_buf_lose(job, fstr->buf, FMDP_READ_PAGE_SZ);
+		fstr->buf = 0;
+	}
+	/* Requests in flight hold the file, not its descriptor */
+	stream->close(stream);
+}
+
+struct FmdMmapStream {
+	struct FmdStream base;
+	int fd;
+
+	const uint8_t *addr;
+	size_t len;
+};
+#define FMDP_GET_MSTR(_stream)			\
+	(struct FmdMmapStream*)((_stream) - offsetof(struct FmdMmapStream, base))
+
+static off_t
+fmdp_mmap_stream_size(struct FmdStream *stream)
+{
+	assert(stream);
+	struct FmdMmapStream *mstr = FMDP_GET_MSTR(stream);
+	return (off_t)mstr->len;
+}
+
+static const uint8_t*
+fmdp_mmap_stream_get(struct FmdStream *stream,
+		     off_t offs, size_t len)
+{
+	assert(stream);
+	assert(len);
+
+	struct FmdMmapStream *mstr = FMDP_GET_MSTR(stream);
+	const off_t size = (off_t)mstr->len;
+	if (offs < 0)
+		offs += size;
+	if (offs < 0 ||
+	    offs + (off_t)len > size ||
+	    !len) {
+		errno = ERANGE;
+		FMDP_X(0);
+		return 0;
+	}
+
+	struct FmdScanJob *job = stream->job;
+	++job->n_logreads;
+	job->v_logreads += len;
+	return mstr->addr + offs;
+}
+
+static int
+fmdp_mmap_stream_get_many(struct FmdStream *stream,
+			  struct FmdRange *ranges, size_t n)
+{
+	assert(stream);
+
+	/* Nothing to read, just point into the mapping */
+	struct FmdMmapStream *mstr = FMDP_GET_MSTR(stream);
+	const off_t size = (off_t)mstr->len;
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		struct FmdRange *r = &ranges[i];
+		if (r->offs < 0)
+			r->offs += size;
+		if (r->offs < 0 ||
+		    !r->len ||
+		    r->offs + (off_t)r->len > size) {
+			errno = ERANGE;
+			FMDP_X(0);
+			return -1;
+		}
+		r->data = mstr->addr + r->offs;
+		++stream->job->n_logreads;
+		stream->job->v_logreads += r->len;
+	}
+	return 0;
+}
+
+static void
+fmdp_mmap_stream_prefetch(struct FmdStream *stream,
+			  off_t offs, size_t len)
+{
+	assert(stream);
+
+	struct FmdMmapStream *mstr = FMDP_GET_MSTR(stream);
+	/* Advice range should start at page boundary */
+	const off_t pgsz = sysconf(_SC_PAGESIZE);
+	const off_t start = pgsz > 0 ? offs - offs % pgsz : offs;
+	(void)posix_madvise((void*)(mstr->addr + start),
+			    (size_t)(offs - start) + len, POSIX_MADV_WILLNEED);
+}
+
+static void
+fmdp_mmap_stream_close(struct FmdStream *stream)
+{
+	assert(stream);
+
+	struct FmdMmapStream *mstr = FMDP_GET_MSTR(stream);
+	munmap((void*)mstr->addr, mstr->len);
+	close(mstr->fd);
+	free(mstr);
+}
+
+int
+fmdp_stream_mapped(const struct FmdStream *stream)
+{
+	assert(stream);
+	return stream->get == &fmdp_mmap_stream_get;
+}
+
+int
+fmdp_mmap_worth(struct FmdScanJob *job,
+		const struct FmdFile *file)
+{
+	assert(job);
+	assert(file);
+
+	const off_t min = job->mmap_min;
+	return min > 0 &&
+		!FMDP_COLD(job) &&
+		!FMDP_TYPEONLY(job) &&
+		!fmdp_sched_throttled(job, file->stat.st_dev) &&
+		S_ISREG(file->stat.st_mode) &&
+		file->stat.st_size >= min &&
+		(uintmax_t)file->stat.st_size <= (uintmax_t)SIZE_MAX;
+}
+
+struct FmdStream*
+fmdp_mmap_stream_create(struct FmdScanJob *job,
+			struct FmdFile *file, int fd)
+{
+	assert(job);
+	assert(file);
+	assert(fd != -1);
+
+	const size_t len = (size_t)file->stat.st_size;
+	if (!len)
+		return (errno = EINVAL), (void*)0;
+	int mflags = MAP_SHARED;
+#if defined (MAP_POPULATE)
+	if (job->mmap_flags & fmdmf_populate)
+		mflags |= MAP_POPULATE;
+#endif
+	void *addr = mmap(0, len, PROT_READ, mflags, fd, 0);
+	if (addr == MAP_FAILED) {
+		FMDP_X(0);
+		return 0;
+	}
+	/* Hints are just hints; ignore failures */
+	if (job->mmap_flags & fmdmf_random)
+		(void)posix_madvise(addr, len, POSIX_MADV_RANDOM);
+	else if (job->mmap_flags & fmdmf_sequential)
+		(void)posix_madvise(addr, len, POSIX_MADV_SEQUENTIAL);
+	if (job->mmap_flags & fmdmf_willneed)
+		(void)posix_madvise(addr, len, POSIX_MADV_WILLNEED);
+
+	struct FmdMmapStream *mstr =
+		(struct FmdMmapStream*)calloc(1, sizeof *mstr);
+	if (!mstr) {
+		munmap(addr, len);
+		return 0;
+	}
+	mstr->base.size = &fmdp_mmap_stream_size;
+	mstr->base.get = &fmdp_mmap_stream_get;
+	mstr->base.close = &fmdp_mmap_stream_close;
+	mstr->base.get_many = &fmdp_mmap_stream_get_many;
+	mstr->base.prefetch = &fmdp_mmap_stream_prefetch;
+	mstr->base.job = job;
+	mstr->base.file = file;
+	mstr->fd = fd;
+	mstr->addr = (const uint8_t*)addr;
+	mstr->len = len;
+	++job->n_mmaps;
+	return &mstr->base;
+}
+
+int
+fmdp_stream_get_many(struct FmdStream *stream,
+		     struct FmdRange *ranges, size_t n)
+{
+	assert(stream);
+	assert(ranges || !n);
+
+	if (stream->get_many)
+		return stream->get_many(stream, ranges, n);
+	if (n != 1 || ranges->len > FMDP_READ_PAGE_SZ)
+		return (errno = ENOTSUP), -1;
+	ranges->data = stream->get(stream, ranges->offs, ranges->len);
+	return ranges->data ? 0 : -1;
+}
+
+static int
+fmdp_range_cmp(const void *a, const void *b)
+{
+	const struct FmdRange *ra = *(const struct FmdRange* const*)a;
+	const struct FmdRange *rb = *(const struct FmdRange* const*)b;
+	return ra->offs < rb->offs ? -1 : ra->offs > rb->offs;
+}
+
+int
+fmdp_get_spans(struct FmdStream *stream, struct FmdSpanBuf *buf,
+	       struct FmdRange *ranges, size_t n,
+	       int (*read)(struct FmdStream *stream, uint8_t *dst,
+			   off_t offs, size_t len))
+{
+	assert(stream);
+	assert(buf);
+	assert(ranges || !n);
+	assert(read);
+
+	if (!n)
+		return 0;
+	struct FmdRange **sorted =
+		(struct FmdRange**)malloc(n * sizeof *sorted);
+	if (!sorted)
+		return -1;
+
+	/* Check ranges, then sort them by offset */
+	struct FmdScanJob *job = stream->job;
+	const off_t ssize = stream->size(stream);
+	size_t i, j;
+	for (i = 0; i < n; ++i) {
+		struct FmdRange *r = &ranges[i];
+		if (r->offs < 0)
+			r->offs += ssize;
+		if (r->offs < 0 ||
+		    !r->len ||
+		    r->offs + (off_t)r->len > ssize) {
+			free(sorted);
+			errno = ERANGE;
+			FMDP_X(0);
+			return -1;
+		}
+		r->data = 0;
+		sorted[i] = r;
+		++job->n_logreads;
+		job->v_logreads += r->len;
+	}
+	qsort(sorted, n, sizeof *sorted, &fmdp_range_cmp);
+
+	/* Twice: size up all spans, then read each into |buf| */
+	int pass;
+	for (pass = 0; pass < 2; ++pass) {
+		size_t total = 0;
+		for (i = 0; i < n; i = j) {
+			const off_t start = sorted[i]->offs;
+			off_t end = start + (off_t)sorted[i]->len;
+			for (j = i + 1;
+			     j < n && sorted[j]->offs <= end + FMDP_SPAN_GAP;
+			     ++j)
+				if (sorted[j]->offs + (off_t)sorted[j]->len > end)
+					end = sorted[j]->offs + (off_t)sorted[j]->len;
+			if (pass) {
+				uint8_t *dst = buf->data + total;
+				if (read(stream, dst, start, end - start) != 0) {
+					free(sorted);
+					return -1;
+				}
+				for (; i < j; ++i)
+					sorted[i]->data = dst + (sorted[i]->offs - start);
+			}
+			total += (size_t)(end - start);
+		}
+		if (!pass && total > buf->size) {
+			uint8_t *data = (uint8_t*)realloc(buf->data, total);
+			if (!data) {
+				free(sorted);
+				return -1;
+			}
+			buf->data = data;
+			buf->size = total;
+		}
+	}
+	free(sorted);
+	return 0;
+}
+
+int
+fmdp_read_chunked(struct FmdStream *stream, uint8_t *dst,
+		  off_t offs, size_t len)
+{
+	assert(stream);
+	assert(dst);
+
+	while (len) {
+		size_t l = len > FMDP_READ_PAGE_SZ ? FMDP_READ_PAGE_SZ : len;
+		const uint8_t *p = stream->get(stream, offs, l);
+		if (!p)
+			return -1;
+		memcpy(dst, p, l);
+		dst += l;
+		offs += (off_t)l;
+		len -= l;
+	}
+	return 0;
+}
+
+void
+fmdp_stream_prefetch(struct FmdStream *stream,
+		     off_t offs, size_t len)
+{
+	assert(stream);
+
+	const off_t ssize = stream->size(stream);
+	if (offs < 0)
+		offs += ssize;
+	if (offs < 0 || !len)
+		return;
+	if (offs + (off_t)len > ssize) {
+		if (offs >= ssize)
+			return;
+		len = (size_t)(ssize - offs);
+	}
+	if (stream->prefetch)
+		stream->prefetch(stream, offs, len);
+}
+
+off_t
+fmdp_tail_offs(struct FmdScanJob *job,
+	       const struct FmdFile *file)
+{
+	assert(job);
+	assert(file);
+
+	size_t len = FMDP_TYPEONLY(job) ? 0 : job->tail_prefetch;
+	if (len > FMDP_READ_PAGE_SZ)
+		len = FMDP_READ_PAGE_SZ;
+	/* Not worth it, if header read covers the tail */
+	if (!len || file->stat.st_size <= (off_t)(FMDP_READ_PAGE_SZ + len))
+		return -1;
+	const off_t offs = file->stat.st_size - (off_t)len;
+	return fmdp_aligned_offs(file, offs, len, FMDP_READ_PAGE_SZ);
+}
+
+int
+fmdp_openat(struct FmdScanJob *job,
+	    int dirfd, const char *path, int flags)
+{
+	assert(job);
+	assert(path);
+
+#if defined (O_NOATIME)
+	if (FMDP_COLD(job)) {
+		const int fd = openat(dirfd, path, flags | O_NOATIME);
+		/* Only owner is permitted to */
+		if (fd != -1 || errno != EPERM)
+			return fd;
+	}
+#endif
+	return openat(dirfd, path, flags);
+}
+
+struct FmdStream*
+fmdp_open_file(struct FmdScanJob *job,
+	       int dirfd, struct FmdFile *file, int cached)
+{
+	assert(job);
+	assert(file);
+
+	int fd = fmdp_openat(job, dirfd,
+			     dirfd != AT_FDCWD ? file->name : file->path,
+			     O_RDONLY);
+	if (fd == -1) {
 		FMDP_X(0);
 		return 0;
 	}
 	++job->n_filopens;
 
-	/* Issue a request to read file header */
-	struct FmdStream *res = &fstr->base;
-	if (cached) {
-		struct FmdStream *c = fmdp_cache_stream(res);
-		if (c)
-			res = c;
+	/* Large files are mapped, falling back to reading them */
+	struct FmdStream *res = 0;
+	if (fmdp_mmap_worth(job, file) &&
+	    (res = fmdp_mmap_stream_create(job, file, fd)) != NULL)
+		return res;
+	res = fmdp_file_stream_create(job, file, fd);
+	if (!res) {
+		close(fd);
+		return 0;
 	}
-	(void)fmdp_file_stream_get(res, 0, FMDP_READ_PAGE_SZ);
+	/* Header alone is read to tell the type, see fmdsf_typeonly */
+	if (cached && !FMDP_TYPEONLY(job))
+		res = fmdp_cache_stream(res);
+
+	/* Have the tail read in background, while reading header */
+	const off_t toffs = fmdp_tail_offs(job, file);
+	if (toffs != -1)
+		fmdp_stream_prefetch(res, toffs,
+				     (size_t)(file->stat.st_size - toffs));
+
+	/* Issue a request to read file header */
+	size_t len = FMDP_TYPEONLY(job) ? FMDP_TYPE_HEADER_SZ :
+		FMDP_READ_PAGE_SZ;
+	if ((off_t)len > file->stat.st_size)
+		len = (size_t)file->stat.st_size;
+	if (len)
+		(void)res->get(res, 0, len);
 	return res;
 }
 
@@ -778,20 +2078,59 @@ fmdp_probe_file(struct FmdScanJob *job,
 		return (errno = EINVAL), -1;
 
 	/* File should have minimum length in order to probe it */
-	if (file->stat.st_size < FMDP_MIN_FSIZE)
+	if (file->stat.st_size < FMDP_MIN_PROBED(job))
 		return 0;
 
+	/* Wait for a slot on its device, unless holding one */
+	const dev_t dev = file->stat.st_dev;
+	const int slot = fmdp_sched_begin(job, dev) == 0;
 	struct FmdStream *stream = fmdp_open_file(job, dirfd, file, /*cache*/1);
 	if (!stream) {
 		job->log(job, file->path, fmdlt_oserr, "%s(%s): %s",
 			 "fmdp_open_file", file->path, strerror(errno));
+		if (slot)
+			fmdp_sched_end(job, dev);
 		FMDP_X(-1);
 		return -1;
 	}
 	stream->job = job;
 
 	int rv = fmdp_probe_stream(stream);
+	if (rv == 0 && FMDP_HASH(job))
+		rv = fmdp_hash_stream(stream);
 	stream->close(stream);
+	if (slot)
+		fmdp_sched_end(job, dev);
+	if (rv == 0 && job->cache && !job->elements && !FMDP_TYPEONLY(job))
+		fmdp_probe_cache_store(job, file);
+	if (rv == 0)
+		fmdp_links_store(job, file);
+	return rv;
+}
+
+
+int
+fmdp_probe_opened(struct FmdScanJob *job,
+		  struct FmdStream *stream)
+{
+	assert(job);
+	assert(stream);
+
+	/* Would return original |stream|, if cannot cache; there is
+	 * nothing to cache for the header alone, see fmdsf_typeonly */
+	if (!FMDP_TYPEONLY(job))
+		stream = fmdp_cache_stream(stream);
+	stream->job = job;
+
+	struct FmdFile *file = stream->file;
+	int rv = fmdp_probe_stream(stream);
+	if (rv == 0 && FMDP_HASH(job))
+		rv = fmdp_hash_stream(stream);
+	stream->close(stream);
+	if (rv == 0 && job->cache && !job->elements && !FMDP_TYPEONLY(job))
+		fmdp_probe_cache_store(job, file);
+	if (rv == 0)
+		fmdp_links_store(job, file);
 	return rv;
 }
 
@@ -807,41 +2146,17 @@ fmdp_probe_stream(struct FmdStream *stream)
 	/* File should have minimum length in order to probe it */
 	if (ssize < FMDP_MIN_FSIZE)
 		return 0;
-	size_t len = FMDP_READ_PAGE_SZ;
+	size_t len = FMDP_TYPEONLY(job) ? FMDP_TYPE_HEADER_SZ :
+		FMDP_READ_PAGE_SZ;
 	if ((off_t)len > ssize)
 		len = (size_t)ssize;
 	const uint8_t *p = stream->get(stream, 0, len);
-	if (p) {
-		/* Attempt to deduce file type from header magic */
-		/* XXX: Replace with some sort of a table to be iterated */
-		if (!memcmp(p, "fLaC", 4) &&
-		    fmdp_do_flac(stream) == 0)
-			goto end;
-		if (p[0] == 'I' && p[1] == 'D' && p[2] == '3' &&
-		    p[3] < 0xff && p[4] < 0xff &&
-		    p[6] < 0x80 && p[7] < 0x80 && p[8] < 0x80 && p[9] < 0x80 &&
-		    fmdp_do_mp3v2(stream) == 0)
-			goto end;
-		if (p[0] == 0 && p[1] == 0 &&
-		    p[4] == 'f' && p[5] == 't' && p[6] == 'y' && p[7] == 'p' &&
-		    fmdp_do_bmff(stream) == 0)
-			goto end;
-		if ((!memcmp(p, "MM\000\052", 4) ||
-		     !memcmp(p, "II\052\000", 4)) &&
-		    fmdp_do_tiff(stream) == 0)
-			goto end;
-		if (p[0] == 0xff && p[1] == 0xd8 &&
-		    p[2] == 0xff && p[3] == 0xe1 &&
-		    !memcmp(p + 6, "Exif", 4) &&
-		    fmdp_do_exif(stream) == 0)
-			goto end;
-		/* XXX: consider delaying this for a second stage */
-		if ((job->flags & fmdsf_archives) == fmdsf_archives &&
-		    fmdp_do_arch(stream) == 0)
-			goto end;
-	} else
+	if (!p) {
 		job->log(job, stream->file->path, fmdlt_oserr, "%s(%s): %s",
 			 "read", stream->file->path, strerror(errno));
-end:
+		return -1;
+	}
+	/* Deduce file type from header magic; unknown ones are fine */
+	(void)fmdp_magic_probe(stream, p, len);
 	return 0;
 }
@@ -3,17 +3,51 @@
 
 #  include "fmd.h"
 #  include <stdint.h>
+#  include <dirent.h>
+#  include <pthread.h>
 
 #  if !defined (FMDP_READ_PAGE_SZ)
 #    define FMDP_READ_PAGE_SZ 32768
 #  endif
+#  if !defined (FMDP_READ_MIN_SZ)
+/* Default minimum read size, see |job->read_min| */
+#    define FMDP_READ_MIN_SZ 4096
+#  endif
 #  if !defined (FMDP_CACHE_PAGES)
 #    define FMDP_CACHE_PAGES 4
 #  endif
+#  if !defined (FMDP_TYPE_HEADER_SZ)
+/* Size of header read with fmdsf_typeonly */
+#    define FMDP_TYPE_HEADER_SZ 4096
+#  endif
 #  if !defined (FMDP_MIN_FSIZE)
 /* Minimum file size to probe */
 #    define FMDP_MIN_FSIZE 256
 #  endif
+#  if !defined (FMDP_DIRENT_BUF_SZ)
+/* Size of getdents64(2) buffer, used with fmdsf_lazystat */
+#    define FMDP_DIRENT_BUF_SZ 262144
+#  endif
+#  if !defined (FMDP_ARENA_CHUNK_SZ)
+/* Size of chunks, arena is carved from */
+#    define FMDP_ARENA_CHUNK_SZ 262144
+#  endif
+#  if !defined (FMDP_SPAN_GAP)
+/* Ranges of |get_many()| this close are read together */
+#    define FMDP_SPAN_GAP 4096
+#  endif
+#  if !defined (FMDP_BUFFER_CAP)
+/* Default cap on buffer memory, see |job->buffer_cap| */
+#    define FMDP_BUFFER_CAP 67108864
+#  endif
+#  if !defined (FMDP_DIRECT_ALIGN)
+/* Alignment of buffers, offsets and lengths of O_DIRECT reads */
+#    define FMDP_DIRECT_ALIGN 4096
+#  endif
+#  if !defined (FMDP_PROBE_BATCH)
+/* Max # of directory entries probed by a worker in one go */
+#    define FMDP_PROBE_BATCH 32
+#  endif
 
 /* FMDP_X(res) macro is used to trace functions' failures */
 #  if defined (_DEBUG)
@@ -28,11 +62,242 @@
 #    define FMDP_XM(_res, _fmt, ...)
 #  endif
 
+/* Whether |_job| shall keep out of page cache, see fmdsf_cold */
+#  define FMDP_COLD(_job)						\
+	(((_job)->flags & (fmdsf_cold | fmdsf_direct)) != 0)
+
+/* Whether |_job| tells only file types, see fmdsf_typeonly */
+#  define FMDP_TYPEONLY(_job)						\
+	(((_job)->flags & fmdsf_typeonly) == fmdsf_typeonly)
+
+/* Whether |_job| hashes contents, see fmdsf_hash */
+#  define FMDP_HASH(_job)						\
+	(((_job)->flags & (fmdsf_metadata | fmdsf_hash)) ==		\
+	 (fmdsf_metadata | fmdsf_hash))
+/* Minimum file size to open: any contents are hashed */
+#  define FMDP_MIN_PROBED(_job)						\
+	(FMDP_HASH(_job) ? 1 : FMDP_MIN_FSIZE)
+
+/* Rounds |_sz| up to alignment, suitable for any object */
+#  define FMDP_ALIGN(_sz)						\
+	(((_sz) + 2 * sizeof (void*) - 1) & ~(2 * sizeof (void*) - 1))
+
+/* Memory, that is carved from large chunks and freed at once. Files
+ * carved from an arena are preceded by a pointer to the arena their
+ * metadata goes to; it is updated by whoever probes them */
+struct FmdArenaChunk;
+struct FmdArena {
+	struct FmdArenaChunk *chunks;
+};
+/* Returns zero-filled memory or 0 */
+void* fmdp_arena_alloc(struct FmdArena *arena, size_t sz);
+/* Moves all chunks of |from| to |to| */
+void fmdp_arena_merge(struct FmdArena *to, struct FmdArena *from);
+void fmdp_arena_fini(struct FmdArena *arena);
+#  define FMDP_FILE_ARENA(_file)					\
+	(*(struct FmdArena**)((char*)(_file) - FMDP_ALIGN(sizeof (struct FmdArena*))))
+
+/* Read buffers and cache pages of all streams of a scan, shared by
+ * workers. Buffers given back are kept for reuse, until the cap
+ * calls for memory of other sizes */
+struct FmdBufFree;
+struct FmdBufPool {
+	pthread_mutex_t lock;
+	pthread_cond_t freed;
+	size_t cap, used, peak;
+	struct FmdBufFree *free;
+};
+void fmdp_bufpool_init(struct FmdBufPool *pool, size_t cap);
+void fmdp_bufpool_fini(struct FmdBufPool *pool);
+/* Returns an uninitialized buffer of |size| octets or 0. A worker
+ * holding no buffers waits, while the cap is reached; others get 0
+ * then, unless they |must| have one, which goes over the cap */
+void* fmdp_buf_get(struct FmdScanJob *job, size_t size, int must);
+void fmdp_buf_put(struct FmdScanJob *job, void *buf, size_t size);
+/* Writes |buf| off the pool, without freeing it, as the kernel could
+ * yet read into it */
+void fmdp_buf_lose(struct FmdScanJob *job, void *buf, size_t size);
+
+/* Per-device scheduler, shared by workers: limits # of files probed
+ * at a time and throttles reads from each device */
+struct FmdDev;
+struct FmdSched {
+	pthread_mutex_t lock;
+	pthread_cond_t freed;
+	struct FmdDev *devs;
+	int throttled;	/* whether any device is */
+};
+void fmdp_sched_init(struct FmdSched *sched);
+void fmdp_sched_fini(struct FmdSched *sched);
+/* Takes a slot to probe a file on |dev|, waiting for one, unless
+ * the worker holds some already; returns -1 then */
+int fmdp_sched_begin(struct FmdScanJob *job, dev_t dev);
+void fmdp_sched_end(struct FmdScanJob *job, dev_t dev);
+/* Charges a read of |len| octets from |dev|; sleeps, while over its
+ * bandwidth or IOPS */
+void fmdp_sched_charge(struct FmdScanJob *job, dev_t dev, size_t len);
+/* Whether reads from |dev| are throttled */
+int fmdp_sched_throttled(struct FmdScanJob *job, dev_t dev);
+/* Whether |dev| is a rotational disk */
+int fmdp_sched_rotational(struct FmdScanJob *job, dev_t dev);
+/* Moves calling thread to idle I/O class, for fmdsf_idleio; returns
+ * its previous I/O priority for fmdp_ioprio_restore(), or -1 */
+int fmdp_ioprio_idle(const struct FmdScanJob *job);
+void fmdp_ioprio_restore(int prio);
+
+struct FmdRing;
+/* Per-thread private state of a scan job */
 struct FmdPriv {
 	char scratch[32768];
+
+	/* io_uring engine, set up on first use; |ring_err| keeps
+	 * errno, if it cannot be set up */
+	struct FmdRing *ring;
+	int ring_err;
+
+	/* getdents64(2) buffer, allocated on first use */
+	char *dents;
+
+	/* Arena to carve files and metadata from, or 0 */
+	struct FmdArena *arena;
+
+	/* Pool of buffers, shared by all workers, or 0 to malloc(3)
+	 * them; octets this worker holds */
+	struct FmdBufPool *bufs;
+	size_t buf_held;
+
+	/* Scheduler, shared by all workers, or 0; # of slots this
+	 * worker holds */
+	struct FmdSched *sched;
+	unsigned sched_held;
+
+	/* Links table of the scan, shared by all workers, or 0 */
+	struct FmdCache *links;
+
+	/* Filters of the scan, shared by all workers, or 0 */
+	struct FmdFilter *filter;
 };
+void fmdp_priv_init(struct FmdPriv *priv);
+void fmdp_priv_fini(struct FmdPriv *priv);
 
 struct FmdFile* fmdp_file_new(struct FmdScanJob *job, const char *path);
+/* Allocates zero-filled metadata element of |file|, with |extrasize|
+ * bytes more, or returns 0; freed by fmd_free(), or with the arena,
+ * if |file| is carved from one */
+struct FmdElem* fmdp_elem_new(struct FmdFile *file, size_t extrasize);
+void fmdp_elem_free(struct FmdFile *file, struct FmdElem *elem);
+
+/* Allocates |file| for |path| (relative to |dirfd|) and fills its
+ * |stat|; does not probe it */
+int fmdp_stat_file(struct FmdScanJob *job, int dirfd, const char *path,
+		   struct FmdFile **file);
+
+/* Entries of a single directory, in readdir order; not chained */
+struct FmdDirList {
+	struct FmdFile **entries;
+	size_t n, cap;
+};
+/* Whether recursive scan descends into |_file|; hidden directories
+ * are listed, but not descended */
+#  define FMDP_DESCEND(_file)					\
+	((_file)->filetype == fmdft_directory && (_file)->name[0] != '.')
+
+DIR* fmdp_open_dir(struct FmdScanJob *job, int parent_dirfd,
+		   const char *name, const char *path);
+int fmdp_dir_list_add(struct FmdDirList *list, struct FmdFile *file);
+/* Directory being scanned, and its parents up to the scan's root, to
+ * tell cycles from directories reached twice, see fmdsf_links */
+struct FmdDirVisit {
+	const struct FmdDirVisit *parent;
+	dev_t dev;
+	ino_t ino;
+};
+/* Opens and lists directory |name| (at |path|) into |list|; with
+ * fmdsf_prune, a directory with the same |st| as in its snapshot is
+ * listed from it instead, with |*dirp| left 0. |st| is 0, if not
+ * known yet. With fmdsf_links, |visit| gets its device and inode; it
+ * fails with ELOOP, if one of |visit| parents is the same directory,
+ * and lists nothing, if it has been scanned already */
+int fmdp_read_dir(struct FmdScanJob *job, int parent_dirfd,
+		  const char *name, const char *path, const struct stat *st,
+		  struct FmdDirVisit *visit, DIR **pdirp,
+		  struct FmdDirList *list);
+/* Filters, see fmd_filter.c */
+struct FmdFilter;
+/* Compiles filters of |job| into |*filter|, left 0, if it has none */
+int fmdp_filter_new(const struct FmdScanJob *job, struct FmdFilter **filter);
+void fmdp_filter_free(struct FmdFilter *filter);
+/* Returns 1 to skip entry |name| (at |path|) of d_type |type|, 0 to
+ * keep it, or -1, if that takes its stat to tell */
+int fmdp_filter_name(struct FmdScanJob *job, const char *path,
+		     const char *name, unsigned char type);
+/* Returns non-zero to skip stat'ed |file| */
+int fmdp_filter_file(struct FmdScanJob *job, const struct FmdFile *file);
+/* Whether files are filtered by size, and need stat for that */
+int fmdp_filter_sized(const struct FmdScanJob *job);
+/* Drops |list| entries at |from| and on, that fmdp_filter_file()
+ * would skip */
+void fmdp_filter_list(struct FmdScanJob *job, struct FmdDirList *list,
+		      size_t from);
+/* Stats all entries of |dirp| (at |path|) into |list|; with
+ * fmdsf_lazystat, only those to be probed or of unknown type. Returns
+ * 1, if some entries could not be listed or stat'ed */
+int fmdp_list_dir(struct FmdScanJob *job, DIR *dirp, const char *path,
+		  struct FmdDirList *list);
+/* Probes |n| non-directory |entries|, if metadata was requested */
+void fmdp_probe_entries(struct FmdScanJob *job, int dirfd,
+			struct FmdFile **entries, size_t n);
+/* Hands finished |file| (and its archive children) over to consume
+ * hook, or chains it at |*tail|, unless finish hook drops it. With
+ * |hold|, |file| is not freed, but 1 is returned if it should be,
+ * once the caller is done with it */
+int fmdp_emit(struct FmdScanJob *job, struct FmdFile ***tail,
+	      struct FmdFile *file, int hold);
+/* Frees |list| itself; also frees its |entries|, if non-zero */
+void fmdp_free_dir_list(struct FmdDirList *list, int entries);
+
+/* Recursive scan of |job->location| with |job->threads| workers */
+int fmdp_scan_parallel(struct FmdScanJob *job);
+
+/* io_uring engine; calls fail with ENOSYS, if it's unavailable */
+int fmdp_uring_ready(struct FmdScanJob *job);
+void fmdp_uring_free(struct FmdPriv *priv);
+/* Stats |list| entries at |*from| and on, that have no |st_mode|
+ * yet, dropping those failed; on error |*from| is where unstat'ed
+ * entries start */
+int fmdp_uring_stat(struct FmdScanJob *job, int dirfd,
+		    struct FmdDirList *list, size_t *from);
+#  if defined (STATX_TYPE)
+struct statx;
+/* statx(2) fields to ask for, considering fmdsf_lazystat */
+unsigned fmdp_statx_mask(const struct FmdScanJob *job);
+void fmdp_statx_to_stat(const struct statx *stx, struct stat *st);
+#  endif
+/* Opens, reads 1st page and probes |n| entries in batches */
+int fmdp_uring_probe(struct FmdScanJob *job, int dirfd,
+		     struct FmdFile **entries, size_t n);
+
+/* Whether element |_et| is requested, see |job->elements| */
+#  define FMDP_WANTS(_job, _et)						\
+	(!(_job)->elements || ((_job)->elements >> (_et) & 1) != 0)
+/* Whether any element of mask |_mask| is requested */
+#  define FMDP_WANTS_ANY(_job, _mask)					\
+	(!(_job)->elements || ((_job)->elements & (_mask)) != 0)
+/* Masks of elements of a kind, for FMDP_WANTS_ANY() */
+#  define FMDP_ELEMS_TEXT						\
+	((1UL << fmdet_title) | (1UL << fmdet_creator) |		\
+	 (1UL << fmdet_subject) | (1UL << fmdet_description) |		\
+	 (1UL << fmdet_artist) | (1UL << fmdet_performer) |		\
+	 (1UL << fmdet_album) | (1UL << fmdet_genre) |			\
+	 (1UL << fmdet_trackno) | (1UL << fmdet_date) |			\
+	 (1UL << fmdet_isrc) | (1UL << fmdet_other))
+#  define FMDP_ELEMS_EXIF						\
+	((1UL << fmdet_exposure_time) | (1UL << fmdet_fnumber) |	\
+	 (1UL << fmdet_iso_speed) | (1UL << fmdet_focal_length) |	\
+	 (1UL << fmdet_focal_length35))
+/* Returns 0, once |file| has each element requested, for parsers to
+ * stop; never, if all are */
+int fmdp_wants_more(const struct FmdScanJob *job, const struct FmdFile *file);
 
 /* Adds metadata to |file| */
 int fmdp_add_n(struct FmdFile *file,
@@ -74,6 +339,14 @@ int fmdp_match_token(const char *text, size_t len,
 int fmdp_match_token_exact(const char *text, size_t len,
 			   const struct FmdToken *tokens);
 
+/* Range of stream octets for |get_many()| */
+struct FmdRange {
+	off_t offs;
+	size_t len;
+	const uint8_t *data;	/* Set by |get_many()| */
+};
+
+/* Also the stream of parser plugins, see fmd_stream_get() */
 struct FmdStream {
 	/* Returns stream size in octets */
 	off_t (*size)(struct FmdStream *stream);
@@ -96,13 +369,87 @@ struct FmdStream {
 	/* Closes given |stream| */
 	void (*close)(struct FmdStream *stream);
 
+	/* Reads |n| |ranges| at once, coalescing nearby ones into few
+	 * reads, and points their |data| to it; returns 0, or -1 and
+	 * sets |errno|. Negative |offs| is relative to end-of-file.
+	 *
+	 * Unlike with |get()|, |len| is not limited, and all the
+	 * pointers are valid together, until next |get()|,
+	 * |get_many()| or |close()| method calls */
+	int (*get_many)(struct FmdStream *stream,
+			struct FmdRange *ranges, size_t n);
+
+	/* Optional; hints that |len| bytes at |offs| will be read soon,
+	 * so I/O for them may start in background */
+	void (*prefetch)(struct FmdStream *stream,
+			 off_t offs, size_t len);
+
 	struct FmdScanJob *job;
 	struct FmdFile *file;
 };
+/* Calls |get_many()|, if |stream| has it, or |get()| for a single
+ * range */
+int fmdp_stream_get_many(struct FmdStream *stream,
+			 struct FmdRange *ranges, size_t n);
+/* Buffer, coalesced ranges are read into */
+struct FmdSpanBuf {
+	uint8_t *data;
+	size_t size;
+};
+/* Implements |get_many()|: sorts |ranges|, joins nearby ones into
+ * spans, and |read()|s each span of |stream| into |buf|, in order of
+ * ascending offsets */
+int fmdp_get_spans(struct FmdStream *stream, struct FmdSpanBuf *buf,
+		   struct FmdRange *ranges, size_t n,
+		   int (*read)(struct FmdStream *stream, uint8_t *dst,
+			       off_t offs, size_t len));
+/* |read()| for fmdp_get_spans(), copying from |get()| page by page;
+ * works for forward-only streams, too */
+int fmdp_read_chunked(struct FmdStream *stream, uint8_t *dst,
+		      off_t offs, size_t len);
+
+/* Declares, that |len| bytes at |offs| (relative to end-of-file if
+ * negative) of |stream| will be needed; see |prefetch()| */
+void fmdp_stream_prefetch(struct FmdStream *stream, off_t offs, size_t len);
+/* Returns offset of |file| tail to fetch along with its header, per
+ * |job->tail_prefetch|, or -1 if none; the tail is up to 32 KiB, and
+ * could span cache pages */
+off_t fmdp_tail_offs(struct FmdScanJob *job, const struct FmdFile *file);
+
+/* Returns size of cache pages, per |job->cache_page_sz| */
+size_t fmdp_cache_page_sz(const struct FmdScanJob *job);
+/* Returns cached |stream|; or the same |stream|, if it needs no
+ * cache or cannot be cached */
 struct FmdStream* fmdp_cache_stream(struct FmdStream *stream);
 
+/* openat(2), adding O_NOATIME with fmdsf_cold, where permitted */
+int fmdp_openat(struct FmdScanJob *job,
+		int dirfd, const char *path, int flags);
 struct FmdStream* fmdp_open_file(struct FmdScanJob *job,
 				 int dirfd, struct FmdFile *file, int cached);
+/* Creates uncached stream over |file|, already opened as |fd| */
+struct FmdStream* fmdp_file_stream_create(struct FmdScanJob *job,
+					  struct FmdFile *file, int fd);
+/* Returns buffer of file |stream|, cached or not, to read |len|
+ * octets at |offs| into, and makes it serve those; call again with
+ * actual len after a short read, or with 0 if read failed. Returns
+ * 0 if no buffer can be allocated. Uncached stream holds just one
+ * such range; for cached one, range should not cross a page */
+uint8_t* fmdp_stream_fill(struct FmdStream *stream,
+			  off_t offs, size_t len);
+/* Counts a read of |len| octets, done for file |stream| elsewhere */
+void fmdp_stream_count_read(struct FmdStream *stream, size_t len);
+/* Closes file |stream|, whose buffers reads could still be under way
+ * into, keeping those; see fmdp_buf_lose() */
+void fmdp_stream_abandon(struct FmdStream *stream);
+
+/* Whether |file| is large enough to be mapped, see |job->mmap_min| */
+int fmdp_mmap_worth(struct FmdScanJob *job, const struct FmdFile *file);
+/* Creates stream over |file|, opened as |fd| and mapped into memory;
+ * |get()| returns pointers right into the mapping */
+struct FmdStream* fmdp_mmap_stream_create(struct FmdScanJob *job,
+					  struct FmdFile *file, int fd);
+int fmdp_stream_mapped(const struct FmdStream *stream);
 
 struct FmdStream* fmdp_ranged_stream_create(struct FmdStream *stream,
 					    off_t start_offs, off_t len);
@@ -114,7 +461,37 @@ long fmdp_get_bits_be(const uint8_t *p, size_t offs, size_t len);
 long fmdp_get_bits_le(const uint8_t *p, size_t offs, size_t len);
 
 int fmdp_probe_file(struct FmdScanJob *job, int dirfd, struct FmdFile *info);
+/* Returns -1, if |stream| could not be read */
 int fmdp_probe_stream(struct FmdStream *stream);
+/* Probes and closes uncached |stream|, opened by the caller */
+int fmdp_probe_opened(struct FmdScanJob *job, struct FmdStream *stream);
+/* Hashes contents of |stream| into fmdet_digest, see fmdsf_hash */
+int fmdp_hash_stream(struct FmdStream *stream);
+
+/* Fills |file| from |job->cache|, if it is there; returns 0 then */
+int fmdp_probe_cache_fill(struct FmdScanJob *job, struct FmdFile *file);
+/* Records |file| just probed into |job->cache| */
+void fmdp_probe_cache_store(struct FmdScanJob *job, struct FmdFile *file);
+
+/* Links table, see fmd_cache.c */
+struct FmdCache* fmdp_links_new(void);
+void fmdp_links_free(struct FmdCache *links);
+/* Fills |file| of more links from another one, probed already, and
+ * marks it with fmdff_link; returns 0 then. Otherwise returns 1, if
+ * it is for the caller to probe, or -1, while another is probed */
+int fmdp_links_claim(struct FmdScanJob *job, struct FmdFile *file);
+/* Records probed |file| of more links for others to be filled */
+void fmdp_links_store(struct FmdScanJob *job, struct FmdFile *file);
+/* Records directory of |st| as scanned; returns 1, if it has been
+ * already, as another symbolic link leads to it */
+int fmdp_links_visit(struct FmdScanJob *job, const struct stat *st);
+/* Adds entries of directory |path| with |st| from its snapshot in
+ * |job->cache| to |list|, if it did not change; returns 0 then */
+int fmdp_dir_cache_fill(struct FmdScanJob *job, const struct stat *st,
+			const char *path, struct FmdDirList *list);
+/* Records |list| entries at |from| and on as directory's snapshot */
+void fmdp_dir_cache_store(struct FmdScanJob *job, const struct stat *st,
+			  const struct FmdDirList *list, size_t from);
 
 /* Reads 1st page or whole file, whatever is less, defines |len|, |p|
  * and |endp|; returns -1 on failure to do so */
@@ -154,6 +531,20 @@ struct FmdFrameIterator {
 	const uint8_t *data;	/* 0, unless read() called */
 };
 
+/* Parser and its signature, see fmd_magic.c; |check|, if set, tests
+ * the header further, once the signature matches, and |type|, if set,
+ * tells type of |file| from the header with fmdsf_typeonly, instead
+ * of |parser.filetype| and |mimetype| */
+struct FmdMagic {
+	struct FmdParser parser;
+	int (*check)(const uint8_t *p, size_t len);
+	void (*type)(struct FmdFile *file, const uint8_t *p, size_t len);
+};
+/* Tries parsers, whose signatures match header |p| of |len| octets,
+ * on |stream|; returns -1, if none of them succeeds */
+int fmdp_magic_probe(struct FmdStream *stream, const uint8_t *p,
+		     size_t len);
+
 int fmdp_do_flac(struct FmdStream *stream);
 int fmdp_do_mp3v2(struct FmdStream *stream);
 int fmdp_do_bmff(struct FmdStream *stream);
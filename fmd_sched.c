@@ -0,0 +1,319 @@
+#if defined (__linux__) && !defined (_GNU_SOURCE)
+#  define _GNU_SOURCE		/* syscall(2) */
+#endif
+#include "fmd_priv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sys/types.h>
+#if defined (__linux__)
+#  include <sys/syscall.h>
+#  include <sys/sysmacros.h>
+#endif
+#include <unistd.h>
+
+/* Per-device scheduling.
+ *
+ * Files of a device are probed |limits.depth| at a time; a worker
+ * waits for a slot only while it holds none, so that those holding
+ * slots go on and give them back, and its queued tasks are stolen by
+ * idle workers meanwhile. Reads draw from two token buckets, of
+ * octets and of reads, refilled at |bandwidth| and |iops| per second
+ * up to a second worth. A read is charged once done, and the reader
+ * sleeps its debt off, before it reads again */
+
+struct FmdDev {
+	struct FmdDev *next;
+	dev_t dev;
+	struct FmdDevLimits limits;
+	int rotational;
+	unsigned active;	/* # of files being probed */
+	/* Tokens in buckets, as of |stamp| */
+	double octets, reads, stamp;
+};
+
+
+static double
+fmdp_sched_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+static int
+fmdp_dev_rotational(dev_t dev)
+{
+#if defined (__linux__)
+	/* Partitions have |queue| of their disk one level up */
+	static const char *const fmts[] = {
+		"/sys/dev/block/%u:%u/queue/rotational",
+		"/sys/dev/block/%u:%u/../queue/rotational"
+	};
+	size_t i;
+	for (i = 0; i < sizeof fmts / sizeof *fmts; ++i) {
+		char path[64];
+		snprintf(path, sizeof path, fmts[i], major(dev), minor(dev));
+		FILE *f = fopen(path, "re");
+		if (!f)
+			continue;
+		const int c = fgetc(f);
+		fclose(f);
+		return c == '1';
+	}
+#else
+	(void)dev;
+#endif
+	return 0;
+}
+
+
+void
+fmdp_sched_init(struct FmdSched *sched)
+{
+	assert(sched);
+	pthread_mutex_init(&sched->lock, 0);
+	pthread_cond_init(&sched->freed, 0);
+	sched->devs = 0;
+	sched->throttled = 0;
+}
+
+
+void
+fmdp_sched_fini(struct FmdSched *sched)
+{
+	assert(sched);
+	struct FmdDev *it = sched->devs;
+	while (it) {
+		struct FmdDev *next = it->next;
+		free(it);
+		it = next;
+	}
+	sched->devs = 0;
+	pthread_cond_destroy(&sched->freed);
+	pthread_mutex_destroy(&sched->lock);
+}
+
+
+static struct FmdDev*
+fmdp_sched_find(struct FmdSched *sched, dev_t dev)
+{
+	struct FmdDev *it = sched->devs;
+	while (it && it->dev != dev)
+		it = it->next;
+	return it;
+}
+
+/* Returns |dev|, adding it with its limits, if new, or 0 if out of
+ * memory; called with |sched->lock| held, so hook is called once */
+static struct FmdDev*
+fmdp_sched_dev(struct FmdScanJob *job,
+	       struct FmdSched *sched, dev_t dev)
+{
+	struct FmdDev *d = fmdp_sched_find(sched, dev);
+	if (d)
+		return d;
+
+	const int rotational = fmdp_dev_rotational(dev);
+	struct FmdDevLimits limits = job->dev_limits;
+	if (job->devlimits)
+		job->devlimits(job, dev, &limits);
+	if (!limits.depth)
+		limits.depth = UINT_MAX;
+
+	if (!(d = (struct FmdDev*)calloc(1, sizeof *d)))
+		return 0;
+	d->dev = dev;
+	d->limits = limits;
+	d->rotational = rotational;
+	d->octets = (double)limits.bandwidth;
+	d->reads = limits.iops;
+	d->stamp = fmdp_sched_now();
+	d->next = sched->devs;
+	sched->devs = d;
+	if (limits.bandwidth || limits.iops)
+		sched->throttled = 1;
+	return d;
+}
+
+
+int
+fmdp_sched_begin(struct FmdScanJob *job,
+		 dev_t dev)
+{
+	assert(job);
+
+	struct FmdSched *sched = job->priv ? job->priv->sched : 0;
+	if (!sched)
+		return 0;
+
+	pthread_mutex_lock(&sched->lock);
+	struct FmdDev *d = fmdp_sched_dev(job, sched, dev);
+	while (d && d->active >= d->limits.depth) {
+		if (job->priv->sched_held) {
+			pthread_mutex_unlock(&sched->lock);
+			errno = EAGAIN;
+			return -1;
+		}
+		pthread_cond_wait(&sched->freed, &sched->lock);
+	}
+	if (d)
+		++d->active;
+	pthread_mutex_unlock(&sched->lock);
+	++job->priv->sched_held;
+	return 0;
+}
+
+
+void
+fmdp_sched_end(struct FmdScanJob *job,
+	       dev_t dev)
+{
+	assert(job);
+
+	struct FmdSched *sched = job->priv ? job->priv->sched : 0;
+	if (!sched)
+		return;
+
+	pthread_mutex_lock(&sched->lock);
+	struct FmdDev *d = fmdp_sched_find(sched, dev);
+	if (d && d->active)
+		--d->active;
+	pthread_cond_broadcast(&sched->freed);
+	pthread_mutex_unlock(&sched->lock);
+	assert(job->priv->sched_held);
+	--job->priv->sched_held;
+}
+
+
+void
+fmdp_sched_charge(struct FmdScanJob *job,
+		  dev_t dev, size_t len)
+{
+	assert(job);
+
+	struct FmdSched *sched = job->priv ? job->priv->sched : 0;
+	if (!sched)
+		return;
+
+	double wait = 0;
+	pthread_mutex_lock(&sched->lock);
+	struct FmdDev *d = sched->throttled ? fmdp_sched_find(sched, dev) : 0;
+	if (d && (d->limits.bandwidth || d->limits.iops)) {
+		const double now = fmdp_sched_now();
+		const double dt = now - d->stamp;
+		d->stamp = now;
+		if (d->limits.bandwidth) {
+			const double rate = (double)d->limits.bandwidth;
+			d->octets += dt * rate;
+			if (d->octets > rate)
+				d->octets = rate;
+			d->octets -= (double)len;
+			if (d->octets < 0)
+				wait = -d->octets / rate;
+		}
+		if (d->limits.iops) {
+			const double rate = d->limits.iops;
+			d->reads += dt * rate;
+			if (d->reads > rate)
+				d->reads = rate;
+			d->reads -= 1;
+			if (d->reads < 0 && -d->reads / rate > wait)
+				wait = -d->reads / rate;
+		}
+	}
+	pthread_mutex_unlock(&sched->lock);
+
+	if (wait > 0) {
+		struct timespec ts;
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+	}
+}
+
+
+int
+fmdp_sched_throttled(struct FmdScanJob *job,
+		     dev_t dev)
+{
+	assert(job);
+
+	struct FmdSched *sched = job->priv ? job->priv->sched : 0;
+	if (!sched)
+		return 0;
+
+	pthread_mutex_lock(&sched->lock);
+	const struct FmdDev *d = sched->throttled ?
+		fmdp_sched_find(sched, dev) : 0;
+	const int res = d && (d->limits.bandwidth || d->limits.iops);
+	pthread_mutex_unlock(&sched->lock);
+	return res;
+}
+
+
+int
+fmdp_sched_rotational(struct FmdScanJob *job,
+		      dev_t dev)
+{
+	assert(job);
+
+	struct FmdSched *sched = job->priv ? job->priv->sched : 0;
+	if (!sched)
+		return 0;
+
+	pthread_mutex_lock(&sched->lock);
+	const struct FmdDev *d = fmdp_sched_dev(job, sched, dev);
+	const int res = d && d->rotational;
+	pthread_mutex_unlock(&sched->lock);
+	return res;
+}
+
+
+#if defined (__linux__) && defined (SYS_ioprio_set)
+/* From linux/ioprio.h */
+#  define FMDP_IOPRIO_WHO_PROCESS 1
+#  define FMDP_IOPRIO_CLASS_IDLE 3
+#  define FMDP_IOPRIO_CLASS_SHIFT 13
+#endif
+
+int
+fmdp_ioprio_idle(const struct FmdScanJob *job)
+{
+	assert(job);
+
+	if ((job->flags & fmdsf_idleio) != fmdsf_idleio)
+		return -1;
+#if defined (FMDP_IOPRIO_WHO_PROCESS)
+	/* Of calling thread, which is what 0 stands for */
+	const long prio = syscall(SYS_ioprio_get, FMDP_IOPRIO_WHO_PROCESS, 0);
+	if (prio == -1 ||
+	    syscall(SYS_ioprio_set, FMDP_IOPRIO_WHO_PROCESS, 0,
+		    FMDP_IOPRIO_CLASS_IDLE << FMDP_IOPRIO_CLASS_SHIFT) == -1) {
+		FMDP_X(-1);
+		return -1;
+	}
+	return (int)prio;
+#else
+	return -1;
+#endif
+}
+
+
+void
+fmdp_ioprio_restore(int prio)
+{
+#if defined (FMDP_IOPRIO_WHO_PROCESS)
+	if (prio != -1)
+		(void)syscall(SYS_ioprio_set, FMDP_IOPRIO_WHO_PROCESS, 0, prio);
+#else
+	(void)prio;
+#endif
+}
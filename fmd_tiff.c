@@ -114,6 +114,9 @@ struct FmdpTiffIfdEntry {
 
 		uint32_t offs;
 	};	
+
+	/* Referenced value, if fetched by fmdp_tiff_fetch_refs() */
+	const uint8_t *data;
 };
 
 struct FmdpTiffScanContext {
@@ -178,6 +181,7 @@ fmdp_tiff_parse_ifd_entry(struct FmdpTiffScanContext *ctx,
 		return 0;
 	}
 	entry->type = type;
+	entry->data = 0;
 	entry->count = (uint32_t)ctx->bits(p, 32, 32);
 	if (!entry->count) {
 		job->log(job, stream->file->path, fmdlt_format,
@@ -238,17 +242,45 @@ fmdp_tiff_do_baseline_ifd(struct FmdpTiffScanContext *ctx,
 	const uint32_t v = (entry->type == fmdp_tet_short ?
 			    entry->v_short[0] : entry->v_long);
 
+	/* Entries not requested are left unset, so never read */
+	const struct FmdScanJob *job = ctx->stream->job;
 	switch (entry->tag) {
-	case fmdp_ttt_width: ctx->width = v; break;
-	case fmdp_ttt_height: ctx->height = v; break;
+	case fmdp_ttt_width:
+		if (FMDP_WANTS(job, fmdet_frame_width))
+			ctx->width = v;
+		break;
+	case fmdp_ttt_height:
+		if (FMDP_WANTS(job, fmdet_frame_height))
+			ctx->height = v;
+		break;
 	case fmdp_ttt_bits_per_sample:
-		ctx->bits_per_sample = *entry; break;
-	case fmdp_ttt_docname: ctx->docname = *entry; break;
-	case fmdp_ttt_description: ctx->description = *entry; break;
-	case fmdp_ttt_devicevendor: ctx->devicevendor = *entry; break;
-	case fmdp_ttt_devicemodel: ctx->devicemodel = *entry; break;
-	case fmdp_ttt_software: ctx->software = *entry; break;
-	case fmdp_ttt_artist: ctx->artist = *entry; break;
+		if (FMDP_WANTS(job, fmdet_bits_per_sample))
+			ctx->bits_per_sample = *entry;
+		break;
+	case fmdp_ttt_docname:
+		if (FMDP_WANTS(job, fmdet_title))
+			ctx->docname = *entry;
+		break;
+	case fmdp_ttt_description:
+		if (FMDP_WANTS(job, fmdet_description))
+			ctx->description = *entry;
+		break;
+	case fmdp_ttt_devicevendor:
+		if (FMDP_WANTS(job, fmdet_creator))
+			ctx->devicevendor = *entry;
+		break;
+	case fmdp_ttt_devicemodel:
+		if (FMDP_WANTS(job, fmdet_creator))
+			ctx->devicemodel = *entry;
+		break;
+	case fmdp_ttt_software:
+		if (FMDP_WANTS(job, fmdet_creator))
+			ctx->software = *entry;
+		break;
+	case fmdp_ttt_artist:
+		if (FMDP_WANTS(job, fmdet_artist))
+			ctx->artist = *entry;
+		break;
 	case fmdp_ttt_samples_per_pixel:
 		ctx->samples_per_pixel = (uint16_t)v; break;
 	case fmdp_ttt_exififd: ctx->exififd_offs = v; break;
@@ -267,12 +299,28 @@ fmdp_tiff_do_exififd(struct FmdpTiffScanContext *ctx,
 	assert(entry);
 	assert(!ifd_index);
 
+	const struct FmdScanJob *job = ctx->stream->job;
 	switch (entry->tag) {
-	case fmdp_ttt_exif_exposure_time: ctx->exposure_time = *entry; break;
-	case fmdp_ttt_exif_fnumber: ctx->fnumber = *entry; break;
-	case fmdp_ttt_exif_iso_speed: ctx->iso_speed = *entry; break;
-	case fmdp_ttt_exif_focal_length: ctx->focal_length = *entry; break;
-	case fmdp_ttt_exif_focal_length35: ctx->focal_length35 = *entry; break;
+	case fmdp_ttt_exif_exposure_time:
+		if (FMDP_WANTS(job, fmdet_exposure_time))
+			ctx->exposure_time = *entry;
+		break;
+	case fmdp_ttt_exif_fnumber:
+		if (FMDP_WANTS(job, fmdet_fnumber))
+			ctx->fnumber = *entry;
+		break;
+	case fmdp_ttt_exif_iso_speed:
+		if (FMDP_WANTS(job, fmdet_iso_speed))
+			ctx->iso_speed = *entry;
+		break;
+	case fmdp_ttt_exif_focal_length:
+		if (FMDP_WANTS(job, fmdet_focal_length))
+			ctx->focal_length = *entry;
+		break;
+	case fmdp_ttt_exif_focal_length35:
+		if (FMDP_WANTS(job, fmdet_focal_length35))
+			ctx->focal_length35 = *entry;
+		break;
 	case fmdp_ttt_exif_exposure_prog: ctx->exposure_program = *entry; break;
 	}
 	return 0;
@@ -457,7 +505,8 @@ fmdp_tiff_add_frac(struct FmdpTiffScanContext *ctx,
 
 	/* References a pair of longs: numerator and denominator */
 	struct FmdStream *stream = ctx->stream;
-	const uint8_t *p = stream->get(stream, entry->v_long, 8);
+	const uint8_t *p = entry->data ? entry->data :
+		stream->get(stream, entry->v_long, 8);
 	if (!p)
 		return -1;
 	if (as_rational) {
@@ -485,7 +534,8 @@ fmdp_tiff_add_text(struct FmdpTiffScanContext *ctx,
 		return fmdp_add_text(stream->file, elemtype,
 				     entry->v_char, entry->count - 1);
 	/* A referenced string */
-	const uint8_t *p = stream->get(stream, entry->v_long, entry->count);
+	const uint8_t *p = entry->data ? entry->data :
+		stream->get(stream, entry->v_long, entry->count);
 	if (!p)
 		return -1;
 	return fmdp_add_text(stream->file, elemtype,
@@ -514,9 +564,9 @@ fmdp_tiff_add_bps(struct FmdpTiffScanContext *ctx)
 		for (i = 0; i < n; ++i)
 			v += ctx->bits_per_sample.v_short[i];
 	} else {		/* Referenced */
-		const uint8_t *p = stream->get(stream,
-					       ctx->bits_per_sample.offs,
-					       2 * n);
+		const uint8_t *p = ctx->bits_per_sample.data ?
+			ctx->bits_per_sample.data :
+			stream->get(stream, ctx->bits_per_sample.offs, 2 * n);
 		if (!p)
 			return -1;
 		for (i = 0; i < n; ++i)
@@ -526,6 +576,38 @@ fmdp_tiff_add_bps(struct FmdpTiffScanContext *ctx)
 }
 
 
+/* Fetches values of all referenced entries at once, instead of one
+ * read each; on failure they are left to be read one by one */
+static void
+fmdp_tiff_fetch_refs(struct FmdpTiffScanContext *ctx)
+{
+	assert(ctx);
+
+	struct FmdpTiffIfdEntry *refs[] = {
+		&ctx->bits_per_sample, &ctx->docname, &ctx->description,
+		&ctx->devicevendor, &ctx->devicemodel, &ctx->software,
+		&ctx->artist, &ctx->exposure_time, &ctx->fnumber,
+		&ctx->focal_length
+	};
+	const size_t nrefs = sizeof (refs) / sizeof (refs[0]);
+	struct FmdRange ranges[sizeof (refs) / sizeof (refs[0])];
+	size_t i, n = 0;
+	for (i = 0; i < nrefs; ++i) {
+		if (!refs[i]->tag || !refs[i]->extref)
+			continue;
+		ranges[n].offs = refs[i]->offs;
+		ranges[n].len = refs[i]->count *
+			(size_t)fmdp_tiff_data_sz[refs[i]->type];
+		++n;
+	}
+	if (n < 2 || fmdp_stream_get_many(ctx->stream, ranges, n) != 0)
+		return;
+	for (i = n = 0; i < nrefs; ++i)
+		if (refs[i]->tag && refs[i]->extref)
+			refs[i]->data = ranges[n++].data;
+}
+
+
 int
 fmdp_do_tiff(struct FmdStream *stream)
 {
@@ -560,7 +642,8 @@ fmdp_do_tiff(struct FmdStream *stream)
 	stream->file->filetype = fmdft_raster;
 	stream->file->mimetype = "image/tiff";
 
-	if (res == 0 && ctx.exififd_offs)
+	if (res == 0 && ctx.exififd_offs &&
+	    FMDP_WANTS_ANY(stream->job, FMDP_ELEMS_EXIF))
 		res = fmdp_tiff_do_ifd(&ctx, fmdp_ttt_exififd, 0,
 				       ctx.exififd_offs,
 				       &fmdp_tiff_do_exififd);
@@ -569,11 +652,15 @@ fmdp_do_tiff(struct FmdStream *stream)
 				       ctx.gpsifd_offs,
 				       &fmdp_tiff_do_gpsifd);
 
+	if (res == 0)
+		fmdp_tiff_fetch_refs(&ctx);
+
 	if (res == 0 && ctx.width)
 		res = fmdp_add_n(file, fmdet_frame_width, ctx.width);
 	if (res == 0 && ctx.height)
 		res = fmdp_add_n(file, fmdet_frame_height, ctx.height);
-	if (res == 0 && ctx.samples_per_pixel)
+	if (res == 0 && ctx.samples_per_pixel &&
+	    FMDP_WANTS(stream->job, fmdet_num_channels))
 		res = fmdp_add_n(file, fmdet_num_channels,
 				 ctx.samples_per_pixel);
 	if (res == 0 && ctx.bits_per_sample.tag)
@@ -0,0 +1,649 @@
+#if defined (__linux__) && !defined (_GNU_SOURCE)
+#  define _GNU_SOURCE		/* struct statx */
+#endif
+#include "fmd_priv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* io_uring(7) engine: batches opens, stats and first-page reads of
+ * up to |job->uring_depth| directory entries at once, so that every
+ * batch costs a couple of I/O waits instead of a few per entry.
+ *
+ * Raw system calls are used, so no liburing is needed. Elsewhere, or
+ * when the kernel refuses to set up a ring, callers fall back to the
+ * synchronous path */
+
+#if defined (__linux__)
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <sys/syscall.h>
+#  include <sys/uio.h>
+
+#  if !defined (FMDP_URING_MAX_DEPTH)
+#    define FMDP_URING_MAX_DEPTH 4096
+#  endif
+#  if !defined (FMDP_URING_RETRIES)
+/* Times to retry submitting, that the kernel refuses for lack of
+ * resources, while nothing is in flight */
+#    define FMDP_URING_RETRIES 16
+#  endif
+
+struct FmdRing {
+	int fd;
+	unsigned depth;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_sz, cq_sz, sqes_sz;
+	unsigned queued;	/* SQEs filled, but not submitted */
+	unsigned inflight;	/* submitted, but not reaped, after failure */
+};
+
+
+static void
+fmdp_ring_free(struct FmdRing *ring)
+{
+	if (!ring)
+		return;
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_sz);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_sz);
+	if (ring->fd != -1)
+		close(ring->fd);
+	free(ring);
+}
+
+static struct FmdRing*
+fmdp_ring_new(unsigned depth)
+{
+	struct FmdRing *ring = (struct FmdRing*)calloc(1, sizeof *ring);
+	if (!ring)
+		return 0;
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof p);
+	ring->fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+	if (ring->fd == -1) {
+		free(ring);
+		return 0;
+	}
+	ring->depth = p.sq_entries;
+
+	ring->sq_sz = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	ring->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_sz > ring->sq_sz)
+			ring->sq_sz = ring->cq_sz;
+		ring->cq_sz = ring->sq_sz;
+	}
+	ring->sq_ptr = mmap(0, ring->sq_sz, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = 0;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(0, ring->cq_sz, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = 0;
+			goto fail;
+		}
+	}
+	ring->sqes_sz = p.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe*)
+		mmap(0, ring->sqes_sz, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = 0;
+		goto fail;
+	}
+
+	char *sq = (char*)ring->sq_ptr, *cq = (char*)ring->cq_ptr;
+	ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+	ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return ring;
+
+fail:
+	fmdp_ring_free(ring);
+	return 0;
+}
+
+
+/* Returns a zeroed SQE to fill; |udata| identifies its CQE */
+static struct io_uring_sqe*
+fmdp_ring_sqe(struct FmdRing *ring,
+	      unsigned udata)
+{
+	assert(ring->queued < ring->depth);
+	const unsigned tail = *ring->sq_tail + ring->queued;
+	const unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->user_data = udata;
+	ring->sq_array[idx] = idx;
+	++ring->queued;
+	return sqe;
+}
+
+/* Stores results of completed SQEs into |res|[udata]; returns # of
+ * them */
+static unsigned
+fmdp_ring_reap(struct FmdRing *ring,
+	       int *res)
+{
+	unsigned head = *ring->cq_head, n = 0;
+	const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head, ++n) {
+		const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		res[cqe->user_data] = cqe->res;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* Submits queued SQEs and waits for all of them to complete, storing
+ * result of each into |res|[udata], or -ECANCELED, if it did not
+ * complete. Returns -1, if cannot submit them all; those submitted are
+ * still waited for, and |ring->inflight| is left with those, that
+ * could not be */
+static int
+fmdp_ring_run(struct FmdRing *ring,
+	      int *res)
+{
+	const unsigned n = ring->queued;
+	if (!n)
+		return 0;
+	const unsigned first = *ring->sq_tail;
+	unsigned i;
+	for (i = 0; i < n; ++i)
+		res[ring->sqes[(first + i) & *ring->sq_mask].user_data] =
+			-ECANCELED;
+	__atomic_store_n(ring->sq_tail, first + n, __ATOMIC_RELEASE);
+	ring->queued = 0;
+
+	unsigned done = 0, submitted = 0, tries = 0;
+	int err = 0, backoff = 0;
+	while (done < n && !(err && done == submitted)) {
+		/* After a failure, or while the kernel is short of
+		 * resources, only wait for what is in flight */
+		const unsigned to_submit = err || backoff ? 0 : n - submitted;
+		const unsigned to_wait = backoff ? 1 :
+			(err ? submitted : n) - done;
+		long rv = syscall(__NR_io_uring_enter, ring->fd,
+				  to_submit, to_wait,
+				  IORING_ENTER_GETEVENTS, (void*)0, 0);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EBUSY) &&
+			    (submitted > done ||
+			     (!err && ++tries < FMDP_URING_RETRIES))) {
+				done += fmdp_ring_reap(ring, res);
+				backoff = submitted > done;
+				continue;
+			}
+			if (!to_submit) {
+				/* Cannot even wait for them */
+				if (!err)
+					err = errno;
+				break;
+			}
+			err = errno;
+			continue;
+		}
+		submitted += (unsigned)rv;
+		backoff = 0;
+		tries = 0;
+		done += fmdp_ring_reap(ring, res);
+	}
+	ring->inflight = submitted - done;
+	return err ? (errno = err), -1 : 0;
+}
+
+
+void
+fmdp_uring_free(struct FmdPriv *priv)
+{
+	assert(priv);
+	fmdp_ring_free(priv->ring);
+	priv->ring = 0;
+}
+
+/* Drops the ring, after it failed to submit; returns 1, if some of its
+ * requests are still in flight, and it is left open, as the kernel
+ * could yet write into their buffers, which are not to be reused */
+static int
+fmdp_uring_broken(struct FmdScanJob *job)
+{
+	struct FmdPriv *priv = job->priv;
+	priv->ring_err = errno;
+	const int lost = priv->ring->inflight != 0;
+	if (!lost)
+		fmdp_ring_free(priv->ring);
+	priv->ring = 0;
+	return lost;
+}
+
+static struct FmdRing*
+fmdp_uring_get(struct FmdScanJob *job)
+{
+	struct FmdPriv *priv = job->priv;
+	if (priv->ring || priv->ring_err)
+		return priv->ring;
+
+	unsigned depth = job->uring_depth;
+	if (depth > FMDP_URING_MAX_DEPTH)
+		depth = FMDP_URING_MAX_DEPTH;
+	priv->ring = fmdp_ring_new(depth);
+	if (!priv->ring) {
+		priv->ring_err = errno;
+		job->log(job, job->location, fmdlt_trace, "%s(%u): %s",
+			 "io_uring_setup", depth, strerror(errno));
+	}
+	return priv->ring;
+}
+
+int
+fmdp_uring_ready(struct FmdScanJob *job)
+{
+	assert(job);
+	return job->uring_depth && fmdp_uring_get(job) != 0;
+}
+
+
+int
+fmdp_uring_stat(struct FmdScanJob *job,
+		int dirfd,
+		struct FmdDirList *list,
+		size_t *pfrom)
+{
+	assert(job);
+	assert(list);
+	assert(pfrom);
+
+	struct FmdRing *ring = fmdp_uring_get(job);
+	if (!ring)
+		return (errno = ENOSYS), -1;
+
+	struct statx *stx = (struct statx*)malloc(ring->depth * sizeof *stx);
+	int *res = (int*)malloc(ring->depth * sizeof *res);
+	if (!stx || !res) {
+		free(stx);
+		free(res);
+		return (errno = ENOMEM), -1;
+	}
+
+	/* Stat entries without |st_mode| in batches, then drop those
+	 * that failed */
+	const unsigned mask = fmdp_statx_mask(job);
+	size_t i = *pfrom, k = *pfrom, j, first, nb;
+	while (i < list->n) {
+		for (first = i, nb = 0; i < list->n && nb < ring->depth; ++i) {
+			struct FmdFile *file = list->entries[i];
+			if (file->stat.st_mode != 0)
+				continue;
+			struct io_uring_sqe *sqe = fmdp_ring_sqe(ring, nb);
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = dirfd;
+			sqe->addr = (unsigned long)file->name;
+			sqe->len = mask;
+			sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+			sqe->off = (unsigned long)&stx[nb];
+			++nb;
+		}
+		int err = 0, lost = 0;
+		if (nb && fmdp_ring_run(ring, res) != 0) {
+			err = errno;
+			lost = fmdp_uring_broken(job);
+		}
+		job->n_stats += nb;
+		const size_t kfirst = k;
+		for (j = first, nb = 0; j < i; ++j) {
+			struct FmdFile *file = list->entries[j];
+			if (file->stat.st_mode != 0 ||
+			    (err && res[nb] == -ECANCELED)) {
+				/* Not stat'ed ones are left to the caller */
+				list->entries[k++] = file;
+				nb += file->stat.st_mode == 0;
+				continue;
+			}
+			if (res[nb] < 0) {
+				job->log(job, file->path, fmdlt_oserr,
+					 "%s(%s): %s", "statx", file->path,
+					 strerror(-res[nb]));
+				fmd_free(file);
+			} else {
+				fmdp_statx_to_stat(&stx[nb], &file->stat);
+				list->entries[k++] = file;
+			}
+			++nb;
+		}
+		if (err) {
+			/* Keep remaining entries unstat'ed */
+			*pfrom = kfirst;
+			for (j = i; j < list->n; ++j)
+				list->entries[k++] = list->entries[j];
+			list->n = k;
+			if (!lost)	/* else kernel could write into it */
+				free(stx);
+			free(res);
+			return (errno = err), -1;
+		}
+	}
+	list->n = *pfrom = k;
+	free(stx);
+	free(res);
+	return 0;
+}
+
+
+int
+fmdp_uring_probe(struct FmdScanJob *job,
+		 int dirfd,
+		 struct FmdFile **entries,
+		 size_t n)
+{
+	assert(job);
+	assert(entries || !n);
+
+	struct FmdRing *ring = fmdp_uring_get(job);
+	if (!ring)
+		return (errno = ENOSYS), -1;
+
+	const unsigned depth = ring->depth;
+	/* Leave room for tail reads, see |job->tail_prefetch| */
+	const unsigned batch = job->tail_prefetch && depth > 1 ?
+		depth / 2 : depth;
+	struct FmdFile **files = (struct FmdFile**)malloc(depth * sizeof *files);
+	struct FmdStream **streams =
+		(struct FmdStream**)calloc(depth, sizeof *streams);
+	int *res = (int*)malloc(depth * sizeof *res);
+	off_t *tails = (off_t*)malloc(depth * sizeof *tails);
+	/* Cache pages a tail spans, read into with a single request */
+	const size_t maxv = (FMDP_READ_PAGE_SZ - 1) /
+		fmdp_cache_page_sz(job) + 2;
+	struct iovec *tiovs = job->tail_prefetch ?
+		(struct iovec*)malloc(batch * maxv * sizeof *tiovs) : 0;
+	if (!files || !streams || !res || !tails ||
+	    (job->tail_prefetch && !tiovs)) {
+		free(files);
+		free(streams);
+		free(res);
+		free(tails);
+		free(tiovs);
+		return (errno = ENOMEM), -1;
+	}
+
+	size_t i = 0;
+	while (i < n) {
+		/* Pick next batch of entries, worth to probe, while
+		 * their devices have slots for them */
+		unsigned nb = 0, j;
+		for (; i < n && nb < batch; ++i) {
+			if (entries[i]->filetype == fmdft_directory ||
+			    entries[i]->stat.st_size < FMDP_MIN_PROBED(job))
+				continue;
+			if (fmdp_sched_begin(job, entries[i]->stat.st_dev) != 0)
+				break;
+			files[nb++] = entries[i];
+		}
+
+		/* 1st round: open them all */
+		for (j = 0; j < nb; ++j) {
+			struct io_uring_sqe *sqe = fmdp_ring_sqe(ring, j);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = dirfd;
+			sqe->addr = (unsigned long)(dirfd != AT_FDCWD ?
+						    files[j]->name :
+						    files[j]->path);
+			sqe->open_flags = O_RDONLY | O_CLOEXEC;
+			if (FMDP_COLD(job))
+				sqe->open_flags |= O_NOATIME;
+		}
+		/* Give up on the ring, if it fails; files opened read for
+		 * themselves, the rest are probed as usual */
+		int unopened = 0, lost = 0;
+		if (fmdp_ring_run(ring, res) != 0) {
+			job->log(job, job->location, fmdlt_oserr, "%s: %s",
+				 "io_uring_enter", strerror(errno));
+			lost = fmdp_uring_broken(job);
+			ring = 0;
+			unopened = 1;
+		}
+
+		/* 2nd round: read 1st page of each opened file, and its
+		 * tail, if asked to, into its cache pages */
+		unsigned nr = 0;
+		for (j = 0; j < nb; ++j) {
+			struct FmdFile *file = files[j];
+			tails[j] = -1;
+			if (unopened && res[j] == -ECANCELED)
+				continue;
+			if (res[j] == -EPERM && FMDP_COLD(job)) {
+				/* Not the owner, so without O_NOATIME */
+				res[j] = fmdp_openat(job, dirfd,
+						     dirfd != AT_FDCWD ?
+						     file->name : file->path,
+						     O_RDONLY | O_CLOEXEC);
+				if (res[j] == -1)
+					res[j] = -errno;
+			}
+			if (res[j] < 0) {
+				job->log(job, file->path, fmdlt_oserr,
+					 "%s(%s): %s", "openat", file->path,
+					 strerror(-res[j]));
+				continue;
+			}
+			++job->n_filopens;
+			/* Mapped ones need no read, see fmdp_open_file() */
+			if (fmdp_mmap_worth(job, file) &&
+			    (streams[j] = fmdp_mmap_stream_create(job, file,
+								  res[j])))
+				continue;
+			streams[j] = fmdp_file_stream_create(job, file, res[j]);
+			if (!streams[j]) {
+				close(res[j]);
+				continue;
+			}
+			if (!ring)
+				continue;
+			/* Read right into the 1st cache page; header alone
+			 * is read to tell the type, see fmdsf_typeonly */
+			struct FmdStream *uncached = streams[j];
+			if (!FMDP_TYPEONLY(job))
+				streams[j] = fmdp_cache_stream(uncached);
+			size_t len = FMDP_TYPEONLY(job) ? FMDP_TYPE_HEADER_SZ :
+				FMDP_READ_PAGE_SZ;
+			if (streams[j] != uncached &&
+			    len > fmdp_cache_page_sz(job))
+				len = fmdp_cache_page_sz(job);
+			if ((off_t)len > file->stat.st_size)
+				len = (size_t)file->stat.st_size;
+			uint8_t *buf = fmdp_stream_fill(streams[j], 0, len);
+			if (!buf) {
+				/* Let it read for itself */
+				fmdp_probe_opened(job, streams[j]);
+				streams[j] = 0;
+				continue;
+			}
+			struct io_uring_sqe *sqe = fmdp_ring_sqe(ring, j);
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = res[j];
+			sqe->addr = (unsigned long)buf;
+			sqe->len = (unsigned)len;
+			sqe->off = 0;
+			++nr;
+
+			const off_t toffs = fmdp_tail_offs(job, file);
+			if (toffs == -1 ||
+			    streams[j] == uncached ||
+			    2 * nb > depth)
+				continue;
+			struct iovec *iov = tiovs + j * maxv;
+			const off_t psz = (off_t)fmdp_cache_page_sz(job);
+			const off_t size = file->stat.st_size;
+			unsigned v = 0;
+			off_t o, end;
+			for (o = toffs; o < size; o = end) {
+				end = o - o % psz + psz;
+				if (end > size)
+					end = size;
+				iov[v].iov_len = (size_t)(end - o);
+				iov[v].iov_base = fmdp_stream_fill(streams[j], o,
+								   iov[v].iov_len);
+				++v;
+			}
+			sqe = fmdp_ring_sqe(ring, nb + j);
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = res[j];
+			sqe->addr = (unsigned long)iov;
+			sqe->len = v;
+			sqe->off = (uint64_t)toffs;
+			tails[j] = toffs;
+			++nr;
+		}
+		if (nr && fmdp_ring_run(ring, res) != 0) {
+			/* Streams will have to read what failed themselves */
+			job->log(job, job->location, fmdlt_oserr, "%s: %s",
+				 "io_uring_enter", strerror(errno));
+			lost = fmdp_uring_broken(job);
+			ring = 0;
+		}
+		if (nr) {
+			for (j = 0; j < nb; ++j) {
+				if (!streams[j] || fmdp_stream_mapped(streams[j]))
+					continue;
+				if (lost && (res[j] == -ECANCELED ||
+					     (tails[j] != -1 &&
+					      res[nb + j] == -ECANCELED))) {
+					/* Kernel could yet read into its
+					 * pages; these are written off, and
+					 * the file is read anew below */
+					job->log(job, files[j]->path,
+						 fmdlt_oserr, "%s(%s): %s",
+						 "read", files[j]->path,
+						 strerror(ECANCELED));
+					fmdp_stream_abandon(streams[j]);
+					streams[j] = 0;
+					res[j] = -EINPROGRESS;
+					continue;
+				}
+				if (res[j] < 0) {
+					fmdp_stream_fill(streams[j], 0, 0);
+				} else {
+					fmdp_stream_fill(streams[j], 0, res[j]);
+					fmdp_stream_count_read(streams[j],
+							       (size_t)res[j]);
+				}
+				if (tails[j] == -1)
+					continue;
+				const int tres = res[nb + j];
+				const struct iovec *iov = tiovs + j * maxv;
+				size_t left = tres < 0 ? 0 : (size_t)tres;
+				off_t o;
+				for (o = tails[j]; o < files[j]->stat.st_size;
+				     o += (off_t)(iov++)->iov_len) {
+					const size_t got = left < iov->iov_len ?
+						left : iov->iov_len;
+					fmdp_stream_fill(streams[j], o, got);
+					left -= got;
+				}
+				if (tres >= 0)
+					fmdp_stream_count_read(streams[j],
+							       (size_t)tres);
+			}
+		}
+
+		/* Probe with data at hand */
+		for (j = 0; j < nb; ++j) {
+			if (!streams[j])
+				continue;
+			fmdp_probe_opened(job, streams[j]);
+			streams[j] = 0;
+		}
+		for (j = 0; j < nb; ++j)
+			fmdp_sched_end(job, files[j]->stat.st_dev);
+
+		if (!ring) {
+			/* Probe the rest as usual */
+			for (j = 0; j < nb; ++j)
+				if ((unopened && res[j] == -ECANCELED) ||
+				    res[j] == -EINPROGRESS)
+					fmdp_probe_file(job, dirfd, files[j]);
+			for (; i < n; ++i)
+				if (entries[i]->filetype != fmdft_directory)
+					fmdp_probe_file(job, dirfd, entries[i]);
+			break;
+		}
+	}
+
+	free(files);
+	free(streams);
+	free(res);
+	free(tails);
+	free(tiovs);
+	return 0;
+}
+
+#else  /* !__linux__ */
+
+void
+fmdp_uring_free(struct FmdPriv *priv)
+{
+	(void)priv;
+}
+
+int
+fmdp_uring_ready(struct FmdScanJob *job)
+{
+	(void)job;
+	return 0;
+}
+
+int
+fmdp_uring_stat(struct FmdScanJob *job,
+		int dirfd,
+		struct FmdDirList *list,
+		size_t *pfrom)
+{
+	(void)job; (void)dirfd; (void)list; (void)pfrom;
+	return (errno = ENOSYS), -1;
+}
+
+int
+fmdp_uring_probe(struct FmdScanJob *job,
+		 int dirfd,
+		 struct FmdFile **entries,
+		 size_t n)
+{
+	(void)job; (void)dirfd; (void)entries; (void)n;
+	return (errno = ENOSYS), -1;
+}
+
+#endif /* __linux__ */
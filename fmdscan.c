@@ -2,6 +2,7 @@
 #include <err.h>
 #include <getopt.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 #include "fmd.h"
@@ -9,7 +10,34 @@
 static void
 usage(void)
 {
-	puts("usage: fmdscan [-amr] <path>");
+	puts("usage: fmdscan [-AaDHiLlmNnprsT] [-b min] [-B max] [-c cache] [-C bytes]\n"
+	     "               [-e elem,...] [-E glob] [-I glob] [-j threads]\n"
+	     "               [-M bytes] [-o iops] [-O order] [-P pages] [-q depth]\n"
+	     "               [-S bytes] [-t bytes] [-u depth] [-w bytes] [-x glob]\n"
+	     "               [-z min] [-Z max] <path>");
+}
+
+
+/* Returns mask of elements named in comma-separated |list| */
+static unsigned long
+parse_elements(const char *list)
+{
+	unsigned long mask = 0;
+	while (*list) {
+		const size_t len = strcspn(list, ",");
+		int t;
+		for (t = 0; t <= fmdet_digest; ++t)
+			if (strlen(fmd_elemtype[t]) == len &&
+			    memcmp(fmd_elemtype[t], list, len) == 0)
+				break;
+		if (t > fmdet_digest)
+			errx(EX_USAGE, "%.*s: unknown element", (int)len, list);
+		mask |= 1UL << t;
+		list += len;
+		if (*list == ',')
+			++list;
+	}
+	return mask;
 }
 
 
@@ -53,16 +81,73 @@ finish_hook(struct FmdScanJob *job, struct FmdFile *file)
 	return 0;
 }
 
+static int
+consume_hook(struct FmdScanJob *job, struct FmdFile *file)
+{
+	assert(job); (void)job;
+	assert(file);
+	fmd_print_file(file, 1, stdout);
+	return 0;
+}
+
 
 int
 main(int argc, char *argv[])
 {
-	int a_flag = 0, r_flag = 0, m_flag = 0, opt;
-	while ((opt = getopt(argc, argv, "armh")) != -1)
+	int a_flag = 0, l_flag = 0, p_flag = 0, r_flag = 0, m_flag = 0;
+	int s_flag = 0, A_flag = 0, n_flag = 0, D_flag = 0, i_flag = 0, opt;
+	int N_flag = 0, T_flag = 0, H_flag = 0, L_flag = 0;
+	unsigned threads = 0, uring_depth = 0, probe_order = 0;
+	const char *cache_path = 0;
+	off_t mmap_min = 0;
+	size_t tail_prefetch = 0, read_min = 0, read_max = 0;
+	size_t cache_pages = 0, cache_page_sz = 0, buffer_cap = 0;
+	struct FmdDevLimits dev_limits = { 0, 0, 0 };
+	/* Patterns of -I, -E and -x, each list null-terminated */
+	const char **include = (const char**)calloc(argc, sizeof *include);
+	const char **exclude = (const char**)calloc(argc, sizeof *exclude);
+	const char **prune = (const char**)calloc(argc, sizeof *prune);
+	size_t n_include = 0, n_exclude = 0, n_prune = 0;
+	off_t size_min = 0, size_max = 0;
+	unsigned long elements = 0;
+	if (!include || !exclude || !prune)
+		err(EX_OSERR, "calloc");
+	while ((opt = getopt(argc, argv, "AaDHiLlNnprmsTb:B:c:C:e:E:I:j:M:o:O:P:q:S:t:u:w:x:z:Z:h")) != -1)
 		switch (opt) {
+		case 'A': A_flag = 1; break;
 		case 'a': a_flag = 1; break;
+		case 'D': D_flag = 1; break;
+		case 'H': H_flag = 1; break;
+		case 'i': i_flag = 1; break;
+		case 'L': L_flag = 1; break;
+		case 'n': n_flag = 1; break;
+		case 'N': N_flag = 1; break;
+		case 'T': T_flag = 1; break;
+		case 'l': l_flag = 1; break;
+		case 'p': p_flag = 1; break;
+		case 's': s_flag = 1; break;
 		case 'r': r_flag = 1; break;
 		case 'm': m_flag = 1; break;
+		case 'b': read_min = (size_t)strtoul(optarg, 0, 0); break;
+		case 'B': read_max = (size_t)strtoul(optarg, 0, 0); break;
+		case 'c': cache_path = optarg; break;
+		case 'j': threads = (unsigned)atoi(optarg); break;
+		case 'C': buffer_cap = (size_t)strtoul(optarg, 0, 0); break;
+		case 'e': elements = parse_elements(optarg); break;
+		case 'E': exclude[n_exclude++] = optarg; break;
+		case 'I': include[n_include++] = optarg; break;
+		case 'M': mmap_min = (off_t)strtoll(optarg, 0, 0); break;
+		case 'o': dev_limits.iops = (unsigned)atoi(optarg); break;
+		case 'O': probe_order = (unsigned)atoi(optarg); break;
+		case 'q': dev_limits.depth = (unsigned)atoi(optarg); break;
+		case 'w': dev_limits.bandwidth = (size_t)strtoul(optarg, 0, 0); break;
+		case 'x': prune[n_prune++] = optarg; break;
+		case 'z': size_min = (off_t)strtoll(optarg, 0, 0); break;
+		case 'Z': size_max = (off_t)strtoll(optarg, 0, 0); break;
+		case 'P': cache_pages = (size_t)strtoul(optarg, 0, 0); break;
+		case 'S': cache_page_sz = (size_t)strtoul(optarg, 0, 0); break;
+		case 't': tail_prefetch = (size_t)strtoul(optarg, 0, 0); break;
+		case 'u': uring_depth = (unsigned)atoi(optarg); break;
 		case 'h': usage(); return 0;
 		case '?': return EX_USAGE;
 		}
@@ -76,12 +161,54 @@ main(int argc, char *argv[])
 	job.log = &log_hook;
 	job.begin = &begin_hook;
 	job.finish = &finish_hook;
+	if (s_flag)
+		job.consume = &consume_hook;
+	job.threads = threads;
+	job.uring_depth = uring_depth;
+	job.probe_order = probe_order;
+	job.mmap_min = mmap_min;
+	job.tail_prefetch = tail_prefetch;
+	job.read_min = read_min;
+	job.read_max = read_max;
+	job.cache_pages = cache_pages;
+	job.cache_page_sz = cache_page_sz;
+	job.buffer_cap = buffer_cap;
+	job.dev_limits = dev_limits;
+	job.include = n_include ? include : 0;
+	job.exclude = n_exclude ? exclude : 0;
+	job.prune = n_prune ? prune : 0;
+	job.size_min = size_min;
+	job.size_max = size_max;
+	job.elements = elements;
+	if (cache_path && !(job.cache = fmd_cache_open(cache_path)))
+		err(EX_OSERR, "%s", cache_path);
 
-	job.flags = fmdsf_single | fmdsf_metadata;
+	/* Probe in full, or only tell file types, or only stat */
+	job.flags = fmdsf_single;
+	if (!N_flag)
+		job.flags |= fmdsf_metadata;
+	if (T_flag)
+		job.flags |= fmdsf_typeonly;
+	if (H_flag)
+		job.flags |= fmdsf_hash;
 	if (a_flag)
 		job.flags |= fmdsf_archives;
 	if (r_flag)
 		job.flags |= fmdsf_recursive;
+	if (l_flag)
+		job.flags |= fmdsf_lazystat;
+	if (p_flag)
+		job.flags |= fmdsf_prune;
+	if (A_flag)
+		job.flags |= fmdsf_arena;
+	if (n_flag)
+		job.flags |= fmdsf_cold;
+	if (D_flag)
+		job.flags |= fmdsf_direct;
+	if (i_flag)
+		job.flags |= fmdsf_idleio;
+	if (L_flag)
+		job.flags |= fmdsf_links;
 	int i;
 	for (i = 0; i < argc; ++i) {
 		job.location = argv[i];
@@ -92,8 +219,11 @@ main(int argc, char *argv[])
 		for (it = job.first_file; it; it = it->next)
 			fmd_print_file(it, 1, stdout);
 		fmd_free_chain(job.first_file);
+		fmd_free_arena(&job);
 		job.first_file = 0;
 	}
+	if (job.cache && fmd_cache_close(job.cache) != 0)
+		warn("%s", cache_path);
 
 	if (m_flag) {
 		fprintf(stderr, "libfmd Metrics/Statistics:\n");
@@ -101,6 +231,10 @@ main(int argc, char *argv[])
 			(unsigned long)job.n_filopens);
 		fprintf(stderr, "  * %lu directories opened\n",
 			(unsigned long)job.n_diropens);
+		fprintf(stderr, "  * %lu files stat'ed\n",
+			(unsigned long)job.n_stats);
+		fprintf(stderr, "  * %lu files mapped\n",
+			(unsigned long)job.n_mmaps);
 		fprintf(stderr, "  * %lu physical reads\n",
 			(unsigned long)job.n_physreads);
 		fprintf(stderr, "  * %lu logical reads\n",
@@ -109,6 +243,22 @@ main(int argc, char *argv[])
 			job.v_physreads / 1024.0 / 1024.0);
 		fprintf(stderr, "  * %.3f logical MB read\n",
 			job.v_logreads / 1024.0 / 1024.0);
+		fprintf(stderr, "  * %.2f logical/physical read ratio\n",
+			job.v_physreads ?
+			(double)job.v_logreads / job.v_physreads : 0.0);
+		fprintf(stderr, "  * %.3f MB peak buffer memory\n",
+			job.v_bufpeak / 1024.0 / 1024.0);
+		fprintf(stderr, "  * %.3f MB kept out of page cache\n",
+			job.v_uncached / 1024.0 / 1024.0);
+		fprintf(stderr, "  * %.3f MB hashed\n",
+			job.v_hashed / 1024.0 / 1024.0);
+		fprintf(stderr, "  * %.3f physical MB read for hashing\n",
+			job.v_hashreads / 1024.0 / 1024.0);
+		fprintf(stderr, "  * %.1f MB/s hashing throughput\n",
+			job.t_hash > 0 ?
+			job.v_hashed / 1024.0 / 1024.0 / job.t_hash : 0.0);
+		fprintf(stderr, "  * %lu hard links filled from another\n",
+			(unsigned long)job.n_linkhits);
 		size_t n = job.n_cachehits + job.n_cachemisses;
 		fprintf(stderr, "  * %lu cache hits (%.2f%%)\n",
 			(unsigned long)job.n_cachehits,
@@ -116,7 +266,23 @@ main(int argc, char *argv[])
 		fprintf(stderr, "  * %lu cache misses (%.2f%%)\n",
 			(unsigned long)job.n_cachemisses,
 			job.n_cachemisses * 100.0 / n);
+		if (job.cache) {
+			n = job.n_pcachehits + job.n_pcachemisses;
+			fprintf(stderr, "  * %lu probe cache hits (%.2f%%)\n",
+				(unsigned long)job.n_pcachehits,
+				job.n_pcachehits * 100.0 / n);
+			fprintf(stderr, "  * %lu probe cache misses (%.2f%%)\n",
+				(unsigned long)job.n_pcachemisses,
+				job.n_pcachemisses * 100.0 / n);
+			fprintf(stderr, "  * %lu directory snapshots used\n",
+				(unsigned long)job.n_snaphits);
+			fprintf(stderr, "  * %lu directories read\n",
+				(unsigned long)job.n_snapmisses);
+		}
 	}
 
+	free(include);
+	free(exclude);
+	free(prune);
 	return 0;
 }